@@ -1,7 +1,7 @@
 /**
  * Provided code for particle system simulator.
  * This code provides the mouse interface for clicking and dragging particles, and the
- * code to draw the system.  When the simulator is running system.advanceTime is called
+ * code to draw the system.  When the simulator is running system.advance is called
  * to numerically integrate the system forward.
  * @author kry
  */
@@ -25,6 +25,8 @@
 #include "Text.hpp"
 
 #include "ParticleSystem.hpp"
+#include "Benchmark.hpp"
+#include "SceneIO.hpp"
 
 using namespace std;
 
@@ -35,11 +37,15 @@ Midpoint* midpoint = new Midpoint();
 ModifiedMidpoint* modifiedMidpoint = new ModifiedMidpoint();
 RK4* rk4 = new RK4();
 SymplecticEuler* symplecticEuler = new SymplecticEuler();
+MultiRate* multiRate = new MultiRate();
 
 bool run = false;
 float stepsize = 0.05;
 int substeps = 1;
 
+// names of the implicit integrators' linear solvers, in the order of ParticleSystem::LinearSolver
+const char* linearSolverNames[] = { "CG", "LDLT", "automatic" };
+
 // parameters for interacting with particles
 float maxDist = 150;
 float minDist = 50;
@@ -64,6 +70,8 @@ bool closeToParticlePairLine = false;
 // for openGL
 GLFWwindow* window; // Main application window
 string RES_DIR = ""; // Where data files live
+string SCENE_FILE = ""; // Optional scene to load at startup
+string CACHE_DIR = ""; // Optional directory for binary copies of text scenes
 shared_ptr<Program> progIM; // immediate mode
 
 /** Finds the two closest particles for showing potential spring connections */
@@ -95,9 +103,7 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
     } else if ( key == GLFW_KEY_SPACE) {
         run = !run;
     } else if (key == GLFW_KEY_S) {
-        for (int i = 0; i < substeps; i++) {
-            particleSystem.advanceTime(stepsize / substeps);
-        }
+        particleSystem.advance(stepsize, substeps);
     } else if (key == GLFW_KEY_R) {
         particleSystem.resetParticles();
     } else if (key == GLFW_KEY_C) {
@@ -107,6 +113,63 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
     } else if (key == GLFW_KEY_T) {
         particleSystem.useGravity = !particleSystem.useGravity;
         cout << "Toggling gravity, now " << particleSystem.useGravity << endl;
+    } else if (key == GLFW_KEY_O) {
+        const char* names[] = { "none", "Morton", "reverse Cuthill-McKee", "graph partition" };
+        particleSystem.reorderMethod = (ParticleSystem::ReorderMethod)((particleSystem.reorderMethod + 1) % 4);
+        particleSystem.reorderParticles();
+        cout << "Particle reordering: " << names[particleSystem.reorderMethod] << endl;
+    } else if (key == GLFW_KEY_L) {
+        if (particleSystem.colliders.empty()) {
+            particleSystem.colliders.load(RES_DIR + "obstacles.txt");
+        } else {
+            particleSystem.colliders.clear();
+        }
+        cout << "Obstacle segments: " << particleSystem.colliders.segments.size() << endl;
+    } else if (key == GLFW_KEY_X) {
+        particleSystem.breakingStrain = particleSystem.breakingStrain > 0 ? 0 : 0.5f;
+        cout << "Breaking strain, now " << particleSystem.breakingStrain << endl;
+    } else if (key == GLFW_KEY_D) {
+        particleSystem.diagnostics.enabled = !particleSystem.diagnostics.enabled;
+        particleSystem.diagnostics.clear();
+        cout << "Toggling diagnostics, now " << particleSystem.diagnostics.enabled << endl;
+    } else if (key == GLFW_KEY_E) {
+        if (particleSystem.diagnostics.writeCSV("diagnostics.csv")) {
+            cout << "Wrote " << particleSystem.diagnostics.size() << " diagnostics samples to diagnostics.csv" << endl;
+        }
+    } else if (key == GLFW_KEY_W) {
+        particleSystem.useNewton = !particleSystem.useNewton;
+        cout << "Toggling Newton iterations for backward Euler, now " << particleSystem.useNewton << endl;
+    } else if (key == GLFW_KEY_F) {
+        particleSystem.useFusedSymplecticEuler = !particleSystem.useFusedSymplecticEuler;
+        cout << "Toggling fused symplectic Euler, now " << particleSystem.useFusedSymplecticEuler << endl;
+    } else if (key == GLFW_KEY_M) {
+        particleSystem.automaticStepping = false;
+        particleSystem.useExplicitIntegration = true;
+        particleSystem.integrator = multiRate;
+        cout << particleSystem.integrator->getName() << endl;
+    } else if (key == GLFW_KEY_I) {
+        particleSystem.useSleeping = !particleSystem.useSleeping;
+        cout << "Toggling sleeping islands, now " << particleSystem.useSleeping << endl;
+    } else if (key == GLFW_KEY_A) {
+        particleSystem.automaticStepping = !particleSystem.automaticStepping;
+        cout << "Toggling automatic integrator and substep selection, now " << particleSystem.automaticStepping << endl;
+    } else if (key == GLFW_KEY_U) {
+        // cycle through the built in loops and each backend
+        const vector<Backend*>& backends = Backends::all();
+        auto it = find(backends.begin(), backends.end(), particleSystem.backend);
+        if (particleSystem.backend == NULL) {
+            particleSystem.backend = backends[0];
+        } else {
+            particleSystem.backend = it + 1 == backends.end() ? NULL : *(it + 1);
+        }
+        cout << "Backend: " << (particleSystem.backend ? particleSystem.backend->getName() : "built in") << endl;
+    } else if (key == GLFW_KEY_J) {
+        // cycle through conjugate gradients, the direct solver, and the automatic choice
+        particleSystem.linearSolver = (ParticleSystem::LinearSolver) ((particleSystem.linearSolver + 1) % 3);
+        cout << "Linear solver: " << linearSolverNames[particleSystem.linearSolver] << endl;
+    } else if (key == GLFW_KEY_P) {
+        particleSystem.useMatrixFree = !particleSystem.useMatrixFree;
+        cout << "Matrix free implicit solves (with a backend, without bending) = " << particleSystem.useMatrixFree << endl;
     }
     if (mods & GLFW_MOD_SHIFT) {
         if (key == GLFW_KEY_1) {
@@ -117,6 +180,9 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
             particleSystem.createSystem(3);
         }
     } else {
+        if (key >= GLFW_KEY_0 && key <= GLFW_KEY_9) {
+            particleSystem.automaticStepping = false;
+        }
         if (key == GLFW_KEY_1) {
             particleSystem.useExplicitIntegration = true;
             particleSystem.integrator = forwardEuler;
@@ -139,18 +205,38 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
             cout << particleSystem.integrator->getName() << endl;
         } else if (key == GLFW_KEY_6) {
             particleSystem.useExplicitIntegration = false;
+            particleSystem.implicitSolver = ParticleSystem::BACKWARD_EULER;
             cout << "Implicit integration (backward Euler)" << endl;
+        } else if (key == GLFW_KEY_7) {
+            particleSystem.useExplicitIntegration = false;
+            particleSystem.implicitSolver = ParticleSystem::XPBD;
+            cout << "XPBD (" << particleSystem.solverIterations << " iterations)" << endl;
+        } else if (key == GLFW_KEY_8) {
+            particleSystem.useExplicitIntegration = false;
+            particleSystem.implicitSolver = ParticleSystem::PROJECTIVE_DYNAMICS;
+            cout << "Projective dynamics (" << particleSystem.projectiveDynamicsIterations << " iterations), ignores spring damping and bending" << endl;
+        } else if (key == GLFW_KEY_9) {
+            particleSystem.useExplicitIntegration = false;
+            particleSystem.implicitSolver = ParticleSystem::IMPLICIT_MIDPOINT;
+            cout << "Implicit integration (linearized implicit midpoint)" << endl;
+        } else if (key == GLFW_KEY_0) {
+            particleSystem.useExplicitIntegration = false;
+            particleSystem.implicitSolver = ParticleSystem::BDF2;
+            cout << "Implicit integration (BDF2)" << endl;
         }
     }
     if (key == GLFW_KEY_DELETE) {
         findCloseParticles(xcurrent, ycurrent);
         if (p1 != NULL && d1 < grabThresh) {
             particleSystem.remove(p1);
+            p1 = NULL;
+            p2 = NULL;
         }
     } else if (key == GLFW_KEY_Z) {
         for (Particle* p : particleSystem.particles) {
             p->v = glm::vec2(0, 0);
         }
+        particleSystem.stateChanged();
     } else if (key == GLFW_KEY_UP) {
         substeps++;
     } else if (key == GLFW_KEY_DOWN) {
@@ -168,6 +254,8 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
         cout << "k = " << (particleSystem.springStiffness *= scale) << endl;
     } else if (key == GLFW_KEY_B) {
         cout << "b = " << (particleSystem.springDamping *= scale) << endl;
+    } else if (key == GLFW_KEY_N) {
+        cout << "bending stiffness = " << (particleSystem.bendingStiffness *= scale) << endl;
     }
 
 
@@ -220,6 +308,7 @@ void mouse_callback(GLFWwindow* window, int button, int action, int mods) {
             if (p1 != NULL && d1 < grabThresh) {
                 wasPinned = p1->pinned;
                 p1->pinned = true;
+                particleSystem.wake(p1);
                 grabbed = true;
                 p1->p = glm::vec2(xcurrent, ycurrent);
                 p1->v = glm::vec2(0, 0);
@@ -286,8 +375,10 @@ static void init() {
     glDisable(GL_DEPTH_TEST);
     particleSystem.init();
     
-    particleSystem.integrator = forwardEuler;
-    particleSystem.createSystem(1);
+    particleSystem.integrator = symplecticEuler;
+    if (SCENE_FILE.empty() || !SceneIO::load(particleSystem, SCENE_FILE, CACHE_DIR)) {
+        particleSystem.createSystem(1);
+    }
 
     // If there were any OpenGL errors, this will print something.
     // You can intersperse this line in your code to find the exact location
@@ -311,9 +402,7 @@ void display() {
     // set up projection for drawing in pixel units...
 
     if (run) {
-        for (int i = 0; i < substeps; i++) {
-            particleSystem.advanceTime(stepsize / substeps);
-        }
+        particleSystem.advance(stepsize, substeps);
     }
 
     particleSystem.display();
@@ -405,16 +494,62 @@ static void render() {
     progIM->unbind();
 
     stringstream ss;
-    ss << (particleSystem.useExplicitIntegration ? particleSystem.integrator->getName() : "Backward Euler") << "\n";
+    if (particleSystem.automaticStepping) {
+        ss << "Automatic: " << (particleSystem.automaticExplicit ? "symplectic Euler" : "implicit") << " x " 
+            << particleSystem.automaticSubsteps << " (max frequency " << particleSystem.maxFrequency << ")\n";
+    } else if (particleSystem.useExplicitIntegration) {
+        ss << particleSystem.integrator->getName() << "\n";
+        if (particleSystem.integrator == multiRate) {
+            ss << "fast substeps = " << multiRate->fastSubsteps << " (" << particleSystem.fastParticleIndices.size() 
+                << " fast particles)\n";
+        }
+    } else {
+        switch (particleSystem.implicitSolver) {
+        case ParticleSystem::XPBD: ss << "XPBD\n"; break;
+        case ParticleSystem::PROJECTIVE_DYNAMICS: ss << "Projective dynamics (ignores spring damping and bending)\n"; break;
+        case ParticleSystem::IMPLICIT_MIDPOINT: ss << "Implicit midpoint\n"; break;
+        case ParticleSystem::BDF2: ss << "BDF2\n"; break;
+        default: ss << "Backward Euler\n";
+        }
+    }
+    ss << "fused symplectic Euler = " << particleSystem.useFusedSymplecticEuler << "\n";
+    ss << "backend = " << (particleSystem.backend ? particleSystem.backend->getName() : "built in") << "\n";
+    ss << "linear solver = " << linearSolverNames[particleSystem.linearSolver] << " (last solve " 
+        << (particleSystem.usedDirectSolver ? "LDLT" : particleSystem.jacobiansMatrixFree ? "matrix free CG" : "CG")
+        << (particleSystem.usedIslandSolves ? " by island" : "") << ")\n";
     ss << "useGravity = " << particleSystem.useGravity << "\n";
     ss << "gravity = " << particleSystem.gravity << "\n";
     ss << "restitution = " << particleSystem.restitution << "\n";
+    ss << "obstacle segments = " << particleSystem.colliders.segments.size() << "\n";
     ss << "h = " << stepsize << "\n";
     ss << "c = " << particleSystem.viscousDamping << "\n";
     ss << "b = " << particleSystem.springDamping << "\n";
     ss << "k = " << particleSystem.springStiffness << "\n";
+    ss << "spring materials = " << particleSystem.materials.size() << "\n";
+    ss << "bending stiffness = " << particleSystem.bendingStiffness << "\n";
+    ss << "breaking strain = " << particleSystem.breakingStrain << "\n";
     ss << "substeps = " << substeps << "\n";
     ss << "computeTime = " << particleSystem.computeTime << "\n";
+    ss << "force cache hits = " << particleSystem.derivsCache.hits + particleSystem.forceCache.hits << ", Jacobian cache hits = " 
+        << particleSystem.jacobianCache.hits << "\n";
+    if (particleSystem.useSleeping) {
+        ss << "sleeping particles = " << particleSystem.sleepingIndices.size() << "\n";
+    }
+    if (!particleSystem.useExplicitIntegration && particleSystem.implicitSolver == ParticleSystem::BACKWARD_EULER && particleSystem.useNewton) {
+        ss << "Newton iterations = " << particleSystem.newtonIterations << " (" << particleSystem.lineSearchHalvings 
+            << " halvings, " << particleSystem.newtonCGIterations << " CG)\n";
+        ss << "Newton assembly / solve time = " << particleSystem.newtonAssemblyTime << " / " << particleSystem.newtonSolveTime << "\n";
+    }
+    const Diagnostics& diagnostics = particleSystem.diagnostics;
+    if (diagnostics.enabled && diagnostics.size() > 0) {
+        const Diagnostics::Sample& sample = diagnostics.latest();
+        ss << "energy = " << sample.energy() << " (kinetic " << sample.kinetic << ", spring " << sample.spring 
+            << ", bending " << sample.bending << ", gravity " << sample.gravitational << ")\n";
+        ss << "momentum = " << sample.px << ", " << sample.py << "\n";
+        ss << "max strain = " << sample.maxStrain << "\n";
+        ss << "max energy error = " << diagnostics.maxEnergyError << " over " << diagnostics.steps << " steps\n";
+        ss << "compute time x energy error = " << diagnostics.costTimesError() << "\n";
+    }
     string text = ss.str();
     RenderString(projection, modelview, 600, 100, 0.5, text);
 
@@ -423,10 +558,20 @@ static void render() {
 
 int main(int argc, char** argv) {
     if (argc < 2) {
-        cout << "Please specify the resource directory." << endl;
+        cout << "Please specify the resource directory, optionally a scene file and a directory to cache it in, or --benchmark." << endl;
+        return 0;
+    }
+    if (string(argv[1]) == "--benchmark") {
+        Benchmark::runAll();
         return 0;
     }
     RES_DIR = argv[1] + string("/");
+    if (argc > 2) {
+        SCENE_FILE = argv[2];
+    }
+    if (argc > 3) {
+        CACHE_DIR = argv[3];
+    }
 
     // Set error callback.
     glfwSetErrorCallback(error_callback);
@@ -0,0 +1,285 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <functional>
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#ifdef COMP559_TBB
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+#endif
+
+#include "Precision.hpp"
+#include "BlockSparseMatrix.hpp"
+
+/**
+ * Runs the core loops of the simulation: the spring force pass, the integrator
+ * updates, sparse and matrix free products, and wall collisions.  A backend only decides
+ * how to run a number of independent tasks, and the kernels below split their
+ * loops into fixed chunks of indices, one per task.  Because the chunks do not
+ * depend on the backend or the number of threads, and sums are combined in chunk
+ * order, all backends compute exactly the same results.
+ *
+ * The kernels never write to the same entry from two chunks, so the spring force
+ * pass computes each spring's force first, and then gathers the forces of the
+ * springs of each particle, see ParticleSystem::computeBackendForces.
+ * @author kry
+ */
+class Backend {
+public:
+    virtual ~Backend() {}
+
+    virtual std::string getName() = 0;
+
+    /**
+     * Runs task( c ) for every c from 0 to count - 1, in any order and possibly concurrently
+     * @param count
+     * @param task
+     */
+    virtual void run( int count, const std::function<void( int )>& task ) = 0;
+
+    /** Number of loop indices per chunk */
+    static const int grain = 2048;
+
+    /**
+     * Calls body( begin, end ) over chunks of the indices from 0 to n - 1
+     * @param n
+     * @param body
+     */
+    void parallelFor( int n, const std::function<void( int, int )>& body ) {
+        int chunks = ( n + grain - 1 ) / grain;
+        if ( chunks <= 1 ) {
+            if ( n > 0 ) body( 0, n );
+            return;
+        }
+        run( chunks, [&]( int c ) { body( c * grain, std::min( n, ( c + 1 ) * grain ) ); } );
+    }
+
+    /**
+     * Sums body( begin, end ) over chunks of the indices from 0 to n - 1, adding the
+     * chunk sums in order
+     * @param n
+     * @param body
+     * @return the sum
+     */
+    double parallelSum( int n, const std::function<double( int, int )>& body ) {
+        int chunks = ( n + grain - 1 ) / grain;
+        if ( chunks <= 1 ) return n > 0 ? body( 0, n ) : 0;
+        partials.resize( chunks );
+        run( chunks, [&]( int c ) { partials[c] = body( c * grain, std::min( n, ( c + 1 ) * grain ) ); } );
+        double sum = 0;
+        for ( double p : partials ) sum += p;
+        return sum;
+    }
+
+    /**
+     * Computes y += a x
+     */
+    void axpy( Real a, const VectorXr& x, VectorXr& y ) {
+        const Real* px = x.data();
+        Real* py = y.data();
+        parallelFor( x.size(), [=]( int begin, int end ) {
+            for ( int i = begin; i < end; i++ ) py[i] += a * px[i];
+        } );
+    }
+
+    /**
+     * Computes y = x + a y, the conjugate gradient direction update
+     */
+    void xpay( const VectorXr& x, Real a, VectorXr& y ) {
+        const Real* px = x.data();
+        Real* py = y.data();
+        parallelFor( x.size(), [=]( int begin, int end ) {
+            for ( int i = begin; i < end; i++ ) py[i] = px[i] + a * py[i];
+        } );
+    }
+
+    /**
+     * Computes z = x - y, the conjugate gradient residual
+     */
+    void difference( const VectorXr& x, const VectorXr& y, VectorXr& z ) {
+        const Real* px = x.data();
+        const Real* py = y.data();
+        Real* pz = z.data();
+        parallelFor( x.size(), [=]( int begin, int end ) {
+            for ( int i = begin; i < end; i++ ) pz[i] = px[i] - py[i];
+        } );
+    }
+
+    /**
+     * Computes z = x / y entry by entry, the Jacobi preconditioner
+     */
+    void quotient( const VectorXr& x, const VectorXr& y, VectorXr& z ) {
+        const Real* px = x.data();
+        const Real* py = y.data();
+        Real* pz = z.data();
+        parallelFor( x.size(), [=]( int begin, int end ) {
+            for ( int i = begin; i < end; i++ ) pz[i] = px[i] / py[i];
+        } );
+    }
+
+    /**
+     * Computes y = x
+     */
+    void copy( const VectorXr& x, VectorXr& y ) {
+        const Real* px = x.data();
+        Real* py = y.data();
+        parallelFor( x.size(), [=]( int begin, int end ) {
+            std::copy( px + begin, px + end, py + begin );
+        } );
+    }
+
+    /**
+     * @return the dot product of x and y
+     */
+    Real dot( const VectorXr& x, const VectorXr& y ) {
+        const Real* px = x.data();
+        const Real* py = y.data();
+        return parallelSum( x.size(), [=]( int begin, int end ) {
+            double s = 0;
+            for ( int i = begin; i < end; i++ ) s += px[i] * py[i];
+            return s;
+        } );
+    }
+
+    /**
+     * Computes y = A x, by block rows
+     */
+    void multiply( const BlockSparseMatrix& A, const VectorXr& x, VectorXr& y ) {
+        parallelFor( A.rows.size(), [&]( int begin, int end ) { A.multiply( x, y, begin, end ); } );
+    }
+
+    /**
+     * Computes y = A x without assembling A, for a matrix of the form of the spring 
+     * Jacobians and of the implicit system matrix of a mass spring system,
+     *   A = diag( d ) + sum over springs k of ( e_a - e_b ) ( e_a - e_b )^T kron S_k,
+     * where a and b are the particles of spring k and S_k its symmetric 2x2 block.
+     * As in the spring force pass, the first pass computes S_k ( x_a - x_b ) for every
+     * spring, and the second gathers these for every particle in spring order.
+     * @param d diagonal, one entry per particle, or empty for zero
+     * @param S blocks, four entries per spring in row major order
+     * @param ends particle indices, two per spring
+     * @param start start of the incidence entries of each particle, and the end
+     * @param incidence 2 k for springs a particle is the first end of, 2 k + 1 for the second
+     * @param x
+     * @param y
+     */
+    void springMultiply( const VectorXr& d, const VectorXr& S, const std::vector<int>& ends, const std::vector<int>& start, 
+            const std::vector<int>& incidence, const VectorXr& x, VectorXr& y ) {
+        int m = ends.size() / 2;
+        int n = start.size() - 1;
+        if ( springProducts.size() != 2 * m ) springProducts.resize( 2 * m );
+        const Real* pS = S.data();
+        const int* pe = ends.data();
+        const Real* px = x.data();
+        Real* t = springProducts.data();
+        parallelFor( m, [=]( int begin, int end ) {
+            for ( int k = begin; k < end; k++ ) {
+                const Real* B = pS + 4 * k;
+                Real dx = px[2 * pe[2 * k]] - px[2 * pe[2 * k + 1]];
+                Real dy = px[2 * pe[2 * k] + 1] - px[2 * pe[2 * k + 1] + 1];
+                t[2 * k] = B[0] * dx + B[1] * dy;
+                t[2 * k + 1] = B[2] * dx + B[3] * dy;
+            }
+        } );
+        const Real* pd = d.size() > 0 ? d.data() : NULL;
+        const int* ps = start.data();
+        const int* inc = incidence.data();
+        Real* py = y.data();
+        parallelFor( n, [=]( int begin, int end ) {
+            for ( int i = begin; i < end; i++ ) {
+                Real yx = pd != NULL ? pd[i] * px[2 * i] : 0;
+                Real yy = pd != NULL ? pd[i] * px[2 * i + 1] : 0;
+                for ( int q = ps[i]; q < ps[i + 1]; q++ ) {
+                    const Real* tk = t + 2 * ( inc[q] >> 1 );
+                    if ( inc[q] & 1 ) {
+                        yx -= tk[0];
+                        yy -= tk[1];
+                    } else {
+                        yx += tk[0];
+                        yy += tk[1];
+                    }
+                }
+                py[2 * i] = yx;
+                py[2 * i + 1] = yy;
+            }
+        } );
+    }
+
+private:
+    std::vector<double> partials;
+
+    /** Product of each spring's block with the difference of its ends, for springMultiply */
+    VectorXr springProducts;
+};
+
+/**
+ * Runs all tasks in order on the calling thread
+ */
+class SerialBackend : public Backend {
+public:
+    std::string getName() {
+        return "serial";
+    }
+
+    void run( int count, const std::function<void( int )>& task ) {
+        for ( int c = 0; c < count; c++ ) task( c );
+    }
+};
+
+/**
+ * Runs the tasks in an OpenMP parallel loop, serially when built without OpenMP
+ */
+class OpenMPBackend : public Backend {
+public:
+    std::string getName() {
+        return "OpenMP";
+    }
+
+    void run( int count, const std::function<void( int )>& task ) {
+        #pragma omp parallel for schedule(static)
+        for ( int c = 0; c < count; c++ ) task( c );
+    }
+};
+
+#ifdef COMP559_TBB
+/**
+ * Runs the tasks with the Threading Building Blocks work stealing scheduler
+ */
+class TBBBackend : public Backend {
+public:
+    std::string getName() {
+        return "TBB";
+    }
+
+    void run( int count, const std::function<void( int )>& task ) {
+        tbb::parallel_for( tbb::blocked_range<int>( 0, count, 1 ), [&]( const tbb::blocked_range<int>& r ) {
+            for ( int c = r.begin(); c < r.end(); c++ ) task( c );
+        } );
+    }
+};
+#endif
+
+/**
+ * The backends available in this build
+ */
+class Backends {
+public:
+    /**
+     * @return one instance of each backend built in, serial first
+     */
+    static const std::vector<Backend*>& all() {
+        static SerialBackend serial;
+        static OpenMPBackend openMP;
+#ifdef COMP559_TBB
+        static TBBBackend tbb;
+        static std::vector<Backend*> backends = { &serial, &openMP, &tbb };
+#else
+        static std::vector<Backend*> backends = { &serial, &openMP };
+#endif
+        return backends;
+    }
+};
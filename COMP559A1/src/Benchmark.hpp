@@ -0,0 +1,534 @@
+#pragma once
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <algorithm>
+#include <fstream>
+#include <filesystem>
+
+#include "ParticleSystem.hpp"
+#include "DistributedSystem.hpp"
+#include "SceneIO.hpp"
+
+/**
+ * Headless performance benchmarks, run with the --benchmark command line option.
+ * Each benchmark builds its own large scene and prints timings to the console.
+ */
+class Benchmark {
+public:
+    /**
+     * Runs all benchmarks
+     */
+    static void runAll() {
+        particleOrdering();
+        precision();
+        substeps();
+        colliders();
+        springRemoval();
+        multiRate();
+        distributed();
+        backends();
+        stateUpdate();
+        directSolver();
+        sceneLoading();
+    }
+
+    /**
+     * Creates a cloth of nx by ny particles with structural and shear springs.
+     * The particles are created in a random order, much like a scene built by 
+     * clicking, so that particle index has no relation to locality.
+     */
+    static void createCloth( ParticleSystem& system, int nx, int ny, float spacing, unsigned int seed = 0 ) {
+        std::vector<int> cells( nx * ny );
+        for ( int i = 0; i < nx * ny; i++ ) cells[i] = i;
+        std::shuffle( cells.begin(), cells.end(), std::mt19937( seed ) );
+        std::vector<Particle*> grid( nx * ny );
+        for ( int c : cells ) {
+            grid[c] = system.createParticle( 100 + ( c % nx ) * spacing, 100 + ( c / nx ) * spacing, 0, 0 );
+        }
+        for ( int j = 0; j < ny; j++ ) {
+            for ( int i = 0; i < nx; i++ ) {
+                Particle* p = grid[j * nx + i];
+                if ( i + 1 < nx ) system.createSpring( p, grid[j * nx + i + 1] );
+                if ( j + 1 < ny ) system.createSpring( p, grid[( j + 1 ) * nx + i] );
+                if ( i + 1 < nx && j + 1 < ny ) {
+                    system.createSpring( p, grid[( j + 1 ) * nx + i + 1] );
+                    system.createSpring( grid[j * nx + i + 1], grid[( j + 1 ) * nx + i] );
+                }
+            }
+        }
+        for ( int i = 0; i < nx; i++ ) grid[i]->pinned = true;
+    }
+
+    /**
+     * Times a function, returning the average time per call in milliseconds
+     */
+    template <typename F>
+    static double time( int reps, F f ) {
+        f(); // warm up
+        auto start = std::chrono::steady_clock::now();
+        for ( int r = 0; r < reps; r++ ) f();
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        return elapsed.count() / reps;
+    }
+
+    /**
+     * Compares the force computation on a randomly ordered cloth before and after
+     * Morton and reverse Cuthill-McKee reordering.  The average index distance 
+     * between spring endpoints is reported as a proxy for cache misses.
+     */
+    static void particleOrdering() {
+        std::cout << "Particle ordering: force evaluation time (ms) and average spring bandwidth" << std::endl;
+        const char* names[] = { "random", "Morton", "RCM", "domains" };
+        ParticleSystem::ReorderMethod methods[] = { ParticleSystem::NO_REORDERING, ParticleSystem::MORTON, 
+            ParticleSystem::REVERSE_CUTHILL_MCKEE, ParticleSystem::GRAPH_PARTITION };
+        for ( int size : { 100, 300, 600 } ) {
+            for ( int m = 0; m < 4; m++ ) {
+                ParticleSystem system;
+                createCloth( system, size, size, 1 );
+                system.reorderMethod = methods[m];
+                system.reorderParticles();
+                system.gatherState();
+                double ms = time( 20, [&]() { system.computeForces( system.positions, system.velocities, system.forces ); } );
+                std::cout << std::setw( 8 ) << size * size << " particles  " << std::setw( 7 ) << names[m]
+                    << "  " << std::setw( 10 ) << ms << " ms  bandwidth " << ParticleOrdering::averageBandwidth( system.springs ) << std::endl;
+            }
+        }
+    }
+
+    /**
+     * Compares throughput and drift of the fused symplectic Euler update, and of the
+     * StateUpdate combination used by the other explicit integrators, for the three
+     * precision policies.  A large number of particles move ballistically under a 
+     * constant force so that the exact answer is known, and the error is reported as
+     * the largest position error after the run.
+     */
+    static void precision() {
+        std::cout << "Precision: fused symplectic Euler update time (ms) and max position error" << std::endl;
+        precisionRun<SinglePrecision>( "single" );
+        precisionRun<CompensatedSinglePrecision>( "compensated" );
+        precisionRun<DoublePrecision>( "double" );
+        std::cout << "Precision: forward Euler with StateUpdate::combine time (ms) and max position error" << std::endl;
+        combinePrecisionRun<SinglePrecision>( "single" );
+        combinePrecisionRun<CompensatedSinglePrecision>( "compensated" );
+        combinePrecisionRun<DoublePrecision>( "double" );
+    }
+
+    template <typename P>
+    static void precisionRun( const char* name ) {
+        typedef typename P::Scalar Scalar;
+        typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+        const int n = 1 << 16;
+        const int steps = 20000;
+        const double h = 1e-4;
+        Vector x = Vector::Constant( 2 * n, 1000 ), v = Vector::Zero( 2 * n ), f = Vector::Constant( 2 * n, 9.8 );
+        Vector w = Vector::Ones( n ), ex = Vector::Zero( 2 * n ), ev = Vector::Zero( 2 * n );
+        auto start = std::chrono::steady_clock::now();
+        for ( int s = 0; s < steps; s++ ) {
+            SymplecticEuler::update<P>( n, Scalar( h ), x.data(), v.data(), f.data(), w.data(), ex.data(), ev.data() );
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        // symplectic Euler on constant acceleration gives x = x0 + h^2 a N(N+1)/2 exactly
+        double exact = 1000 + h * h * 9.8 * steps * ( steps + 1 ) / 2.0;
+        double err = ( x.template cast<double>().array() - exact ).abs().maxCoeff();
+        std::cout << std::setw( 12 ) << name << "  " << std::setw( 10 ) << elapsed.count() / steps << " ms  error " << err << std::endl;
+    }
+
+    template <typename P>
+    static void combinePrecisionRun( const char* name ) {
+        typedef typename P::Scalar Scalar;
+        typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+        const int n = 1 << 17;
+        const int steps = 20000;
+        const double h = 1e-4;
+        Vector x = Vector::Constant( n, 1000 ), v = Vector::Zero( n ), a = Vector::Constant( n, 9.8 );
+        Vector ex = Vector::Zero( n ), ev = Vector::Zero( n );
+        const Scalar c[] = { Scalar( h ) };
+        const Scalar* dx[] = { v.data() };
+        const Scalar* dv[] = { a.data() };
+        auto start = std::chrono::steady_clock::now();
+        for ( int s = 0; s < steps; s++ ) {
+            StateUpdate::combine<P>( n, x.data(), x.data(), c, dx, ex.data() );
+            StateUpdate::combine<P>( n, v.data(), v.data(), c, dv, ev.data() );
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        // forward Euler on constant acceleration gives x = x0 + h^2 a N(N-1)/2 exactly
+        double exact = 1000 + h * h * 9.8 * steps * ( steps - 1 ) / 2.0;
+        double err = ( x.template cast<double>().array() - exact ).abs().maxCoeff();
+        std::cout << std::setw( 12 ) << name << "  " << std::setw( 10 ) << elapsed.count() / steps << " ms  error " << err << std::endl;
+    }
+
+    /**
+     * Compares 50 substeps taken with one call to advance against 50 calls to 
+     * advanceTime, and against 50 bare fused symplectic Euler steps on the split arrays.
+     */
+    static void substeps() {
+        std::cout << "Substeps: time (ms) for 50 substeps of a 100x100 cloth" << std::endl;
+        SymplecticEuler integrator;
+        ParticleSystem system;
+        system.width = 100000;
+        system.height = 100000;
+        system.integrator = &integrator;
+        createCloth( system, 100, 100, 1 );
+        const int n = 50;
+        double perCall = time( 10, [&]() { for ( int i = 0; i < n; i++ ) system.advanceTime( 0.001f ); } );
+        double batched = time( 10, [&]() { system.advance( 0.001f * n, n ); } );
+        system.gatherState();
+        double bare = time( 10, [&]() { for ( int i = 0; i < n; i++ ) system.stepSymplecticEuler( 0.001f ); } );
+        std::cout << "  advanceTime x " << n << "  " << std::setw( 10 ) << perCall << " ms" << std::endl;
+        std::cout << "  advance( " << n << " )     " << std::setw( 10 ) << batched << " ms" << std::endl;
+        std::cout << "  bare steps x " << n << "  " << std::setw( 10 ) << bare << " ms" << std::endl;
+    }
+
+    /**
+     * Times the parallel swept obstacle query for random particle paths against
+     * random obstacle segments, for increasing particle and obstacle counts.
+     */
+    static void colliders() {
+        std::cout << "Colliders: swept BVH query time (ms)" << std::endl;
+        std::mt19937 rng( 0 );
+        std::uniform_real_distribution<Real> pos( 0, 1000 );
+        std::uniform_real_distribution<Real> step( -5, 5 );
+        for ( int obstacles : { 100, 1000, 10000, 100000 } ) {
+            StaticColliders c;
+            for ( int i = 0; i < obstacles; i++ ) {
+                vec2r a( pos( rng ), pos( rng ) );
+                c.segments.push_back( StaticColliders::Segment{ a, a + vec2r( step( rng ), step( rng ) ) } );
+            }
+            c.build();
+            for ( int particles : { 10000, 100000 } ) {
+                VectorXr x0( 2 * particles ), x( 2 * particles ), v = VectorXr::Zero( 2 * particles ), f = VectorXr::Zero( 2 * particles );
+                VectorXr w = VectorXr::Ones( particles );
+                for ( int i = 0; i < 2 * particles; i++ ) x0[i] = pos( rng );
+                double ms = time( 5, [&]() {
+                    for ( int i = 0; i < 2 * particles; i++ ) x[i] = x0[i] + 3;
+                    c.collide( x0, x, v, f, w, 0 );
+                } );
+                std::cout << std::setw( 8 ) << obstacles << " segments  " << std::setw( 8 ) << particles << " particles  " 
+                    << std::setw( 10 ) << ms << " ms" << std::endl;
+            }
+        }
+    }
+
+    /**
+     * Compares removing a tenth of the springs of a cloth one at a time with
+     * removeSpring against one batch with removeSprings, with the implicit solver
+     * storage and XPBD coloring being kept up to date by both.
+     */
+    static void springRemoval() {
+        std::cout << "Spring removal: time (ms) to remove 10% of the springs" << std::endl;
+        for ( int size : { 50, 100, 150 } ) {
+            double ms[2];
+            for ( int batched = 0; batched < 2; batched++ ) {
+                ParticleSystem system;
+                createCloth( system, size, size, 1 );
+                system.init();
+                std::vector<Spring*> batch;
+                for ( size_t k = 0; k < system.springs.size(); k += 10 ) batch.push_back( system.springs[k] );
+                auto start = std::chrono::steady_clock::now();
+                if ( batched ) {
+                    system.removeSprings( batch );
+                } else {
+                    for ( Spring* s : batch ) system.removeSpring( s );
+                }
+                std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+                ms[batched] = elapsed.count();
+            }
+            std::cout << std::setw( 8 ) << size * size << " particles  one at a time " << std::setw( 10 ) << ms[0] 
+                << " ms  batched " << std::setw( 10 ) << ms[1] << " ms" << std::endl;
+        }
+    }
+
+    /**
+     * Compares symplectic Euler, substepped for the stiffest spring, against the
+     * multi-rate integrator on a soft cloth with a short stiff chain hanging from it.
+     * The largest position difference between the two after the run is reported.
+     */
+    static void multiRate() {
+        std::cout << "Multi-rate: time (ms) for half a second of a soft cloth with a stiff chain" << std::endl;
+        SymplecticEuler symplecticEuler;
+        MultiRate multiRate;
+        ParticleSystem systems[2];
+        for ( ParticleSystem& system : systems ) {
+            system.width = 100000;
+            system.height = 100000;
+            system.springStiffness = 100;
+            createCloth( system, 100, 100, 10 );
+            int stiff = system.addMaterial( 1000, 1 );
+            Particle* p = system.particles[0];
+            for ( Particle* q : system.particles ) {
+                if ( q->p.y > p->p.y ) p = q;
+            }
+            for ( int i = 0; i < 10; i++ ) {
+                Particle* q = system.createParticle( p->p.x, p->p.y + 10, 0, 0 );
+                system.createSpring( p, q, stiff );
+                p = q;
+            }
+        }
+        systems[0].useFusedSymplecticEuler = false;
+        systems[0].integrator = &symplecticEuler;
+        systems[1].integrator = &multiRate;
+        int substeps = std::ceil( systems[0].estimateMaxFrequency() * 0.01 / ( 2 * systems[0].stabilityMargin ) );
+        double ms[2];
+        ms[0] = time( 1, [&]() { for ( int i = 0; i < 50; i++ ) systems[0].advance( 0.01f, substeps ); } );
+        ms[1] = time( 1, [&]() { for ( int i = 0; i < 50; i++ ) systems[1].advance( 0.01f, 1 ); } );
+        Real diff = 0;
+        for ( size_t i = 0; i < systems[0].particles.size(); i++ ) {
+            diff = std::max( diff, glm::length( systems[0].particles[i]->p - systems[1].particles[i]->p ) );
+        }
+        std::cout << "  symplectic Euler x " << substeps << "  " << std::setw( 10 ) << ms[0] << " ms" << std::endl;
+        std::cout << "  multi-rate x " << multiRate.fastSubsteps << " on " << systems[1].fastParticleIndices.size() 
+            << " particles  " << std::setw( 10 ) << ms[1] << " ms  max difference " << diff << std::endl;
+    }
+
+    /**
+     * Backward Euler steps of a cloth distributed over 1, 2, and 4 ranks, as threads
+     * and as processes.  Strong scaling keeps a 100x100 cloth, and weak scaling grows
+     * the cloth with the number of ranks.  Reports time per step, CG iterations,
+     * bytes sent per step by rank 0, and the max difference from a serial run.
+     */
+    static void distributed() {
+        std::cout << "Distributed: backward Euler time per step (ms) over ranks" << std::endl;
+        SymplecticEuler integrator;
+        ParticleSystem serial;
+        createDistributedCloth( serial, 100, 100, integrator );
+        serial.useExplicitIntegration = false;
+        for ( int i = 0; i < 20; i++ ) serial.advance( 0.01f, 1 );
+        const char* transports[] = { "threads", "processes" };
+        for ( int processes = 0; processes < 2; processes++ ) {
+#ifdef _WIN32
+            if ( processes ) continue;
+#endif
+            std::cout << "  strong scaling, " << transports[processes] << std::endl;
+            for ( int ranks : { 1, 2, 4 } ) distributedRun( processes, ranks, 100, 100, &serial );
+            std::cout << "  weak scaling, " << transports[processes] << std::endl;
+            for ( int ranks : { 1, 2, 4 } ) distributedRun( processes, ranks, 100, 50 * ranks, NULL );
+        }
+    }
+
+    static void createDistributedCloth( ParticleSystem& system, int nx, int ny, SymplecticEuler& integrator ) {
+        system.width = 100000;
+        system.height = 100000;
+        system.integrator = &integrator;
+        system.viscousDamping = 0.1f;
+        createCloth( system, nx, ny, 10 );
+    }
+
+    /**
+     * Runs 20 distributed backward Euler steps of 0.01 and prints the results of rank 0
+     * @param processes true for SocketTransport, false for ThreadTransport
+     * @param ranks
+     * @param nx
+     * @param ny
+     * @param serial the same cloth stepped serially for comparison, or NULL
+     */
+    static void distributedRun( bool processes, int ranks, int nx, int ny, ParticleSystem* serial ) {
+        auto f = [&]( Transport& transport ) {
+            SymplecticEuler integrator;
+            ParticleSystem system;
+            createDistributedCloth( system, nx, ny, integrator );
+            DistributedSystem distributed( system, transport );
+            transport.barrier();
+            size_t bytes = transport.bytesSent;
+            int iterations = 0;
+            auto start = std::chrono::steady_clock::now();
+            for ( int i = 0; i < 20; i++ ) {
+                distributed.stepBackwardEuler( 0.01 );
+                iterations += distributed.iterations;
+            }
+            transport.barrier();
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+            bytes = transport.bytesSent - bytes;
+            distributed.gather( system );
+            if ( transport.rank() != 0 ) return;
+            std::cout << "    " << ranks << " ranks, " << nx << "x" << ny << "  " << std::setw( 10 ) << elapsed.count() / 20 
+                << " ms  " << iterations / 20 << " CG iterations  " << bytes / 20 << " bytes";
+            if ( serial != NULL ) {
+                Real diff = 0;
+                for ( size_t i = 0; i < system.particles.size(); i++ ) {
+                    diff = std::max( diff, glm::length( system.particles[i]->p - serial->particles[i]->p ) );
+                }
+                std::cout << "  max difference " << diff;
+            }
+            std::cout << std::endl;
+        };
+#ifndef _WIN32
+        if ( processes ) {
+            SocketTransport::launch( ranks, f );
+            return;
+        }
+#endif
+        ThreadTransport::run( ranks, f );
+    }
+
+    /**
+     * Compares the built in loops with each backend on a 300x300 cloth, timing the
+     * force pass, the fused symplectic Euler update, the backward Euler matrix product,
+     * the wall collisions, and a whole backward Euler step, and for the backends also
+     * the matrix free product and backward Euler step.
+     */
+    static void backends() {
+        std::cout << "Backends: force, update, product, walls, step, matrix free product and step time (ms)" << std::endl;
+        std::vector<Backend*> backends = Backends::all();
+        backends.insert( backends.begin(), (Backend*) NULL );
+        SymplecticEuler integrator;
+        for ( Backend* backend : backends ) {
+            ParticleSystem system;
+            system.width = 100000;
+            system.height = 100000;
+            system.integrator = &integrator;
+            createCloth( system, 300, 300, 1 );
+            system.reorderMethod = ParticleSystem::REVERSE_CUTHILL_MCKEE;
+            system.reorderParticles();
+            system.backend = backend;
+            system.useExplicitIntegration = false;
+            system.advance( 0.01f, 1 );
+            system.gatherState();
+            VectorXr y( system.velocities.size() );
+            double ms[5];
+            ms[0] = time( 20, [&]() { system.computeForces( system.positions, system.velocities, system.forces ); } );
+            ms[1] = time( 20, [&]() { system.stepSymplecticEuler( 1e-6f ); } );
+            ms[2] = time( 20, [&]() { system.multiply( system.A, system.velocities, y ); } );
+            ms[3] = time( 20, [&]() { system.wallCollisions( system.positions, system.velocities, system.forces ); } );
+            ms[4] = time( 5, [&]() { system.advance( 0.01f, 1 ); } );
+            std::cout << std::setw( 10 ) << ( backend != NULL ? backend->getName() : "built in" );
+            for ( double t : ms ) std::cout << "  " << std::setw( 10 ) << t;
+            if ( backend != NULL ) {
+                system.useMatrixFree = true;
+                system.advance( 0.01f, 1 );
+                double product = time( 20, [&]() { 
+                    backend->springMultiply( system.systemDiagonal, system.springSystem, system.springEnds, 
+                        system.incidenceStart, system.incidence, system.velocities, y ); 
+                } );
+                double step = time( 5, [&]() { system.advance( 0.01f, 1 ); } );
+                std::cout << "  " << std::setw( 10 ) << product << "  " << std::setw( 10 ) << step;
+            }
+            std::cout << std::endl;
+        }
+    }
+
+    /**
+     * Compares the final RK4 combination p + h/6 ( k1 + 2 k2 + 2 k3 + k4 ) done as one
+     * pass per term with the fused StateUpdate kernel, on phase space vectors of
+     * increasing size
+     */
+    static void stateUpdate() {
+        std::cout << "State update: RK4 combination time (ms), one pass per term vs fused" << std::endl;
+        for ( int n : { 1 << 16, 1 << 20, 1 << 23 } ) {
+            VectorXr p = VectorXr::Random( n ), out( n );
+            VectorXr k1 = VectorXr::Random( n ), k2 = VectorXr::Random( n ), k3 = VectorXr::Random( n ), k4 = VectorXr::Random( n );
+            Real h = 0.01f;
+            double passes = time( 10, [&]() {
+                out = p;
+                out += ( h / 6 ) * k1;
+                out += ( h / 3 ) * k2;
+                out += ( h / 3 ) * k3;
+                out += ( h / 6 ) * k4;
+            } );
+            const Real a[] = { h / 6, h / 3, h / 3, h / 6 };
+            const Real* k[] = { k1.data(), k2.data(), k3.data(), k4.data() };
+            double fused = time( 10, [&]() { StateUpdate::combine( n, out.data(), p.data(), a, k ); } );
+            std::cout << std::setw( 10 ) << n << " entries  " << std::setw( 10 ) << passes << " ms  " << std::setw( 10 ) << fused << " ms" << std::endl;
+        }
+    }
+
+    /**
+     * Compares conjugate gradients with the sparse direct solver for backward Euler
+     * steps of stiff cloths of increasing size, reporting the time per step with each
+     * and with the automatic choice once the motion settles, the CG iterations, and 
+     * the time of the first direct step, which includes the ordering and symbolic 
+     * factorization.
+     */
+    static void directSolver() {
+        std::cout << "Direct solver: backward Euler step time (ms) with CG, LDLT, and the automatic choice" << std::endl;
+        SymplecticEuler integrator;
+        ParticleSystem::LinearSolver solvers[] = { ParticleSystem::CONJUGATE_GRADIENT, ParticleSystem::SPARSE_DIRECT, ParticleSystem::AUTOMATIC_LINEAR_SOLVER };
+        for ( float stiffness : { 1e6f, 1e8f } ) {
+            for ( int nx : { 20, 50, 100, 200 } ) {
+                double ms[3];
+                double first = 0;
+                int iterations = 0;
+                bool automaticDirect = false;
+                for ( int s = 0; s < 3; s++ ) {
+                    ParticleSystem system;
+                    system.width = 100000;
+                    system.height = 100000;
+                    system.integrator = &integrator;
+                    createCloth( system, nx, nx, 1 );
+                    system.reorderMethod = ParticleSystem::REVERSE_CUTHILL_MCKEE;
+                    system.reorderParticles();
+                    system.springStiffness = stiffness;
+                    system.solverIterations = 10000;
+                    system.useExplicitIntegration = false;
+                    system.linearSolver = solvers[s];
+                    auto start = std::chrono::steady_clock::now();
+                    system.advance( 0.01f, 1 );
+                    if ( s == 1 ) first = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+                    // let the motion settle, so that the automatic choice has measured the CG iterations again
+                    for ( int i = 0; i < 10; i++ ) system.advance( 0.01f, 1 );
+                    ms[s] = time( 5, [&]() { system.advance( 0.01f, 1 ); } );
+                    if ( s == 0 ) iterations = system.CG.iterations;
+                    if ( s == 2 ) automaticDirect = system.usedDirectSolver;
+                }
+                std::cout << "k " << stiffness << std::setw( 8 ) << 2 * nx * nx << " dofs  CG " << std::setw( 10 ) << ms[0] 
+                    << " ms (" << iterations << " iterations)  LDLT " << std::setw( 10 ) << ms[1] << " ms (first " << first 
+                    << " ms)  automatic " << std::setw( 10 ) << ms[2] << " ms (" << ( automaticDirect ? "LDLT" : "CG" ) << ")" << std::endl;
+            }
+        }
+    }
+
+    /**
+     * Times SceneIO::load on text cloth scenes of up to a million particles and four
+     * million springs, from the text alone, with an empty cache directory, which also
+     * writes the binary copy, and from the cached binary copy.
+     */
+    static void sceneLoading() {
+        std::cout << "Scene loading: load time (ms) from text, with a cold cache, and with a warm cache" << std::endl;
+        std::filesystem::path directory = std::filesystem::temp_directory_path() / "comp559-scene-benchmark";
+        std::filesystem::path cache = directory / "cache";
+        std::filesystem::create_directories( directory );
+        std::string filename = ( directory / "cloth.txt" ).string();
+        for ( int size : { 100, 300, 1000 } ) {
+            writeClothScene( filename, size, size );
+            double ms[3];
+            size_t springs = 0;
+            std::filesystem::remove_all( cache );
+            for ( int run = 0; run < 3; run++ ) {
+                ParticleSystem system;
+                auto start = std::chrono::steady_clock::now();
+                SceneIO::load( system, filename, run == 0 ? "" : cache.string() );
+                ms[run] = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+                springs = system.springs.size();
+            }
+            std::cout << std::setw( 8 ) << size * size << " particles " << std::setw( 8 ) << springs << " springs  text " 
+                << std::setw( 10 ) << ms[0] << " ms  cold cache " << std::setw( 10 ) << ms[1] << " ms  warm cache " 
+                << std::setw( 10 ) << ms[2] << " ms" << std::endl;
+        }
+        std::filesystem::remove_all( directory );
+    }
+
+    /**
+     * Writes a text scene of a cloth of nx by ny particles with structural and shear
+     * springs, the same cloth as createCloth but with the particles in grid order
+     */
+    static void writeClothScene( const std::string& filename, int nx, int ny ) {
+        std::ofstream out( filename );
+        for ( int j = 0; j < ny; j++ ) {
+            for ( int i = 0; i < nx; i++ ) {
+                out << "p " << 100 + i << " " << 100 + j << " 0 0 1 " << ( j == 0 ? 1 : 0 ) << "\n";
+            }
+        }
+        for ( int j = 0; j < ny; j++ ) {
+            for ( int i = 0; i < nx; i++ ) {
+                int p = j * nx + i;
+                if ( i + 1 < nx ) out << "s " << p << " " << p + 1 << "\n";
+                if ( j + 1 < ny ) out << "s " << p << " " << p + nx << "\n";
+                if ( i + 1 < nx && j + 1 < ny ) {
+                    out << "s " << p << " " << p + nx + 1 << "\n";
+                    out << "s " << p + 1 << " " << p + nx << "\n";
+                }
+            }
+        }
+    }
+};
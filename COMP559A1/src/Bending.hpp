@@ -0,0 +1,264 @@
+#pragma once
+#include <cmath>
+#include <algorithm>
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+#include <Eigen/Dense>
+
+#include "Precision.hpp"
+#include "Particle.hpp"
+#include "BlockSparseMatrix.hpp"
+
+/**
+ * Bending element on three consecutive particles of a chain, with energy
+ * E = k/2 (theta - theta0)^2, where theta is the signed angle the chain turns
+ * through at the middle particle, from e1 = x1 - x0 to e2 = x2 - x1.  Damping
+ * acts on the rate of change of the angle.  Elements refer to their particles
+ * by index, so that they can be stored by value in one contiguous array.
+ *
+ * With g(e) = J e / |e|^2 the gradient of the direction angle of e (J rotates
+ * by 90 degrees), the angle gradients are dtheta/dx0 = g(e1), dtheta/dx2 = g(e2),
+ * and dtheta/dx1 = -g(e1) - g(e2).  The stiffness matrix keeps only the term 
+ * k grad grad^T of the energy Hessian and drops ( theta - theta0 ) k times the
+ * Hessian of the angle, which is indefinite whenever the angle is away from rest.
+ * As with the clamped transverse term of the springs, this keeps the implicit 
+ * system matrix positive definite.
+ * @param P precision policy, see Precision.hpp
+ * @author kry
+ */
+template <typename P>
+class BendingElementT {
+public:
+    typedef typename P::Scalar Scalar;
+    typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+    typedef ParticleT<P> Particle;
+    typedef typename Particle::Vec2 Vec2;
+
+    /** Particle indices, the chain bends at i1 */
+    int i0, i1, i2;
+
+    /** Bending stiffness, in force times length per radian */
+    Scalar k = 1;
+    /** Damping of the angle rate */
+    Scalar c = 0;
+    /** Rest angle */
+    Scalar theta0 = 0;
+
+    /**
+     * Creates a bending element with its rest angle set from the initial positions
+     * @param p0
+     * @param p1 the middle particle
+     * @param p2
+     */
+    BendingElementT( Particle* p0, Particle* p1, Particle* p2 ) {
+        i0 = p0->index;
+        i1 = p1->index;
+        i2 = p2->index;
+        Vec2 x[3] = { p0->p0, p1->p0, p2->p0 };
+        Vec2 g[3];
+        theta0 = gradient( x, g );
+    }
+
+    /**
+     * Applies the bending force by adding a force to each particle
+     * @param particles particle list, indexed by the element's indices
+     * @return the angle from the rest angle
+     */
+    Scalar apply( const std::vector<Particle*>& particles ) {
+        Particle* p[3] = { particles[i0], particles[i1], particles[i2] };
+        Vec2 x[3] = { p[0]->p, p[1]->p, p[2]->p };
+        Vec2 v[3] = { p[0]->v, p[1]->v, p[2]->v };
+        Vec2 f[3];
+        Scalar d = force( x, v, f );
+        for ( int a = 0; a < 3; a++ ) p[a]->addForce( f[a] );
+        return d;
+    }
+
+    /**
+     * Computes the force from positions and velocities stored in split arrays
+     * and adds it to the force array, as Spring::addForce does.
+     * @param x positions
+     * @param xd velocities
+     * @param f forces
+     * @return the angle from the rest angle
+     */
+    inline Scalar addForce( const Vector& x, const Vector& xd, Vector& f ) const {
+        int idx[3] = { 2 * i0, 2 * i1, 2 * i2 };
+        Vec2 xs[3], vs[3], fs[3];
+        for ( int a = 0; a < 3; a++ ) {
+            xs[a] = Vec2( x[idx[a]], x[idx[a] + 1] );
+            vs[a] = Vec2( xd[idx[a]], xd[idx[a] + 1] );
+        }
+        Scalar d = force( xs, vs, fs );
+        for ( int a = 0; a < 3; a++ ) {
+            f[idx[a]] += fs[a].x;
+            f[idx[a] + 1] += fs[a].y;
+        }
+        return d;
+    }
+
+    /**
+     * Computes the forces on the three particles without adding them anywhere, for
+     * the parallel force passes which add them to the particles afterwards
+     * @param x positions
+     * @param xd velocities
+     * @param f set to the forces on i0, i1, and i2, x and y interleaved
+     * @return the angle from the rest angle
+     */
+    inline Scalar computeForce( const Vector& x, const Vector& xd, Scalar* f ) const {
+        int idx[3] = { 2 * i0, 2 * i1, 2 * i2 };
+        Vec2 xs[3], vs[3], fs[3];
+        for ( int a = 0; a < 3; a++ ) {
+            xs[a] = Vec2( x[idx[a]], x[idx[a] + 1] );
+            vs[a] = Vec2( xd[idx[a]], xd[idx[a] + 1] );
+        }
+        Scalar d = force( xs, vs, fs );
+        for ( int a = 0; a < 3; a++ ) {
+            f[2 * a] = fs[a].x;
+            f[2 * a + 1] = fs[a].y;
+        }
+        return d;
+    }
+
+    /**
+     * Adds this element's contribution to the stiffness matrix, dfdx = -k grad grad^T,
+     * which is exact at the rest angle.  The blocks between i0 and i2 must be in the
+     * pattern, see ParticleSystem::addBendingPattern.
+     * @param x positions
+     * @param dfdx
+     */
+    void addDfdx( const Vector& x, BlockSparseMatrixT<Scalar>& dfdx ) const {
+        Scalar K[36];
+        if ( stiffnessBlocks( x, K ) ) subtractBlocks( dfdx, K );
+    }
+
+    /**
+     * Adds this element's damping contribution, dfdv = -c grad grad^T
+     * @param x positions
+     * @param dfdv
+     */
+    void addDfdv( const Vector& x, BlockSparseMatrixT<Scalar>& dfdv ) const {
+        Scalar D[36];
+        dampingBlocks( x, D );
+        subtractBlocks( dfdv, D );
+    }
+
+    /**
+     * Computes the nine blocks k grad grad^T that addDfdx subtracts, block (a,b) at 
+     * 4 (3 a + b) in row major order, with a and b numbering i0, i1, and i2, for the
+     * parallel assembly which gathers them by row
+     * @param x positions
+     * @param K set to the blocks, zero if either edge has zero length
+     * @return false if either edge has zero length
+     */
+    bool stiffnessBlocks( const Vector& x, Scalar* K ) const {
+        Vec2 xs[3];
+        load( x, xs );
+        Vec2 e1 = xs[1] - xs[0];
+        Vec2 e2 = xs[2] - xs[1];
+        if ( ( e1.x == 0 && e1.y == 0 ) || ( e2.x == 0 && e2.y == 0 ) ) {
+            std::fill( K, K + 36, Scalar( 0 ) );
+            return false;
+        }
+        Vec2 g[3];
+        gradient( xs, g );
+        for ( int a = 0; a < 3; a++ ) {
+            for ( int b = 0; b < 3; b++ ) {
+                Scalar* m = K + 4 * ( 3 * a + b );
+                m[0] = k * g[a].x * g[b].x;
+                m[1] = k * g[a].x * g[b].y;
+                m[2] = k * g[a].y * g[b].x;
+                m[3] = k * g[a].y * g[b].y;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * Computes the nine blocks c grad grad^T that addDfdv subtracts, laid out as in
+     * stiffnessBlocks
+     * @param x positions
+     * @param D set to the blocks
+     */
+    void dampingBlocks( const Vector& x, Scalar* D ) const {
+        Vec2 xs[3];
+        load( x, xs );
+        Vec2 g[3];
+        gradient( xs, g );
+        for ( int a = 0; a < 3; a++ ) {
+            for ( int b = 0; b < 3; b++ ) {
+                Scalar* m = D + 4 * ( 3 * a + b );
+                m[0] = c * g[a].x * g[b].x;
+                m[1] = c * g[a].x * g[b].y;
+                m[2] = c * g[a].y * g[b].x;
+                m[3] = c * g[a].y * g[b].y;
+            }
+        }
+    }
+
+    /**
+     * Computes the bending angle and its gradient with respect to the three positions
+     * @param x positions of the three particles
+     * @param g set to the gradient, zero if either edge has zero length
+     * @return the angle in (-pi, pi]
+     */
+    static Scalar gradient( const Vec2* x, Vec2* g ) {
+        Vec2 e1 = x[1] - x[0];
+        Vec2 e2 = x[2] - x[1];
+        Scalar l1 = e1.x * e1.x + e1.y * e1.y;
+        Scalar l2 = e2.x * e2.x + e2.y * e2.y;
+        if ( l1 == 0 || l2 == 0 ) {
+            g[0] = g[1] = g[2] = Vec2( 0, 0 );
+            return 0;
+        }
+        g[0] = Vec2( -e1.y, e1.x ) / l1;
+        g[2] = Vec2( -e2.y, e2.x ) / l2;
+        g[1] = -g[0] - g[2];
+        return atan2( e1.x * e2.y - e1.y * e2.x, e1.x * e2.x + e1.y * e2.y );
+    }
+
+    /**
+     * @return theta - theta0 wrapped to [-pi, pi]
+     */
+    inline Scalar angleError( Scalar theta ) const {
+        return std::remainder( theta - theta0, Scalar( 2 * M_PI ) );
+    }
+
+private:
+    /**
+     * Computes the forces on the three particles
+     * @return the angle from the rest angle
+     */
+    Scalar force( const Vec2* x, const Vec2* v, Vec2* f ) const {
+        Vec2 g[3];
+        Scalar d = angleError( gradient( x, g ) );
+        Scalar rate = g[0].x * v[0].x + g[0].y * v[0].y + g[1].x * v[1].x + g[1].y * v[1].y + g[2].x * v[2].x + g[2].y * v[2].y;
+        Scalar s = -( k * d + c * rate );
+        for ( int a = 0; a < 3; a++ ) f[a] = g[a] * s;
+        return d;
+    }
+
+    /**
+     * Subtracts the nine blocks laid out as in stiffnessBlocks from the matrix
+     */
+    void subtractBlocks( BlockSparseMatrixT<Scalar>& M, const Scalar* B ) const {
+        int idx[3] = { i0, i1, i2 };
+        for ( int a = 0; a < 3; a++ ) {
+            for ( int b = 0; b < 3; b++ ) {
+                Scalar* m = M.block( idx[a], idx[b] ).m;
+                const Scalar* Bab = B + 4 * ( 3 * a + b );
+                for ( int j = 0; j < 4; j++ ) m[j] -= Bab[j];
+            }
+        }
+    }
+
+    inline void load( const Vector& x, Vec2* xs ) const {
+        xs[0] = Vec2( x[2 * i0], x[2 * i0 + 1] );
+        xs[1] = Vec2( x[2 * i1], x[2 * i1 + 1] );
+        xs[2] = Vec2( x[2 * i2], x[2 * i2 + 1] );
+    }
+};
+
+typedef BendingElementT<Precision> BendingElement;
@@ -0,0 +1,206 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+
+#include "Precision.hpp"
+
+/**
+ * Sparse matrix of 2x2 blocks, one block row per particle, for the implicit 
+ * solvers.  Each block row keeps its diagonal block first, followed by one block
+ * for each neighbouring particle.  Off diagonal blocks are reference counted 
+ * because several springs can connect the same pair of particles.  The pattern 
+ * is updated incrementally as particles and springs come and go, touching only
+ * the affected rows.
+ * @author kry
+ */
+template <typename Scalar>
+class BlockSparseMatrixT {
+public:
+    typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+
+    struct Block {
+        /** Block column */
+        int col;
+        /** Number of springs that need this block */
+        int refs;
+        /** Entries of the 2x2 block in row major order */
+        Scalar m[4];
+    };
+
+    std::vector<std::vector<Block>> rows;
+
+    /** Incremented whenever blocks are added to or removed from the pattern, or moved */
+    int patternVersion = 0;
+
+    /** @return number of block rows */
+    int size() const {
+        return rows.size();
+    }
+
+    /**
+     * Removes all rows
+     */
+    void clear() {
+        rows.clear();
+        patternVersion++;
+    }
+
+    /**
+     * Adds a new block row (and column) with only a diagonal block
+     */
+    void addRow() {
+        int i = rows.size();
+        rows.emplace_back();
+        rows.back().push_back( Block{ i, 1, { 0, 0, 0, 0 } } );
+        patternVersion++;
+    }
+
+    /**
+     * Removes block row (and column) i, which must have no off diagonal blocks left,
+     * by moving the last row into its place.
+     * @param i
+     */
+    void removeRow( int i ) {
+        int last = rows.size() - 1;
+        if ( i != last ) {
+            rows[i] = std::move( rows[last] );
+            rows[i][0].col = i;
+            // renumber the references to the moved column in the neighbouring rows
+            for ( size_t k = 1; k < rows[i].size(); k++ ) {
+                for ( Block& b : rows[rows[i][k].col] ) {
+                    if ( b.col == last ) b.col = i;
+                }
+            }
+        }
+        rows.pop_back();
+        patternVersion++;
+    }
+
+    /**
+     * Adds a reference to the off diagonal blocks (a,b) and (b,a), creating them if needed
+     * @param a
+     * @param b
+     */
+    void addPair( int a, int b ) {
+        addRef( a, b );
+        addRef( b, a );
+    }
+
+    /**
+     * Removes a reference to the off diagonal blocks (a,b) and (b,a), removing them
+     * from the pattern when no longer used.
+     * @param a
+     * @param b
+     */
+    void removePair( int a, int b ) {
+        removeRef( a, b );
+        removeRef( b, a );
+    }
+
+    /**
+     * Finds the block at the given block row and column, which must be in the pattern
+     * @param r
+     * @param c
+     * @return the block
+     */
+    inline Block& block( int r, int c ) {
+        std::vector<Block>& row = rows[r];
+        for ( Block& b : row ) {
+            if ( b.col == c ) return b;
+        }
+        return row[0]; // not reached when the pattern is consistent
+    }
+
+    /**
+     * Sets all entries to zero, keeping the pattern
+     */
+    void setZero() {
+        int n = rows.size();
+        #pragma omp parallel for
+        for ( int i = 0; i < n; i++ ) {
+            for ( Block& b : rows[i] ) {
+                std::fill( b.m, b.m + 4, Scalar( 0 ) );
+            }
+        }
+    }
+
+    /**
+     * Computes y = this * x
+     * @param x
+     * @param y
+     */
+    void multiply( const Vector& x, Vector& y ) const {
+        int n = rows.size();
+        #pragma omp parallel for
+        for ( int i = 0; i < n; i++ ) {
+            multiplyRow( i, x, y );
+        }
+    }
+
+    /**
+     * Computes the block rows from begin to end of y = this * x, for Backend::multiply
+     * @param x
+     * @param y
+     * @param begin
+     * @param end
+     */
+    void multiply( const Vector& x, Vector& y, int begin, int end ) const {
+        for ( int i = begin; i < end; i++ ) {
+            multiplyRow( i, x, y );
+        }
+    }
+
+    /**
+     * Fills d with the diagonal of this matrix
+     * @param d
+     */
+    void getDiagonal( Vector& d ) const {
+        int n = rows.size();
+        if ( d.size() != 2 * n ) d.resize( 2 * n );
+        for ( int i = 0; i < n; i++ ) {
+            d[2 * i] = rows[i][0].m[0];
+            d[2 * i + 1] = rows[i][0].m[3];
+        }
+    }
+
+private:
+    inline void multiplyRow( int i, const Vector& x, Vector& y ) const {
+        Scalar y0 = 0;
+        Scalar y1 = 0;
+        for ( const Block& b : rows[i] ) {
+            Scalar x0 = x[2 * b.col];
+            Scalar x1 = x[2 * b.col + 1];
+            y0 += b.m[0] * x0 + b.m[1] * x1;
+            y1 += b.m[2] * x0 + b.m[3] * x1;
+        }
+        y[2 * i] = y0;
+        y[2 * i + 1] = y1;
+    }
+
+    void addRef( int r, int c ) {
+        for ( Block& b : rows[r] ) {
+            if ( b.col == c ) {
+                b.refs++;
+                return;
+            }
+        }
+        rows[r].push_back( Block{ c, 1, { 0, 0, 0, 0 } } );
+        patternVersion++;
+    }
+
+    void removeRef( int r, int c ) {
+        std::vector<Block>& row = rows[r];
+        for ( size_t k = 1; k < row.size(); k++ ) {
+            if ( row[k].col == c ) {
+                if ( --row[k].refs == 0 ) {
+                    row[k] = row.back();
+                    row.pop_back();
+                    patternVersion++;
+                }
+                return;
+            }
+        }
+    }
+};
+
+typedef BlockSparseMatrixT<Real> BlockSparseMatrix;
@@ -0,0 +1,289 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+
+#define GLEW_STATIC
+#include <GL/glew.h>
+
+#include "Precision.hpp"
+
+/**
+ * Static line segment and polygon obstacles stored in a bounding volume hierarchy.
+ * The hierarchy is built once when the obstacles are loaded, and particles are
+ * tested with a swept query along the path they moved during a step so that fast
+ * particles at large step sizes cannot tunnel through thin obstacles.
+ *
+ * The obstacle file is plain text with one obstacle per line, and # comments:
+ *   segment x0 y0 x1 y1
+ *   polygon n x0 y0 x1 y1 ... (closed, n vertices)
+ * @author kry
+ */
+class StaticColliders {
+public:
+
+    struct Segment {
+        vec2r a;
+        vec2r b;
+    };
+
+    /**
+     * BVH node, with children at left and left + 1 for internal nodes, and
+     * segments first to first + count in the segment list for leaves
+     */
+    struct Node {
+        vec2r lo;
+        vec2r hi;
+        int left = -1;
+        int first = 0;
+        int count = 0;
+    };
+
+    std::vector<Segment> segments;
+    std::vector<Node> nodes;
+
+    /** Largest number of segments in a leaf */
+    int leafSize = 2;
+
+    /** Distance at which a particle is left on its own side of an obstacle after a hit */
+    Real margin = 0.01;
+
+    /**
+     * Loads obstacles from a file, replacing any current ones, and builds the hierarchy
+     * @param filename
+     * @return false if the file could not be read or has a malformed line
+     */
+    bool load( const std::string& filename ) {
+        std::ifstream in( filename );
+        if ( !in ) {
+            std::cerr << "Could not open obstacle file " << filename << std::endl;
+            return false;
+        }
+        std::vector<Segment> loaded;
+        std::string line;
+        int lineNumber = 0;
+        while ( std::getline( in, line ) ) {
+            lineNumber++;
+            std::istringstream ss( line.substr( 0, line.find( '#' ) ) );
+            std::string type;
+            if ( !( ss >> type ) ) continue;
+            bool ok = false;
+            if ( type == "segment" ) {
+                Segment s;
+                ok = (bool) ( ss >> s.a.x >> s.a.y >> s.b.x >> s.b.y );
+                if ( ok ) loaded.push_back( s );
+            } else if ( type == "polygon" ) {
+                int n = 0;
+                std::vector<vec2r> v;
+                ok = (bool) ( ss >> n ) && n >= 2;
+                for ( int i = 0; ok && i < n; i++ ) {
+                    vec2r p;
+                    ok = (bool) ( ss >> p.x >> p.y );
+                    v.push_back( p );
+                }
+                for ( int i = 0; ok && i < n; i++ ) {
+                    loaded.push_back( Segment{ v[i], v[( i + 1 ) % n] } );
+                }
+            }
+            if ( !ok ) {
+                std::cerr << filename << ":" << lineNumber << ": could not parse obstacle \"" << line << "\"" << std::endl;
+                return false;
+            }
+        }
+        segments = loaded;
+        build();
+        return true;
+    }
+
+    /**
+     * Removes all obstacles
+     */
+    void clear() {
+        segments.clear();
+        nodes.clear();
+    }
+
+    bool empty() {
+        return segments.empty();
+    }
+
+    /**
+     * Builds the hierarchy over the current segment list, reordering the segments
+     * so that each leaf refers to a contiguous range.
+     */
+    void build() {
+        nodes.clear();
+        if ( segments.empty() ) return;
+        nodes.reserve( 2 * segments.size() );
+        nodes.push_back( Node() );
+        build( 0, 0, segments.size() );
+    }
+
+    /** Largest number of obstacles a particle can slide into in one step */
+    int maxHits = 4;
+
+    /**
+     * Collides one particle with the obstacles along the path it moved in the last step.
+     * At the earliest hit the particle is put at the hit point, offset by the margin to
+     * the side it came from, its velocity into the obstacle is reflected and scaled by
+     * the restitution, and its force into the obstacle is removed.  The rest of the 
+     * motion slides along the obstacle, and is itself tested for hits.
+     * @param x0 position at the start of the step
+     * @param x position at the end of the step, modified on collision
+     * @param v velocity, modified on collision
+     * @param f force, modified on collision
+     * @param r restitution
+     * @return true if the particle hit an obstacle
+     */
+    bool collide( const vec2r& x0, vec2r& x, vec2r& v, vec2r& f, Real r ) const {
+        if ( nodes.empty() ) return false;
+        vec2r start = x0;
+        bool collided = false;
+        for ( int k = 0; k < maxHits; k++ ) {
+            Real t;
+            int hit = query( start, x, t );
+            if ( hit < 0 ) break;
+            collided = true;
+            const Segment& s = segments[hit];
+            vec2r e = s.b - s.a;
+            vec2r n( -e.y, e.x );
+            n = n / (Real) sqrt( n.x * n.x + n.y * n.y );
+            // normal facing the side the particle came from
+            if ( ( start.x - s.a.x ) * n.x + ( start.y - s.a.y ) * n.y < 0 ) n = -n;
+            vec2r d = x - start;
+            vec2r rest = d * ( 1 - t );
+            Real dn = rest.x * n.x + rest.y * n.y;
+            if ( dn < 0 ) rest = rest - n * dn;
+            start = start + d * t + n * margin;
+            x = start + rest;
+            Real vn = v.x * n.x + v.y * n.y;
+            if ( vn < 0 ) v = v - n * ( ( 1 + r ) * vn );
+            Real fn = f.x * n.x + f.y * n.y;
+            if ( fn < 0 ) f = f - n * fn;
+        }
+        return collided;
+    }
+
+    /**
+     * Finds the earliest obstacle crossed by the path from x0 to x1
+     * @param t set to the path parameter of the hit
+     * @return index of the segment hit, or -1
+     */
+    int query( const vec2r& x0, const vec2r& x1, Real& t ) const {
+        vec2r d = x1 - x0;
+        vec2r lo( std::min( x0.x, x1.x ), std::min( x0.y, x1.y ) );
+        vec2r hi( std::max( x0.x, x1.x ), std::max( x0.y, x1.y ) );
+        t = 2;
+        int hit = -1;
+        int stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while ( top > 0 ) {
+            const Node& node = nodes[stack[--top]];
+            if ( node.lo.x > hi.x || node.hi.x < lo.x || node.lo.y > hi.y || node.hi.y < lo.y ) continue;
+            if ( node.left < 0 ) {
+                for ( int i = node.first; i < node.first + node.count; i++ ) {
+                    Real ti;
+                    if ( intersect( x0, d, segments[i], ti ) && ti < t ) {
+                        t = ti;
+                        hit = i;
+                    }
+                }
+            } else {
+                stack[top++] = node.left;
+                stack[top++] = node.left + 1;
+            }
+        }
+        return hit;
+    }
+
+    /**
+     * Collides all particles stored in split arrays, in parallel.
+     * @param x0 positions at the start of the step
+     * @param x positions at the end of the step
+     * @param v velocities
+     * @param f forces
+     * @param w inverse masses, particles with zero inverse mass are skipped
+     * @param r restitution
+     */
+    void collide( const VectorXr& x0, VectorXr& x, VectorXr& v, VectorXr& f, const VectorXr& w, Real r ) const {
+        if ( nodes.empty() ) return;
+        int n = w.size();
+        #pragma omp parallel for schedule(static, 256)
+        for ( int i = 0; i < n; i++ ) {
+            if ( w[i] == 0 ) continue;
+            vec2r p( x[2 * i], x[2 * i + 1] );
+            vec2r vi( v[2 * i], v[2 * i + 1] );
+            vec2r fi( f[2 * i], f[2 * i + 1] );
+            if ( collide( vec2r( x0[2 * i], x0[2 * i + 1] ), p, vi, fi, r ) ) {
+                x[2 * i] = p.x;
+                x[2 * i + 1] = p.y;
+                v[2 * i] = vi.x;
+                v[2 * i + 1] = vi.y;
+                f[2 * i] = fi.x;
+                f[2 * i + 1] = fi.y;
+            }
+        }
+    }
+
+    void display() {
+        glColor4d( 0.8, 0.8, 0.8, 1 );
+        glLineWidth( 3.0f );
+        glBegin( GL_LINES );
+        for ( const Segment& s : segments ) {
+            glVertex2d( s.a.x, s.a.y );
+            glVertex2d( s.b.x, s.b.y );
+        }
+        glEnd();
+    }
+
+private:
+    /**
+     * Builds the subtree at the given node over segments begin to end, splitting
+     * at the median centroid along the longest axis of the node box.
+     */
+    void build( int node, int begin, int end ) {
+        Node nd;
+        nd.lo = nd.hi = segments[begin].a;
+        for ( int i = begin; i < end; i++ ) {
+            for ( const vec2r& p : { segments[i].a, segments[i].b } ) {
+                nd.lo = vec2r( std::min( nd.lo.x, p.x ), std::min( nd.lo.y, p.y ) );
+                nd.hi = vec2r( std::max( nd.hi.x, p.x ), std::max( nd.hi.y, p.y ) );
+            }
+        }
+        if ( end - begin <= leafSize ) {
+            nd.first = begin;
+            nd.count = end - begin;
+            nodes[node] = nd;
+            return;
+        }
+        int axis = ( nd.hi.x - nd.lo.x ) >= ( nd.hi.y - nd.lo.y ) ? 0 : 1;
+        int mid = ( begin + end ) / 2;
+        std::nth_element( segments.begin() + begin, segments.begin() + mid, segments.begin() + end,
+            [axis]( const Segment& s, const Segment& t ) { return s.a[axis] + s.b[axis] < t.a[axis] + t.b[axis]; } );
+        nd.left = nodes.size();
+        nodes[node] = nd;
+        nodes.push_back( Node() );
+        nodes.push_back( Node() );
+        build( nd.left, begin, mid );
+        build( nd.left + 1, mid, end );
+    }
+
+    /**
+     * Intersects the path x0 + t d, t in [0,1], with a segment
+     * @param t set to the path parameter of the intersection
+     * @return true if they intersect
+     */
+    static bool intersect( const vec2r& x0, const vec2r& d, const Segment& s, Real& t ) {
+        vec2r e = s.b - s.a;
+        Real denom = d.x * e.y - d.y * e.x;
+        if ( denom == 0 ) return false;
+        vec2r q = s.a - x0;
+        t = ( q.x * e.y - q.y * e.x ) / denom;
+        Real u = ( q.x * d.y - q.y * d.x ) / denom;
+        return t >= 0 && t <= 1 && u >= 0 && u <= 1;
+    }
+};
@@ -0,0 +1,153 @@
+#pragma once
+#include <cmath>
+#include <functional>
+
+#include "Precision.hpp"
+
+#include "Filter.hpp"
+#include "BlockSparseMatrix.hpp"
+#include "Backend.hpp"
+
+/**
+ * Jacobi preconditioned conjugate gradient solver with a filter for removing
+ * constrained (pinned) degrees of freedom, as in the modified PCG of Baraff and 
+ * Witkin, "Large Steps in Cloth Simulation", SIGGRAPH 1998.
+ * @author kry
+ */
+class ConjugateGradient {
+public:
+    /** Number of iterations taken by the last solve */
+    int iterations = 0;
+    /** Relative residual at the end of the last solve */
+    Real residual = 0;
+
+    VectorXr r;
+    VectorXr z;
+    VectorXr d;
+    VectorXr q;
+    VectorXr diag;
+
+    /** Backend for the products and vector updates, or NULL for the built in loops */
+    Backend* backend = NULL;
+
+    /** Computes y = A x, for solves with a matrix that is not assembled */
+    typedef std::function<void( const VectorXr& x, VectorXr& y )> Operator;
+
+    /**
+     * Solves A x = b, using the provided x as the initial guess
+     * @param A
+     * @param b
+     * @param x initial guess, and solution
+     * @param maxIterations
+     * @param tolerance relative to the norm of the filtered b
+     * @param filter removes constrained components of vectors, may be NULL
+     */
+    void solve( const BlockSparseMatrix& A, VectorXr& b, VectorXr& x, int maxIterations, Real tolerance, Filter* filter ) {
+        A.getDiagonal( diag );
+        if ( backend != NULL ) {
+            Backend* be = backend;
+            solve( *be, [&A, be]( const VectorXr& v, VectorXr& y ) { be->multiply( A, v, y ); }, diag, b, x, maxIterations, tolerance, filter );
+            return;
+        }
+        solve( [&A]( const VectorXr& v, VectorXr& y ) { A.multiply( v, y ); }, diag, b, x, maxIterations, tolerance, filter );
+    }
+
+    /**
+     * Solves A x = b for a matrix given by its product, such as a block of the system
+     * for one island, see ParticleSystem::solveIslands
+     * @param A computes products with the matrix
+     * @param diagonal diagonal of the matrix, for the preconditioner
+     * @param b
+     * @param x initial guess, and solution
+     * @param maxIterations
+     * @param tolerance relative to the norm of the filtered b
+     * @param filter removes constrained components of vectors, may be NULL
+     */
+    void solve( const Operator& A, const VectorXr& diagonal, VectorXr& b, VectorXr& x, int maxIterations, Real tolerance, Filter* filter ) {
+        allocate( b.size() );
+        if ( filter != NULL ) {
+            filter->filter( b );
+            filter->filter( x );
+        }
+        A( x, q );
+        r = b - q;
+        if ( filter != NULL ) filter->filter( r );
+        z = r.cwiseQuotient( diagonal );
+        d = z;
+        Real rz = r.dot( z );
+        Real bnorm = b.norm();
+        Real tol = tolerance * ( bnorm > 0 ? bnorm : 1 );
+        iterations = 0;
+        while ( iterations < maxIterations && r.norm() > tol ) {
+            A( d, q );
+            if ( filter != NULL ) filter->filter( q );
+            Real dq = d.dot( q );
+            if ( dq <= 0 ) break;
+            Real alpha = rz / dq;
+            x += alpha * d;
+            r -= alpha * q;
+            z = r.cwiseQuotient( diagonal );
+            Real rzNew = r.dot( z );
+            d = z + ( rzNew / rz ) * d;
+            rz = rzNew;
+            iterations++;
+        }
+        residual = bnorm > 0 ? r.norm() / bnorm : r.norm();
+    }
+
+    /**
+     * The same iterations with the products, dot products, and vector updates run by a
+     * backend, for a matrix given by its product, such as Backend::springMultiply
+     * @param be
+     * @param A computes products with the matrix
+     * @param diagonal diagonal of the matrix, for the preconditioner
+     * @param b
+     * @param x initial guess, and solution
+     * @param maxIterations
+     * @param tolerance relative to the norm of the filtered b
+     * @param filter removes constrained components of vectors, may be NULL
+     */
+    void solve( Backend& be, const Operator& A, const VectorXr& diagonal, VectorXr& b, VectorXr& x, int maxIterations, Real tolerance, Filter* filter ) {
+        allocate( b.size() );
+        if ( filter != NULL ) {
+            filter->filter( b );
+            filter->filter( x );
+        }
+        A( x, q );
+        be.difference( b, q, r );
+        if ( filter != NULL ) filter->filter( r );
+        be.quotient( r, diagonal, z );
+        be.copy( z, d );
+        Real rz = be.dot( r, z );
+        Real bnorm = sqrt( be.dot( b, b ) );
+        Real tol = tolerance * ( bnorm > 0 ? bnorm : 1 );
+        Real rr = be.dot( r, r );
+        iterations = 0;
+        while ( iterations < maxIterations && sqrt( rr ) > tol ) {
+            A( d, q );
+            if ( filter != NULL ) filter->filter( q );
+            Real dq = be.dot( d, q );
+            if ( dq <= 0 ) break;
+            Real alpha = rz / dq;
+            be.axpy( alpha, d, x );
+            be.axpy( -alpha, q, r );
+            be.quotient( r, diagonal, z );
+            Real rzNew = be.dot( r, z );
+            rr = be.dot( r, r );
+            be.xpay( z, rzNew / rz, d );
+            rz = rzNew;
+            iterations++;
+        }
+        residual = bnorm > 0 ? sqrt( rr ) / bnorm : sqrt( rr );
+    }
+
+private:
+    void allocate( int n ) {
+        if ( r.size() != n ) {
+            r.resize( n );
+            z.resize( n );
+            d.resize( n );
+            q.resize( n );
+        }
+    }
+};
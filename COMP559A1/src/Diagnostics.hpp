@@ -0,0 +1,151 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <cmath>
+#include <algorithm>
+
+/**
+ * Ring buffer of per step energy, momentum, and spring strain measurements, for
+ * comparing the stability and accuracy of the integrators.  The measurements are
+ * taken by ParticleSystem during the first force evaluation of each step, so they
+ * cost little more than the force pass itself.
+ * @author kry
+ */
+class Diagnostics {
+public:
+
+    /** Measurements at the start of one step */
+    struct Sample {
+        double time;
+        double kinetic;
+        /** Spring potential energy */
+        double spring;
+        /** Bending element potential energy */
+        double bending;
+        /** Gravitational potential energy, with y pointing down */
+        double gravitational;
+        /** Linear momentum */
+        double px, py;
+        /** Largest spring strain magnitude |l - l0| / l0 */
+        double maxStrain;
+        /** Compute time of the step in seconds */
+        double stepTime;
+
+        double energy() const {
+            return kinetic + spring + bending + gravitational;
+        }
+    };
+
+    /** Measurements are only taken while enabled */
+    bool enabled = false;
+
+    /** Largest number of samples kept, the oldest are overwritten */
+    size_t capacity = 10000;
+
+    /** Energy of the first sample since the last clear, for the energy error */
+    double initialEnergy = 0;
+
+    /** Compute time and steps since the last clear */
+    double totalTime = 0;
+    long steps = 0;
+
+    /** Largest relative energy error |E - E0| / |E0| since the last clear */
+    double maxEnergyError = 0;
+
+    /**
+     * Removes all samples, and restarts the energy error from the next sample
+     */
+    void clear() {
+        samples.clear();
+        next = 0;
+        totalTime = 0;
+        steps = 0;
+        maxEnergyError = 0;
+    }
+
+    /** @return number of samples stored */
+    size_t size() const {
+        return samples.size();
+    }
+
+    /**
+     * @param k
+     * @return the k-th oldest sample stored
+     */
+    const Sample& get( size_t k ) const {
+        return samples.size() < capacity ? samples[k] : samples[( next + k ) % capacity];
+    }
+
+    /** @return the most recent sample, there must be one */
+    const Sample& latest() const {
+        return samples[( next + capacity - 1 ) % capacity];
+    }
+
+    /**
+     * Adds a sample, overwriting the oldest when full
+     * @param s
+     */
+    void push( const Sample& s ) {
+        if ( steps == 0 ) initialEnergy = s.energy();
+        double E = s.energy();
+        maxEnergyError = std::max( maxEnergyError, std::abs( E - initialEnergy ) / std::max( std::abs( initialEnergy ), 1e-12 ) );
+        steps++;
+        if ( samples.size() < capacity ) {
+            samples.push_back( s );
+            next = samples.size() % capacity;
+        } else {
+            samples[next] = s;
+            next = ( next + 1 ) % capacity;
+        }
+    }
+
+    /**
+     * Sets the compute time of the most recent samples, once the time taken for the
+     * steps that produced them is known.
+     * @param seconds time for each of the steps
+     * @param count number of samples to set
+     */
+    void setStepTime( double seconds, int count ) {
+        count = std::min( (size_t) count, samples.size() );
+        for ( int k = 0; k < count; k++ ) {
+            samples[( next + capacity - 1 - k ) % capacity].stepTime = seconds;
+        }
+        totalTime += seconds * count;
+    }
+
+    /**
+     * @return compute time multiplied by the largest relative energy error since the
+     * last clear, a cost for comparing integrators run to the same simulated time
+     */
+    double costTimesError() const {
+        return totalTime * maxEnergyError;
+    }
+
+    /**
+     * Writes the samples, oldest first, as comma separated values with a header row
+     * @param filename
+     * @return false if the file could not be written
+     */
+    bool writeCSV( const std::string& filename ) const {
+        std::ofstream out( filename );
+        out << "time,kinetic,spring,bending,gravitational,energy,px,py,maxStrain,stepTime\n";
+        out.precision( 10 );
+        for ( size_t k = 0; k < samples.size(); k++ ) {
+            const Sample& s = get( k );
+            out << s.time << "," << s.kinetic << "," << s.spring << "," << s.bending << "," << s.gravitational << ","
+                << s.energy() << "," << s.px << "," << s.py << "," << s.maxStrain << "," << s.stepTime << "\n";
+        }
+        if ( !out ) {
+            std::cerr << "Could not write diagnostics file " << filename << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    std::vector<Sample> samples;
+    /** Slot of the next sample once the buffer is full */
+    size_t next = 0;
+};
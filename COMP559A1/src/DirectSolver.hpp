@@ -0,0 +1,175 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <Eigen/Sparse>
+
+#include "Precision.hpp"
+#include "Filter.hpp"
+#include "BlockSparseMatrix.hpp"
+
+/**
+ * Sparse direct solver for the implicit integrators, an alternative to the
+ * conjugate gradient solver for stiff systems where CG needs many iterations.
+ * The degrees of freedom removed by the filter (pinned and sleeping particles)
+ * are eliminated, and the lower triangle of the remaining system is factored with
+ * a simplicial LDL^T decomposition in a fill reducing (approximate minimum degree)
+ * order.  The factorization is done in double precision whatever the precision
+ * of the state, as in float the fill decays into subnormal numbers, which are
+ * both slow and inaccurate for stiff systems.  The ordering and the symbolic
+ * factorization only depend on the pattern of the matrix and on the eliminated
+ * degrees of freedom, so they are computed again only when these change, and each
+ * solve only does the numeric factorization.
+ * @author kry
+ */
+class SparseDirectSolver {
+public:
+    /** Number of symbolic analyses and numeric factorizations done so far */
+    int analyses = 0;
+    int factorizations = 0;
+
+    /** Number of free degrees of freedom */
+    int dofs = 0;
+
+    /** Number of nonzero entries of the free part of A, which sets the cost of a product with it */
+    long matrixEntries = 0;
+
+    /** Multiply adds of one numeric factorization, the sum of the squared column counts of L */
+    double factorFlops = 0;
+
+    /**
+     * Finds the free degrees of freedom, and computes the ordering and symbolic
+     * factorization if they or the pattern of A changed since the last call
+     * @param A
+     * @param filter removes constrained components of vectors, may be NULL
+     */
+    void update( const BlockSparseMatrix& A, Filter* filter ) {
+        if ( updateFree( A.size(), filter ) || A.patternVersion != patternVersion ) {
+            analyze( A );
+        }
+    }
+
+    /**
+     * Solves A x = b for the degrees of freedom kept by the filter, setting the
+     * others to zero.  A must be symmetric.
+     * @param A
+     * @param b
+     * @param x solution
+     * @param filter removes constrained components of vectors, may be NULL
+     * @return false if the factorization failed, in which case x is unchanged
+     */
+    bool solve( const BlockSparseMatrix& A, const VectorXr& b, VectorXr& x, Filter* filter ) {
+        update( A, filter );
+        int nf = freeDofs.size();
+        double* values = L.valuePtr();
+        int nnz = entries.size();
+        #pragma omp parallel for if(nnz > 100000)
+        for ( int k = 0; k < nnz; k++ ) {
+            const Entry& e = entries[k];
+            values[k] = A.rows[e.row][e.block].m[e.index];
+        }
+        ldlt.factorize( L );
+        factorizations++;
+        if ( ldlt.info() != Eigen::Success ) return false;
+        rhs.resize( nf );
+        for ( int k = 0; k < nf; k++ ) rhs[k] = b[freeDofs[k]];
+        solution = ldlt.solve( rhs );
+        x.setZero( b.size() );
+        for ( int k = 0; k < nf; k++ ) x[freeDofs[k]] = solution[k];
+        return true;
+    }
+
+private:
+    /** Source of a stored entry of L, at a block row, block, and index within the block */
+    struct Entry {
+        int row;
+        int block;
+        int index;
+    };
+
+    /** The LDL^T factorization, giving access to the column counts of its symbolic analysis */
+    class Factorization : public Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>, Eigen::Lower, Eigen::AMDOrdering<int>> {
+    public:
+        double flops() const {
+            return m_nonZerosPerCol.template cast<double>().squaredNorm();
+        }
+    };
+
+    Eigen::SparseMatrix<double> L;
+    Factorization ldlt;
+
+    /** Entries of A copied into the stored values of L, in storage order */
+    std::vector<Entry> entries;
+
+    /** Free degrees of freedom in order, and the free index of each, or -1 if eliminated */
+    std::vector<int> freeDofs;
+    std::vector<int> freeIndex;
+
+    /** Pattern version of the matrix that was analyzed, or -1 */
+    int patternVersion = -1;
+
+    VectorXr mask;
+    Eigen::VectorXd rhs;
+    Eigen::VectorXd solution;
+
+    /**
+     * Finds the degrees of freedom kept by the filter as those of a vector of ones
+     * that it does not zero
+     * @return true if they differ from those of the last solve
+     */
+    bool updateFree( int n, Filter* filter ) {
+        mask.setOnes( 2 * n );
+        if ( filter != NULL ) filter->filter( mask );
+        bool changed = (int) freeIndex.size() != 2 * n;
+        freeIndex.resize( 2 * n );
+        freeDofs.clear();
+        for ( int i = 0; i < 2 * n; i++ ) {
+            int f = mask[i] != 0 ? (int) freeDofs.size() : -1;
+            if ( f >= 0 ) freeDofs.push_back( i );
+            if ( freeIndex[i] != f ) changed = true;
+            freeIndex[i] = f;
+        }
+        dofs = freeDofs.size();
+        return changed;
+    }
+
+    /**
+     * Builds the pattern of the lower triangle of the free part of A, along with
+     * where each stored entry comes from, and computes the ordering and symbolic
+     * factorization
+     * @param A
+     */
+    void analyze( const BlockSparseMatrix& A ) {
+        int nf = freeDofs.size();
+        std::vector<Eigen::Triplet<double>> triplets;
+        std::vector<Entry> sources;
+        for ( int r = 0; r < A.size(); r++ ) {
+            const std::vector<BlockSparseMatrix::Block>& row = A.rows[r];
+            for ( int k = 0; k < (int) row.size(); k++ ) {
+                for ( int j = 0; j < 4; j++ ) {
+                    int fr = freeIndex[2 * r + j / 2];
+                    int fc = freeIndex[2 * row[k].col + j % 2];
+                    if ( fr < 0 || fc < 0 || fr < fc ) continue;
+                    triplets.emplace_back( fr, fc, 0 );
+                    sources.push_back( Entry{ r, k, j } );
+                }
+            }
+        }
+        L.resize( nf, nf );
+        L.setFromTriplets( triplets.begin(), triplets.end() );
+        L.makeCompressed();
+        // each entry of the lower triangle comes from exactly one block entry
+        entries.resize( L.nonZeros() );
+        const int* outer = L.outerIndexPtr();
+        const int* inner = L.innerIndexPtr();
+        for ( size_t t = 0; t < triplets.size(); t++ ) {
+            int c = triplets[t].col();
+            int position = std::lower_bound( inner + outer[c], inner + outer[c + 1], triplets[t].row() ) - inner;
+            entries[position] = sources[t];
+        }
+        ldlt.analyzePattern( L );
+        analyses++;
+        matrixEntries = 2 * L.nonZeros() - nf;
+        factorFlops = ldlt.flops();
+        patternVersion = A.patternVersion;
+    }
+};
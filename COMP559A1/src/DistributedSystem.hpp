@@ -0,0 +1,409 @@
+#pragma once
+#include <vector>
+#include <map>
+#include <algorithm>
+
+#include "Precision.hpp"
+#include "ParticleSystem.hpp"
+#include "ParticleOrdering.hpp"
+#include "Transport.hpp"
+
+/**
+ * Prototype of distributed memory backward Euler for Benchmark::distributed, which
+ * measures how the spring force pass and the conjugate gradient solve scale over
+ * ranks that share no memory.  It is not a simulation mode of ParticleSystem: it
+ * steps a copy of the state of a system that does not change while it runs, and
+ * writes the result back with gather.
+ *
+ * Each rank holds its share of the particle system.  Every
+ * rank builds the same scene and partitions it the same way with
+ * ParticleOrdering::graphPartition, then keeps only the particles it owns, the
+ * springs touching them, and the halo particles at the other ends of springs
+ * that cross to other ranks.  Local particles are numbered with the owned ones
+ * first, then the halo particles grouped by owning rank.
+ *
+ * The halo positions and velocities are exchanged before each force evaluation,
+ * and springs crossing between two ranks are computed by both, each adding the
+ * force only to its own particle, as in DomainDecomposition.  Backward Euler is
+ * solved with a matrix free Jacobi preconditioned conjugate gradient, with one
+ * halo exchange per product and one sum over all ranks per iteration.
+ *
+ * The spring forces and Jacobian blocks are those of Spring, evaluated on the local
+ * arrays.  Gravity, viscous damping, and springs are simulated; bending elements,
+ * walls, obstacles, breaking, and topology edits are not.
+ * @author kry
+ */
+class DistributedSystem {
+public:
+    Transport& transport;
+
+    /** Number of owned particles, and of owned plus halo particles */
+    int owned = 0;
+    int local = 0;
+
+    /** Global particle index of each local particle */
+    std::vector<int> globalIndex;
+
+    /** Local state, two values per local particle */
+    VectorXr x;
+    VectorXr v;
+    VectorXr f;
+    /** Masses and inverse masses of the local particles, zero inverse mass when pinned */
+    VectorXr mass;
+    VectorXr invMass;
+
+    struct LocalSpring {
+        /** Spring of the system, for its parameters and its force and Jacobian code */
+        const Spring* spring;
+        /** Local indices of the ends */
+        int a;
+        int b;
+        /** Which ends this rank owns */
+        bool ownsA;
+        bool ownsB;
+    };
+    std::vector<LocalSpring> springs;
+
+    /** Owned particles to send to, and halo particles to receive from, a neighbouring rank */
+    struct Neighbour {
+        int rank;
+        std::vector<int> send;
+        std::vector<int> receive;
+        std::vector<Real> buffer;
+    };
+    std::vector<Neighbour> neighbours;
+
+    Real gravity = 0;
+    Real viscousDamping = 0;
+
+    /** Conjugate gradient iterations and tolerance, relative to the norm of the right hand side */
+    int solverIterations = 100;
+    Real solverTolerance = 1e-5;
+    /** Iterations taken by the last solve */
+    int iterations = 0;
+
+    /** Velocity change of the last backward Euler step, the initial guess for the next */
+    VectorXr deltaxdot;
+
+    /**
+     * Takes this rank's share of a particle system, which must be the same on every rank
+     * @param system must keep its springs while this is used
+     * @param transport
+     */
+    DistributedSystem( ParticleSystem& system, Transport& transport ) : transport( transport ) {
+        system.updateSpringParameters();
+        gravity = system.useGravity ? system.gravity : 0;
+        viscousDamping = system.viscousDamping;
+        solverIterations = system.solverIterations;
+        solverTolerance = system.solverTolerance;
+        int n = system.particles.size();
+        int me = transport.rank();
+        std::vector<int> start;
+        std::vector<int> order = ParticleOrdering::graphPartition( system.particles, system.bendingElements, transport.size(), start );
+        std::vector<int> ownerOf( n );
+        for ( size_t d = 0; d + 1 < start.size(); d++ ) {
+            for ( int k = start[d]; k < start[d + 1]; k++ ) ownerOf[order[k]] = d;
+        }
+        std::vector<int> localIndex( n, -1 );
+        for ( int k = start[me]; k < start[me + 1]; k++ ) {
+            localIndex[order[k]] = globalIndex.size();
+            globalIndex.push_back( order[k] );
+        }
+        owned = globalIndex.size();
+        // the particles to exchange with each neighbour, in global index order on both sides
+        std::map<int, std::vector<int>> sendTo, receiveFrom;
+        for ( Spring* s : system.springs ) {
+            int a = s->p1->index;
+            int b = s->p2->index;
+            if ( ownerOf[a] == ownerOf[b] ) continue;
+            if ( ownerOf[a] == me ) {
+                sendTo[ownerOf[b]].push_back( a );
+                receiveFrom[ownerOf[b]].push_back( b );
+            } else if ( ownerOf[b] == me ) {
+                sendTo[ownerOf[a]].push_back( b );
+                receiveFrom[ownerOf[a]].push_back( a );
+            }
+        }
+        for ( auto& entry : receiveFrom ) {
+            Neighbour nb;
+            nb.rank = entry.first;
+            std::vector<int>& out = sendTo[entry.first];
+            std::vector<int>& in = entry.second;
+            std::sort( out.begin(), out.end() );
+            out.erase( std::unique( out.begin(), out.end() ), out.end() );
+            std::sort( in.begin(), in.end() );
+            in.erase( std::unique( in.begin(), in.end() ), in.end() );
+            for ( int i : out ) nb.send.push_back( localIndex[i] );
+            for ( int i : in ) {
+                localIndex[i] = globalIndex.size();
+                globalIndex.push_back( i );
+                nb.receive.push_back( localIndex[i] );
+            }
+            nb.buffer.resize( 2 * std::max( out.size(), in.size() ) );
+            neighbours.push_back( nb );
+        }
+        local = globalIndex.size();
+        for ( Spring* s : system.springs ) {
+            int a = s->p1->index;
+            int b = s->p2->index;
+            if ( ownerOf[a] != me && ownerOf[b] != me ) continue;
+            springs.push_back( LocalSpring{ s, localIndex[a], localIndex[b], ownerOf[a] == me, ownerOf[b] == me } );
+        }
+        x.resize( 2 * local );
+        v.resize( 2 * local );
+        f.resize( 2 * local );
+        mass.resize( local );
+        invMass.resize( local );
+        for ( int i = 0; i < local; i++ ) {
+            Particle* p = system.particles[globalIndex[i]];
+            x[2 * i] = p->p.x;
+            x[2 * i + 1] = p->p.y;
+            v[2 * i] = p->pinned ? 0 : p->v.x;
+            v[2 * i + 1] = p->pinned ? 0 : p->v.y;
+            mass[i] = p->mass;
+            invMass[i] = p->pinned ? 0 : 1 / p->mass;
+        }
+    }
+
+    /**
+     * Copies the owned values of a two per particle array to the neighbours, and
+     * fills the halo values from theirs.  Each pair of ranks exchanges with the
+     * lower rank sending first, so that blocking transports cannot deadlock.
+     * @param a
+     */
+    void exchange( VectorXr& a ) {
+        int me = transport.rank();
+        for ( Neighbour& nb : neighbours ) {
+            for ( int pass = 0; pass < 2; pass++ ) {
+                if ( ( pass == 0 ) == ( me < nb.rank ) ) {
+                    for ( size_t k = 0; k < nb.send.size(); k++ ) {
+                        nb.buffer[2 * k] = a[2 * nb.send[k]];
+                        nb.buffer[2 * k + 1] = a[2 * nb.send[k] + 1];
+                    }
+                    transport.send( nb.rank, nb.buffer.data(), 2 * nb.send.size() * sizeof( Real ) );
+                } else {
+                    transport.receive( nb.rank, nb.buffer.data(), 2 * nb.receive.size() * sizeof( Real ) );
+                    for ( size_t k = 0; k < nb.receive.size(); k++ ) {
+                        a[2 * nb.receive[k]] = nb.buffer[2 * k];
+                        a[2 * nb.receive[k] + 1] = nb.buffer[2 * k + 1];
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * Exchanges the halo state and computes the forces on the owned particles
+     */
+    void computeForces() {
+        exchange( x );
+        exchange( v );
+        for ( int i = 0; i < owned; i++ ) {
+            f[2 * i] = -viscousDamping * v[2 * i];
+            f[2 * i + 1] = mass[i] * gravity - viscousDamping * v[2 * i + 1];
+        }
+        for ( const LocalSpring& s : springs ) {
+            Real fk[2];
+            s.spring->computeForce( s.a, s.b, x, v, fk );
+            if ( s.ownsA ) {
+                f[2 * s.a] += fk[0];
+                f[2 * s.a + 1] += fk[1];
+            }
+            if ( s.ownsB ) {
+                f[2 * s.b] -= fk[0];
+                f[2 * s.b + 1] -= fk[1];
+            }
+        }
+    }
+
+    /**
+     * Linearized backward Euler step, solving ( M - h D - h^2 K ) dv = h ( f + h K v )
+     * with the spring blocks of Spring::stiffnessBlock and Spring::dampingBlock
+     * @param h
+     */
+    void stepBackwardEuler( Real h ) {
+        computeForces();
+        stiffness.resize( springs.size() );
+        damping.resize( springs.size() );
+        for ( size_t k = 0; k < springs.size(); k++ ) {
+            const LocalSpring& s = springs[k];
+            s.spring->stiffnessBlock( s.a, s.b, x, stiffness[k].m );
+            s.spring->dampingBlock( s.a, s.b, x, damping[k].m );
+        }
+        // b = h ( f + h K v ), with the sign convention dfdx = -K on the diagonal blocks
+        VectorXr Kv( 2 * local );
+        multiplyStiffness( v, Kv );
+        VectorXr b = h * ( f - h * Kv );
+        if ( deltaxdot.size() != 2 * local ) deltaxdot.setZero( 2 * local );
+        solve( h, b, deltaxdot );
+        for ( int i = 0; i < owned; i++ ) {
+            v[2 * i] += deltaxdot[2 * i];
+            v[2 * i + 1] += deltaxdot[2 * i + 1];
+            x[2 * i] += h * v[2 * i];
+            x[2 * i + 1] += h * v[2 * i + 1];
+        }
+    }
+
+    /**
+     * Sends the owned particle state to rank 0, which writes all of it into the
+     * particles of its system
+     * @param system
+     */
+    void gather( ParticleSystem& system ) {
+        if ( transport.rank() != 0 ) {
+            std::vector<Real> state( 4 * owned );
+            for ( int i = 0; i < owned; i++ ) {
+                state[4 * i] = x[2 * i];
+                state[4 * i + 1] = x[2 * i + 1];
+                state[4 * i + 2] = v[2 * i];
+                state[4 * i + 3] = v[2 * i + 1];
+            }
+            int count = owned;
+            transport.send( 0, &count, sizeof( count ) );
+            transport.send( 0, globalIndex.data(), owned * sizeof( int ) );
+            transport.send( 0, state.data(), state.size() * sizeof( Real ) );
+            return;
+        }
+        for ( int i = 0; i < owned; i++ ) {
+            Particle* p = system.particles[globalIndex[i]];
+            p->p = vec2r( x[2 * i], x[2 * i + 1] );
+            p->v = vec2r( v[2 * i], v[2 * i + 1] );
+        }
+        for ( int r = 1; r < transport.size(); r++ ) {
+            int count = 0;
+            transport.receive( r, &count, sizeof( count ) );
+            std::vector<int> indices( count );
+            std::vector<Real> state( 4 * count );
+            transport.receive( r, indices.data(), count * sizeof( int ) );
+            transport.receive( r, state.data(), state.size() * sizeof( Real ) );
+            for ( int k = 0; k < count; k++ ) {
+                Particle* p = system.particles[indices[k]];
+                p->p = vec2r( state[4 * k], state[4 * k + 1] );
+                p->v = vec2r( state[4 * k + 2], state[4 * k + 3] );
+            }
+        }
+    }
+
+private:
+    struct Block {
+        Real m[4];
+    };
+    /** Stiffness K and damping D blocks of each local spring for the current step */
+    std::vector<Block> stiffness;
+    std::vector<Block> damping;
+    /** Conjugate gradient vectors */
+    VectorXr r, z, d, q, diag;
+
+    /**
+     * Computes the owned entries of y = sum of K_s applied to the spring extensions,
+     * i.e., -dfdx y, from y at the owned and halo particles
+     */
+    void multiplyStiffness( const VectorXr& y, VectorXr& out ) const {
+        out.setZero( 2 * local );
+        addBlocks( stiffness, 1, y, out );
+    }
+
+    /**
+     * Adds scale * B_s ( y_a - y_b ) to the owned end a, and the negative to owned end b
+     */
+    void addBlocks( const std::vector<Block>& blocks, Real scale, const VectorXr& y, VectorXr& out ) const {
+        for ( size_t k = 0; k < springs.size(); k++ ) {
+            const LocalSpring& s = springs[k];
+            const Real* B = blocks[k].m;
+            Real ex = y[2 * s.a] - y[2 * s.b];
+            Real ey = y[2 * s.a + 1] - y[2 * s.b + 1];
+            Real bx = scale * ( B[0] * ex + B[1] * ey );
+            Real by = scale * ( B[2] * ex + B[3] * ey );
+            if ( s.ownsA ) {
+                out[2 * s.a] += bx;
+                out[2 * s.a + 1] += by;
+            }
+            if ( s.ownsB ) {
+                out[2 * s.b] -= bx;
+                out[2 * s.b + 1] -= by;
+            }
+        }
+    }
+
+    /**
+     * Computes the owned entries of ( M - h D - h^2 K ) y, with the halo entries of y
+     * exchanged first, and pinned entries zeroed
+     */
+    void multiply( Real h, VectorXr& y, VectorXr& out ) {
+        exchange( y );
+        out.setZero( 2 * local );
+        for ( int i = 0; i < owned; i++ ) {
+            out[2 * i] = ( mass[i] + h * viscousDamping ) * y[2 * i];
+            out[2 * i + 1] = ( mass[i] + h * viscousDamping ) * y[2 * i + 1];
+        }
+        addBlocks( damping, h, y, out );
+        addBlocks( stiffness, h * h, y, out );
+        filter( out );
+    }
+
+    /** Zeroes the pinned entries, and the halo entries */
+    void filter( VectorXr& y ) const {
+        for ( int i = 0; i < owned; i++ ) {
+            if ( invMass[i] == 0 ) y[2 * i] = y[2 * i + 1] = 0;
+        }
+        y.tail( 2 * ( local - owned ) ).setZero();
+    }
+
+    /**
+     * Sums a local dot product of the owned entries over all ranks
+     */
+    Real dot( const VectorXr& a, const VectorXr& b ) {
+        return transport.allReduceSum( (double) a.head( 2 * owned ).dot( b.head( 2 * owned ) ) );
+    }
+
+    /**
+     * Distributed Jacobi preconditioned conjugate gradient, as ConjugateGradient
+     * @param h step size
+     * @param b right hand side, filtered
+     * @param dv initial guess and solution
+     */
+    void solve( Real h, VectorXr& b, VectorXr& dv ) {
+        int n = 2 * local;
+        diag.setOnes( n );
+        for ( int i = 0; i < owned; i++ ) {
+            diag[2 * i] = diag[2 * i + 1] = mass[i] + h * viscousDamping;
+        }
+        for ( size_t k = 0; k < springs.size(); k++ ) {
+            const LocalSpring& s = springs[k];
+            for ( int e : { s.ownsA ? s.a : -1, s.ownsB ? s.b : -1 } ) {
+                if ( e < 0 ) continue;
+                diag[2 * e] += h * damping[k].m[0] + h * h * stiffness[k].m[0];
+                diag[2 * e + 1] += h * damping[k].m[3] + h * h * stiffness[k].m[3];
+            }
+        }
+        filter( b );
+        filter( dv );
+        multiply( h, dv, q );
+        r = b - q;
+        z = r.cwiseQuotient( diag );
+        d = z;
+        double sums[3] = { r.head( 2 * owned ).dot( z.head( 2 * owned ) ), b.head( 2 * owned ).squaredNorm(), r.head( 2 * owned ).squaredNorm() };
+        transport.allReduceSum( sums, 3 );
+        Real rz = sums[0];
+        Real bnorm = sqrt( sums[1] );
+        Real tol = solverTolerance * ( bnorm > 0 ? bnorm : 1 );
+        Real rnorm = sqrt( sums[2] );
+        iterations = 0;
+        while ( iterations < solverIterations && rnorm > tol ) {
+            multiply( h, d, q );
+            Real dq = dot( d, q );
+            if ( dq <= 0 ) break;
+            Real alpha = rz / dq;
+            dv += alpha * d;
+            r -= alpha * q;
+            z = r.cwiseQuotient( diag );
+            double s[2] = { r.head( 2 * owned ).dot( z.head( 2 * owned ) ), r.head( 2 * owned ).squaredNorm() };
+            transport.allReduceSum( s, 2 );
+            Real rzNew = s[0];
+            rnorm = sqrt( s[1] );
+            d = z + ( rzNew / rz ) * d;
+            rz = rzNew;
+            iterations++;
+        }
+    }
+};
@@ -0,0 +1,173 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "Spring.hpp"
+#include "Bending.hpp"
+
+/**
+ * Domain decomposition of the particles for the parallel force pass.  Domains
+ * are contiguous ranges of particle indices, made by ordering the particles with
+ * ParticleOrdering::graphPartition, and each domain is processed by one thread.
+ * Springs inside a domain are computed by it, while springs crossing between two
+ * domains are computed by both, each adding the force only to its own particle,
+ * so that no thread writes to another's particles and no shared force buffers
+ * or atomics are needed.  Bending elements are likewise computed by every domain
+ * holding one of their particles, each adding the forces on its own particles.
+ * The positions of the halo particles at the other ends of crossing springs are
+ * read directly from the shared arrays, made consistent by the barrier at the end
+ * of each parallel stage of the integrator.
+ *
+ * The data of each domain is first touched by the thread that owns it (see
+ * ParticleSystem::placeDomains), so on a multi-socket machine its pages are 
+ * placed in memory local to that thread's socket.
+ *
+ * Topology changes between reorderings keep the particle ranges of the domains
+ * and sort the springs and bending elements into them again, see rebuild.
+ * @author kry
+ */
+class DomainDecomposition {
+public:
+    struct Domain {
+        /** Range of particle indices */
+        int begin;
+        int end;
+        /** Springs with both ends in the domain */
+        std::vector<int> interior;
+        /** Crossing springs whose p1 is in the domain */
+        std::vector<int> firstEnds;
+        /** Crossing springs whose p2 is in the domain */
+        std::vector<int> secondEnds;
+        /** Bending elements with at least one particle in the domain */
+        std::vector<int> bending;
+    };
+
+    std::vector<Domain> domains;
+
+    /** Topology version for which the domains were built, see rebuild */
+    int version = -1;
+
+    /**
+     * @return the number of domains to use when none is requested, one per thread
+     */
+    static int defaultCount() {
+#ifdef _OPENMP
+        return omp_get_max_threads();
+#else
+        return 1;
+#endif
+    }
+
+    /**
+     * Builds the domains and sorts the springs and bending elements into them
+     * @param springs
+     * @param bending
+     * @param start first particle index of each domain, with a final entry of n
+     * @param topologyVersion
+     */
+    void build( const std::vector<Spring*>& springs, const std::vector<BendingElement>& bending, const std::vector<int>& start, int topologyVersion ) {
+        int count = start.size() - 1;
+        domains.assign( count, Domain() );
+        std::vector<int> domainOf( start.back() );
+        for ( int d = 0; d < count; d++ ) {
+            domains[d].begin = start[d];
+            domains[d].end = start[d + 1];
+            for ( int i = start[d]; i < start[d + 1]; i++ ) domainOf[i] = d;
+        }
+        for ( size_t k = 0; k < springs.size(); k++ ) {
+            int a = domainOf[springs[k]->p1->index];
+            int b = domainOf[springs[k]->p2->index];
+            if ( a == b ) {
+                domains[a].interior.push_back( k );
+            } else {
+                domains[a].firstEnds.push_back( k );
+                domains[b].secondEnds.push_back( k );
+            }
+        }
+        for ( size_t e = 0; e < bending.size(); e++ ) {
+            int a = domainOf[bending[e].i0];
+            int b = domainOf[bending[e].i1];
+            int c = domainOf[bending[e].i2];
+            domains[a].bending.push_back( e );
+            if ( b != a ) domains[b].bending.push_back( e );
+            if ( c != a && c != b ) domains[c].bending.push_back( e );
+        }
+        version = topologyVersion;
+    }
+
+    /**
+     * Sorts the springs and bending elements into the current particle ranges again
+     * after a topology change.  Particles added since the domains were built join the
+     * last domain, and domains left empty by removed particles are dropped, so the
+     * balance degrades until the next reordering rebuilds the ranges.
+     * @param springs
+     * @param bending
+     * @param n number of particles
+     * @param topologyVersion
+     */
+    void rebuild( const std::vector<Spring*>& springs, const std::vector<BendingElement>& bending, int n, int topologyVersion ) {
+        std::vector<int> start( 1, 0 );
+        for ( size_t d = 0; d + 1 < domains.size(); d++ ) {
+            int end = std::min( domains[d].end, n );
+            if ( end > start.back() ) start.push_back( end );
+        }
+        if ( n > start.back() || start.size() == 1 ) start.push_back( n );
+        build( springs, bending, start, topologyVersion );
+    }
+
+    /**
+     * Removes all domains, leaving the force pass serial
+     */
+    void clear() {
+        domains.clear();
+        version = -1;
+    }
+
+    /**
+     * Reallocates the spring and bending element lists of domain d, so that they are
+     * first touched by the calling thread
+     * @param d
+     */
+    void place( int d ) {
+        Domain& domain = domains[d];
+        std::vector<int>( domain.interior ).swap( domain.interior );
+        std::vector<int>( domain.firstEnds ).swap( domain.firstEnds );
+        std::vector<int>( domain.secondEnds ).swap( domain.secondEnds );
+        std::vector<int>( domain.bending ).swap( domain.bending );
+    }
+
+    /**
+     * @param topologyVersion
+     * @return true if the domains match the topology and there is more than one
+     */
+    bool valid( int topologyVersion ) const {
+        return version == topologyVersion && domains.size() > 1;
+    }
+
+    /** @return the number of springs computed twice, for reporting */
+    int crossingSprings() const {
+        int count = 0;
+        for ( const Domain& d : domains ) count += d.firstEnds.size();
+        return count;
+    }
+
+    /**
+     * Zeroes freshly allocated per particle arrays from the thread that owns each
+     * domain, with the same static schedule as the force pass, so that first touch
+     * places each domain's pages near its thread, for arrays allocated after
+     * ParticleSystem::placeDomains
+     * @param v array with stride values per particle
+     * @param stride
+     */
+    void firstTouch( VectorXr& v, int stride ) const {
+        int count = domains.size();
+        #pragma omp parallel for schedule(static, 1)
+        for ( int d = 0; d < count; d++ ) {
+            for ( int i = stride * domains[d].begin; i < stride * domains[d].end; i++ ) v[i] = 0;
+        }
+    }
+};
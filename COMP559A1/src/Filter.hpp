@@ -1,3 +1,6 @@
+#pragma once
+#include "Precision.hpp"
+
 /**
  * Velocity filter to use with a conjugate gradients solve
  * @author kry
@@ -8,5 +11,5 @@ public:
      * removes disallowed parts of v by projection
      * @param v
      */
-    virtual void filter(VectorXf& v) = 0;
+    virtual void filter(VectorXr& v) = 0;
 };
\ No newline at end of file
@@ -0,0 +1,107 @@
+#pragma once
+#include "Precision.hpp"
+
+/**
+ * Remembers the last state at which something was evaluated, such as the forces
+ * or the force Jacobians, so that asking again at the same state can reuse the
+ * result.  The state is compared exactly, as the state arrays are written in too
+ * many places to track, while everything else the result depends on is compared
+ * through a Context of version counters and settings.  The owner keeps the result,
+ * either in the values and forces vectors here or in its own storage.
+ *
+ * Copying the state on every store costs about as much as a few vector updates, so
+ * while lookups keep missing the cache only stores every probeInterval evaluations.
+ * A state that is evaluated repeatedly, such as a scene come to rest, is still
+ * caught by the next probe, after which every evaluation is stored again.
+ * @author kry
+ */
+class ForceCache {
+public:
+    /** Everything besides the state that the cached result depends on */
+    struct Context {
+        int topologyVersion;
+        int parameterVersion;
+        int massVersion;
+        /** Changes when particles are pinned, unpinned, put to sleep, or woken */
+        int fixedVersion;
+        Real gravity;
+        Real viscousDamping;
+        Real breakingStrain;
+
+        bool operator==( const Context& c ) const {
+            return topologyVersion == c.topologyVersion && parameterVersion == c.parameterVersion
+                && massVersion == c.massVersion && fixedVersion == c.fixedVersion && gravity == c.gravity
+                && viscousDamping == c.viscousDamping && breakingStrain == c.breakingStrain;
+        }
+    };
+
+    /** When false, lookups always miss and nothing is stored */
+    bool enabled = true;
+
+    /** Lookups that found the cached state, and those that did not */
+    long hits = 0;
+    long misses = 0;
+
+    /** Version of the cached state, incremented each time a new state is stored */
+    long version = 0;
+
+    /** Number of consecutive misses after which only every probeInterval-th state is stored */
+    int probeInterval = 64;
+
+    /** Results cached by the owner, for instance the derivatives and the particle forces */
+    VectorXr values;
+    VectorXr forces;
+
+    /**
+     * @param context
+     * @param x first part of the state
+     * @param xd second part of the state, may be empty
+     * @return true if the context and state are exactly those of the last store
+     */
+    bool lookup( const Context& context, const VectorXr& x, const VectorXr& xd ) {
+        if ( enabled && valid && context == this->context && sameState( x, xd ) ) {
+            hits++;
+            missStreak = 0;
+            return true;
+        }
+        misses++;
+        missStreak++;
+        return false;
+    }
+
+    /**
+     * Remembers the context and state, after which the owner stores its results,
+     * unless the cache is disabled or skipping stores after a streak of misses
+     * @param context
+     * @param x
+     * @param xd
+     * @return true if the owner should store its results
+     */
+    bool store( const Context& context, const VectorXr& x, const VectorXr& xd ) {
+        if ( !enabled || ( missStreak > probeInterval && missStreak % probeInterval != 0 ) ) return false;
+        this->context = context;
+        this->x = x;
+        this->xd = xd;
+        valid = true;
+        version++;
+        return true;
+    }
+
+    /**
+     * Forgets the cached state, for when its result is overwritten
+     */
+    void invalidate() {
+        valid = false;
+    }
+
+private:
+    bool valid = false;
+    int missStreak = 0;
+    Context context;
+    VectorXr x;
+    VectorXr xd;
+
+    bool sameState( const VectorXr& x, const VectorXr& xd ) const {
+        return x.size() == this->x.size() && xd.size() == this->xd.size() && x == this->x && xd == this->xd;
+    }
+};
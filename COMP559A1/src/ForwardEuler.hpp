@@ -1,10 +1,9 @@
+#pragma once
 #include <string>
 #include "Integrator.hpp"
 #include "Function.hpp"
+#include "StateUpdate.hpp"
 
-/**
- * TODO: finish this class!
- */
 class ForwardEuler : public Integrator {
 public:
 
@@ -12,6 +11,10 @@ public:
         return "Forward Euler";
     }
 
+    VectorXr dpdt;
+    /** Rounding error carried between steps by the compensated precision policy */
+    VectorXr error;
+
     /**
      * Advances the system at t by h
      * @param p The state at time h (don't modify, passed by ref for speed)
@@ -21,9 +24,16 @@ public:
      * @param pout  The state of the system at time t+h
      * @param derivs The object which computes the derivative of the system state
      */
-    void step(VectorXf& p, int n, float t, float h, VectorXf& pout, Function* derivs) {
-        // TODO: Objective 3, implement the forward Euler method
-
+    void step(VectorXr& p, int n, float t, float h, VectorXr& pout, Function* derivs) {
+        if ( dpdt.size() != n ) {
+            dpdt.resize( n );
+            error.setZero( n );
+        }
+        if ( pout.size() != n ) pout.resize( n );
+        derivs->derivs( t, p, dpdt );
+        const Real a[] = { h };
+        const Real* k[] = { dpdt.data() };
+        StateUpdate::combine<Precision>( n, pout.data(), p.data(), a, k, error.data(), backend );
     }
 
-};
\ No newline at end of file
+};
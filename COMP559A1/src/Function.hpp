@@ -1,16 +1,19 @@
 #ifndef COMP599_FUNCTION
 #define COMP599_FUNCTION
-#include <Eigen/Dense>
-using Eigen::MatrixXf;
-using Eigen::VectorXf;
+#include "Precision.hpp"
 
 /**
     * Interface for a class that computes an unknown function's derivative
     * and checks that a provided state is valid.
+    * @param P precision policy, see Precision.hpp
     * @author kry
     */
-class Function {
+template <typename P>
+class FunctionT {
 public:
+    typedef typename P::Scalar Scalar;
+    typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+
     /**
         * Evaluates derivatives for ODE integration.
         * The forces could be time varying, which is why t is provided, but
@@ -21,7 +24,9 @@ public:
         * @param p phase space state (don't modify, passed by ref for efficiency)
         * @param dpdt to be filled with the derivative
         */
-    virtual void derivs(float t, VectorXf& p, VectorXf& dpdt) = 0;
+    virtual void derivs(float t, Vector& p, Vector& dpdt) = 0;
 
 };
+
+typedef FunctionT<Precision> Function;
 #endif
@@ -4,6 +4,8 @@
 
 #include "Function.hpp"
 
+class Backend;
+
 /**
  * Interface for a numerical integration method
  * 
@@ -27,12 +29,21 @@
  * See the NR book online, chapter 17, for additional information on integration of ODEs:
  * http://www.nrbook.com/nr3/
  * 
+ * The precision policy P (see Precision.hpp) gives the scalar type of the state.
+ * 
  * @author kry
  */
 
-class Integrator {
+template <typename P>
+class IntegratorT {
 
 public:
+    typedef typename P::Scalar Scalar;
+    typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+
+    /** Backend for the state updates, or NULL for the built in loops, set by the particle system */
+    Backend* backend = NULL;
+
     /**
      * @return the name of this numerical integration method
      */
@@ -47,6 +58,8 @@ public:
      * @param pout  The state of the system at time t+h
      * @param derivs The object which computes the derivative of the system state
      */
-	virtual void step(VectorXf& p, int n, float t, float h, VectorXf& pout, Function* derivs) = 0;
+	virtual void step(Vector& p, int n, float t, float h, Vector& pout, FunctionT<P>* derivs) = 0;
 };
+
+typedef IntegratorT<Precision> Integrator;
 #endif
\ No newline at end of file
@@ -0,0 +1,121 @@
+#pragma once
+#include <vector>
+#include <numeric>
+
+#include "Particle.hpp"
+#include "Spring.hpp"
+#include "Bending.hpp"
+#include "TopologyListener.hpp"
+
+/**
+ * Connected components of the graph of particles joined by springs and bending
+ * elements, kept in a union find structure over particle indices.  Additions
+ * merge islands incrementally.  Removals can split an island, so they mark the
+ * structure dirty and it is rebuilt from scratch the next time it is used.
+ * Particles whose island changed are recorded so that sleeping islands can be
+ * woken when something touches them.
+ * @author kry
+ */
+class Islands : public TopologyListener {
+public:
+    /** Union find parent of each particle, roots are their own parent */
+    std::vector<int> parent;
+
+    /** Number of consecutive calm steps of the island of each root */
+    std::vector<int> calmSteps;
+
+    /** True when removals have made the union find structure stale */
+    bool dirty = false;
+
+    /** Particles whose island was merged or split since the last call to clearTouched */
+    std::vector<int> touched;
+
+    /**
+     * @param i particle index
+     * @return the root particle of the island of i
+     */
+    int find( int i ) {
+        while ( parent[i] != i ) {
+            parent[i] = parent[parent[i]];
+            i = parent[i];
+        }
+        return i;
+    }
+
+    /**
+     * Merges the islands of two particles, restarting the calm step count
+     * @param a
+     * @param b
+     */
+    void unite( int a, int b ) {
+        int ra = find( a );
+        int rb = find( b );
+        if ( ra == rb ) return;
+        if ( rb < ra ) std::swap( ra, rb );
+        parent[rb] = ra;
+        calmSteps[ra] = 0;
+        touched.push_back( ra );
+    }
+
+    /**
+     * Rebuilds the islands from scratch, all with no calm steps.  Touched particles
+     * are kept, but merges made by the rebuild itself do not count as touches.
+     * @param n number of particles
+     * @param springs
+     * @param bendingElements
+     */
+    void rebuild( int n, const std::vector<Spring*>& springs, const std::vector<BendingElement>& bendingElements ) {
+        std::vector<int> keep;
+        for ( int i : touched ) {
+            if ( i < n ) keep.push_back( i );
+        }
+        parent.resize( n );
+        std::iota( parent.begin(), parent.end(), 0 );
+        calmSteps.assign( n, 0 );
+        dirty = false;
+        for ( Spring* s : springs ) unite( s->p1->index, s->p2->index );
+        for ( const BendingElement& e : bendingElements ) {
+            unite( e.i0, e.i1 );
+            unite( e.i1, e.i2 );
+        }
+        touched = keep;
+    }
+
+    void clearTouched() {
+        touched.clear();
+    }
+
+    void particleAdded( Particle* p ) {
+        parent.push_back( p->index );
+        calmSteps.push_back( 0 );
+    }
+
+    void particleRemoved( int index, int last ) {
+        parent.pop_back();
+        calmSteps.pop_back();
+        dirty = true;
+        if ( index != last ) touched.push_back( index );
+    }
+
+    void springAdded( Spring* s ) {
+        if ( dirty ) {
+            touched.push_back( s->p1->index );
+            return;
+        }
+        unite( s->p1->index, s->p2->index );
+        touched.push_back( s->p1->index );
+    }
+
+    void springRemoved( Spring* s ) {
+        dirty = true;
+        touched.push_back( s->p1->index );
+        touched.push_back( s->p2->index );
+    }
+
+    void topologyCleared() {
+        parent.clear();
+        calmSteps.clear();
+        touched.clear();
+        dirty = true;
+    }
+};
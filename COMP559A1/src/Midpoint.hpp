@@ -1,5 +1,7 @@
+#pragma once
 #include <string>
 #include "Integrator.hpp"
+#include "StateUpdate.hpp"
 
 class Midpoint : public Integrator {
 public:
@@ -7,14 +9,31 @@ public:
         return "midpoint";
     }
 
-    float* tmp;
-    int tmplength;
-
-    void step(VectorXf& p, int n, float t, float h, VectorXf& pout, Function* derivs) {
-        // TODO: Objective 4, implement midpoint method
-
-        // You will probably want a temporary array in this method 
+    /** Midpoint state and the derivatives at the start and at the midpoint, kept between steps */
+    VectorXr tmp;
+    VectorXr k1;
+    VectorXr k2;
+    /** Rounding error carried between steps by the compensated precision policy */
+    VectorXr error;
 
+    void step(VectorXr& p, int n, float t, float h, VectorXr& pout, Function* derivs) {
+        if ( tmp.size() != n ) {
+            tmp.resize( n );
+            k1.resize( n );
+            k2.resize( n );
+            error.setZero( n );
+        }
+        if ( pout.size() != n ) pout.resize( n );
+        derivs->derivs( t, p, k1 );
+        {
+            const Real a[] = { h / 2 };
+            const Real* k[] = { k1.data() };
+            StateUpdate::combine( n, tmp.data(), p.data(), a, k, backend );
+        }
+        derivs->derivs( t + h / 2, tmp, k2 );
+        const Real a[] = { h };
+        const Real* k[] = { k2.data() };
+        StateUpdate::combine<Precision>( n, pout.data(), p.data(), a, k, error.data(), backend );
     }
 
 };
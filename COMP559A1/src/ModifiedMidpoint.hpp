@@ -1,6 +1,13 @@
+#pragma once
 #include <string>
 #include "Integrator.hpp"
+#include "StateUpdate.hpp"
 
+/**
+ * The 2/3 method, which evaluates the second derivative two thirds of the way
+ * through the step and weights the two derivatives 1/4 and 3/4, with the final
+ * combination done in one pass, see StateUpdate.
+ */
 class ModifiedMidpoint : public Integrator {
 public:
 
@@ -8,10 +15,30 @@ public:
         return "modified midpoint";
     }
 
-    void step(VectorXf& p, int n, float t, float h, VectorXf& pout, Function* derivs) {
-        // TODO: Objective 5, implmement the modified midpoint (2/3) method.
-        // see also efficient memory management suggestion in provided code for the Midpoint method.
+    VectorXr tmp;
+    VectorXr k1;
+    VectorXr k2;
+    /** Rounding error carried between steps by the compensated precision policy */
+    VectorXr error;
 
+    void step(VectorXr& p, int n, float t, float h, VectorXr& pout, Function* derivs) {
+        if ( tmp.size() != n ) {
+            tmp.resize( n );
+            k1.resize( n );
+            k2.resize( n );
+            error.setZero( n );
+        }
+        if ( pout.size() != n ) pout.resize( n );
+        derivs->derivs( t, p, k1 );
+        {
+            const Real a[] = { 2 * h / 3 };
+            const Real* k[] = { k1.data() };
+            StateUpdate::combine( n, tmp.data(), p.data(), a, k, backend );
+        }
+        derivs->derivs( t + 2 * h / 3, tmp, k2 );
+        const Real a[] = { h / 4, 3 * h / 4 };
+        const Real* k[] = { k1.data(), k2.data() };
+        StateUpdate::combine<Precision>( n, pout.data(), p.data(), a, k, error.data(), backend );
     }
 
-};
\ No newline at end of file
+};
@@ -0,0 +1,66 @@
+#pragma once
+#include <string>
+#include "Integrator.hpp"
+#include "SplitFunction.hpp"
+
+/**
+ * Multi-rate symplectic Euler, an impulse method in the style of r-RESPA.  Each
+ * step of h kicks all velocities with the slow forces, drifts the slow particles
+ * by h, and then takes a number of symplectic Euler substeps of the fast forces
+ * on only the fast particles.  Forces between fast and slow particles belong to
+ * the slow part and are applied as one impulse per step, which keeps the coupling
+ * at the boundary symplectic.  When the derivative function cannot be split, this
+ * is a plain symplectic Euler step.
+ */
+class MultiRate : public Integrator {
+public:
+    std::string getName() {
+        return "multi-rate symplectic Euler";
+    }
+
+    VectorXr dpdt;
+
+    /** Number of fast substeps taken in the last step */
+    int fastSubsteps = 0;
+
+    void step(VectorXr &p, int n, float t, float h, VectorXr &pout, Function* derivs) {
+        if ( dpdt.size() != n ) dpdt.resize( n );
+        SplitFunction* split = dynamic_cast<SplitFunction*>( derivs );
+        if ( split == NULL ) {
+            derivs->derivs( t, p, dpdt );
+            pout = p;
+            kickDrift( 0, n, h, pout );
+            fastSubsteps = 0;
+            return;
+        }
+        fastSubsteps = split->partition( h );
+        split->slowDerivs( t, p, dpdt );
+        pout = p;
+        kickDrift( 0, n, h, pout );
+        // fast particles start their substeps from where they were, with the kicked velocity
+        const std::vector<int>& fast = split->fastParticles();
+        for ( int i : fast ) {
+            pout[4 * i] = p[4 * i];
+            pout[4 * i + 1] = p[4 * i + 1];
+        }
+        float hf = h / fastSubsteps;
+        for ( int k = 0; k < fastSubsteps; k++ ) {
+            split->fastDerivs( t + k * hf, pout, dpdt );
+            for ( int i : fast ) kickDrift( 4 * i, 4 * i + 4, hf, pout );
+        }
+    }
+
+private:
+    /**
+     * Symplectic Euler update of the state entries from begin to end, using the
+     * accelerations in dpdt
+     */
+    inline void kickDrift( int begin, int end, float h, VectorXr& pout ) {
+        for ( int i = begin; i < end; i += 4 ) {
+            pout[i + 2] += h * dpdt[i + 2];
+            pout[i + 3] += h * dpdt[i + 3];
+            pout[i] += h * pout[i + 2];
+            pout[i + 1] += h * pout[i + 3];
+        }
+    }
+};
@@ -10,32 +10,42 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
-class Spring;
+#include "Precision.hpp"
+
+template <typename P> class SpringT;
 
 /**
  * Particle class that contains particle properties (e.g., mass), 
  * initial positions and velocities, current position and velocities 
  * and a force accumulator for computing the total force acting on this particle.
+ * @param P precision policy, see Precision.hpp
  * @author kry
  */
-class Particle {
+template <typename P>
+class ParticleT {
 public:
+    typedef typename P::Scalar Scalar;
+    typedef glm::vec<2, Scalar, glm::defaultp> Vec2;
+
     /** Identifies this particles position in the particle list */
     int index;
 
     bool pinned = false;
 
+    /** Set while the particle's island is asleep, see ParticleSystem::updateSleeping */
+    bool asleep = false;
+
     glm::vec3 color{ 0.0f, 0.95f, 0.0f };
 
     float size = 10;
 
-    float mass = 1;
+    Scalar mass = 1;
 
-    glm::vec2 p;
-    glm::vec2 v;
-    glm::vec2 p0;
-    glm::vec2 v0;
-    glm::vec2 f;
+    Vec2 p;
+    Vec2 v;
+    Vec2 p0;
+    Vec2 v0;
+    Vec2 f;
 
 
     /**
@@ -43,10 +53,10 @@ public:
      * to adjust rest lengths when dragging particles around.
      * This is only used for UI... it is probably not needed for simulation
      */
-    std::vector<Spring*> springs;
+    std::vector<SpringT<P>*> springs;
 
     /** Default constructor */
-    Particle() {}
+    ParticleT() {}
 
     /**
      * Creates a particle with the given position and velocity
@@ -55,9 +65,9 @@ public:
      * @param vx
      * @param vy
      */
-    Particle( float x, float y, float vx, float vy) {
-        p0 = glm::vec2(x, y);
-        v0 = glm::vec2(vx, vy);
+    ParticleT( Scalar x, Scalar y, Scalar vx, Scalar vy) {
+        p0 = Vec2(x, y);
+        v0 = Vec2(vx, vy);
         reset();
     }
 
@@ -67,21 +77,28 @@ public:
     void reset() {
         p = p0;
         v = v0;
-        f = glm::vec2(0, 0);
+        f = Vec2(0, 0);
+    }
+
+    /**
+     * @return true if the particle does not move, because it is pinned or asleep
+     */
+    bool fixed() const {
+        return pinned || asleep;
     }
 
     /**
      * Clears all forces acting on this particle
      */
     void clearForce() {
-        f = glm::vec2(0, 0);
+        f = Vec2(0, 0);
     }
 
     /**
      * Adds the given force to this particle
      * @param force
      */
-    void addForce(glm::vec2 force) {
+    void addForce(Vec2 force) {
         f += force;
     }
 
@@ -92,8 +109,10 @@ public:
      * @return the distance
      */
     float distance(float x, float y) {
-        glm::vec2 diff = p - glm::vec2(x, y);
+        Vec2 diff = p - Vec2(x, y);
         
         return (float) sqrt( diff.x*diff.x + diff.y*diff.y);
     }
 };
+
+typedef ParticleT<Precision> Particle;
@@ -0,0 +1,244 @@
+#pragma once
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <cstdint>
+
+#include "Particle.hpp"
+#include "Spring.hpp"
+#include "Bending.hpp"
+
+/**
+ * Computes cache friendly orderings of the particles.  Each method returns an 
+ * order where order[k] is the current index of the particle that should be 
+ * placed at index k.
+ */
+class ParticleOrdering {
+public:
+    /**
+     * Orders particles along a Morton (Z-order) curve through their positions, so 
+     * that particles close in space are close in memory.
+     * @param particles
+     * @return the new order
+     */
+    static std::vector<int> morton( const std::vector<Particle*>& particles ) {
+        int n = particles.size();
+        std::vector<int> order( n );
+        if ( n == 0 ) return order;
+        vec2r lo = particles[0]->p;
+        vec2r hi = particles[0]->p;
+        for ( Particle* p : particles ) {
+            lo = vec2r( std::min( lo.x, p->p.x ), std::min( lo.y, p->p.y ) );
+            hi = vec2r( std::max( hi.x, p->p.x ), std::max( hi.y, p->p.y ) );
+        }
+        Real ext = std::max( std::max( hi.x - lo.x, hi.y - lo.y ), Real( 1e-6 ) );
+        std::vector<std::pair<uint32_t, int>> keys( n );
+        for ( int i = 0; i < n; i++ ) {
+            uint32_t qx = (uint32_t) ( ( particles[i]->p.x - lo.x ) / ext * 65535 );
+            uint32_t qy = (uint32_t) ( ( particles[i]->p.y - lo.y ) / ext * 65535 );
+            keys[i] = std::make_pair( spread( qx ) | ( spread( qy ) << 1 ), i );
+        }
+        std::sort( keys.begin(), keys.end() );
+        for ( int k = 0; k < n; k++ ) order[k] = keys[k].second;
+        return order;
+    }
+
+    /**
+     * Reverse Cuthill-McKee ordering of the spring graph, which reduces the 
+     * bandwidth, i.e., the index distance between the two ends of each spring.
+     * Each connected component starts from a minimum degree particle.
+     * @param particles
+     * @return the new order
+     */
+    static std::vector<int> reverseCuthillMcKee( const std::vector<Particle*>& particles ) {
+        int n = particles.size();
+        std::vector<int> order;
+        order.reserve( n );
+        std::vector<bool> visited( n, false );
+        std::vector<int> byDegree( n );
+        for ( int i = 0; i < n; i++ ) byDegree[i] = i;
+        std::stable_sort( byDegree.begin(), byDegree.end(), [&]( int a, int b ) {
+            return particles[a]->springs.size() < particles[b]->springs.size();
+        } );
+        std::vector<int> neighbours;
+        for ( int start : byDegree ) {
+            if ( visited[start] ) continue;
+            std::queue<int> queue;
+            queue.push( start );
+            visited[start] = true;
+            while ( !queue.empty() ) {
+                int i = queue.front();
+                queue.pop();
+                order.push_back( i );
+                neighbours.clear();
+                for ( Spring* s : particles[i]->springs ) {
+                    int j = s->p1->index == i ? s->p2->index : s->p1->index;
+                    if ( !visited[j] ) {
+                        visited[j] = true;
+                        neighbours.push_back( j );
+                    }
+                }
+                std::sort( neighbours.begin(), neighbours.end(), [&]( int a, int b ) {
+                    return particles[a]->springs.size() < particles[b]->springs.size();
+                } );
+                for ( int j : neighbours ) queue.push( j );
+            }
+        }
+        std::reverse( order.begin(), order.end() );
+        return order;
+    }
+
+    /**
+     * Partitions the graph of the springs and bending elements into domains of nearly
+     * equal size by recursive bisection.  Each part is split at the middle of a breadth
+     * first ordering from a pseudo peripheral particle, so that the split follows a 
+     * level set of the graph distance and cuts few springs and bending elements.  
+     * Particles are ordered by domain, and in breadth first order within each domain.
+     * @param particles
+     * @param bending bending elements, which couple each of their three particles to the other two
+     * @param count number of domains
+     * @param start set to the first new index of each domain, with a final entry of n
+     * @return the new order
+     */
+    static std::vector<int> graphPartition( const std::vector<Particle*>& particles, const std::vector<BendingElement>& bending, 
+            int count, std::vector<int>& start ) {
+        int n = particles.size();
+        Graph graph( particles, bending );
+        std::vector<int> order( n );
+        for ( int i = 0; i < n; i++ ) order[i] = i;
+        std::vector<int> part( n, 0 );
+        start.assign( 1, 0 );
+        bisect( graph, order, part, 0, n, std::max( count, 1 ), 0, start );
+        return order;
+    }
+
+    /**
+     * Average index distance between the two ends of each spring, a simple proxy 
+     * for the locality of the spring endpoint reads in the force computation.
+     * @param springs
+     * @return average bandwidth
+     */
+    static double averageBandwidth( const std::vector<Spring*>& springs ) {
+        if ( springs.empty() ) return 0;
+        double sum = 0;
+        for ( Spring* s : springs ) sum += std::abs( s->p1->index - s->p2->index );
+        return sum / springs.size();
+    }
+
+private:
+    /**
+     * Neighbours of each particle through springs and bending elements, with those
+     * of particle i in adjacency[begin[i], begin[i+1]), duplicates included
+     */
+    struct Graph {
+        std::vector<int> begin;
+        std::vector<int> adjacency;
+
+        Graph( const std::vector<Particle*>& particles, const std::vector<BendingElement>& bending ) {
+            int n = particles.size();
+            begin.assign( n + 1, 0 );
+            for ( int i = 0; i < n; i++ ) begin[i + 1] = particles[i]->springs.size();
+            for ( const BendingElement& e : bending ) {
+                begin[e.i0 + 1] += 2;
+                begin[e.i1 + 1] += 2;
+                begin[e.i2 + 1] += 2;
+            }
+            for ( int i = 0; i < n; i++ ) begin[i + 1] += begin[i];
+            adjacency.resize( begin[n] );
+            std::vector<int> next( begin.begin(), begin.end() - 1 );
+            for ( int i = 0; i < n; i++ ) {
+                for ( Spring* s : particles[i]->springs ) {
+                    adjacency[next[i]++] = s->p1->index == i ? s->p2->index : s->p1->index;
+                }
+            }
+            for ( const BendingElement& e : bending ) {
+                int idx[3] = { e.i0, e.i1, e.i2 };
+                for ( int a = 0; a < 3; a++ ) {
+                    adjacency[next[idx[a]]++] = idx[( a + 1 ) % 3];
+                    adjacency[next[idx[a]]++] = idx[( a + 2 ) % 3];
+                }
+            }
+        }
+    };
+
+    /**
+     * Splits order[begin,end), the particles with the given part label, into count
+     * domains, appending the domain starts after the first.  The labels of the two
+     * halves are set to fresh values so that the breadth first searches stay 
+     * within their half.
+     */
+    static void bisect( const Graph& graph, std::vector<int>& order, std::vector<int>& part,
+            int begin, int end, int count, int label, std::vector<int>& start ) {
+        if ( end - begin > 0 ) breadthFirst( graph, order, part, begin, end, label );
+        if ( count == 1 ) {
+            start.push_back( end );
+            return;
+        }
+        int lower = count / 2;
+        int mid = begin + (int) ( (long) ( end - begin ) * lower / count );
+        int labelA = 2 * label + 1;
+        int labelB = 2 * label + 2;
+        for ( int k = begin; k < end; k++ ) part[order[k]] = k < mid ? labelA : labelB;
+        bisect( graph, order, part, begin, mid, lower, labelA, start );
+        bisect( graph, order, part, mid, end, count - lower, labelB, start );
+    }
+
+    /**
+     * Reorders order[begin,end) breadth first over the graph edges between particles
+     * with the given label, starting from a pseudo peripheral particle found with
+     * a second search from the last particle reached by a first.  Disconnected 
+     * pieces are appended one after the other.
+     */
+    static void breadthFirst( const Graph& graph, std::vector<int>& order, std::vector<int>& part,
+            int begin, int end, int label ) {
+        std::vector<int> members( order.begin() + begin, order.begin() + end );
+        // the last particle reached from an arbitrary root is far from it
+        int root = search( graph, members, part, label, members[0] ).back();
+        std::vector<int> levels = search( graph, members, part, label, root );
+        std::copy( levels.begin(), levels.end(), order.begin() + begin );
+    }
+
+    /**
+     * Breadth first search from root over the particles with the given label,
+     * continuing from the next unvisited member when a piece is exhausted
+     * @return the particles in the order visited
+     */
+    static std::vector<int> search( const Graph& graph, const std::vector<int>& members, 
+            std::vector<int>& part, int label, int root ) {
+        // visited particles are marked by negating their label
+        int visitedLabel = -label - 1;
+        std::vector<int> visited;
+        visited.reserve( members.size() );
+        size_t next = 0;
+        size_t head = 0;
+        visited.push_back( root );
+        part[root] = visitedLabel;
+        while ( visited.size() < members.size() ) {
+            if ( head == visited.size() ) {
+                while ( part[members[next]] != label ) next++;
+                visited.push_back( members[next] );
+                part[members[next]] = visitedLabel;
+            }
+            int i = visited[head++];
+            for ( int q = graph.begin[i]; q < graph.begin[i + 1]; q++ ) {
+                int j = graph.adjacency[q];
+                if ( part[j] == label ) {
+                    part[j] = visitedLabel;
+                    visited.push_back( j );
+                }
+            }
+        }
+        for ( int i : visited ) part[i] = label;
+        return visited;
+    }
+
+    /** Spreads the low 16 bits of x to the even bits of the result */
+    static uint32_t spread( uint32_t x ) {
+        x &= 0xffff;
+        x = ( x | ( x << 8 ) ) & 0x00ff00ff;
+        x = ( x | ( x << 4 ) ) & 0x0f0f0f0f;
+        x = ( x | ( x << 2 ) ) & 0x33333333;
+        x = ( x | ( x << 1 ) ) & 0x55555555;
+        return x;
+    }
+};
@@ -1,4 +1,6 @@
+#pragma once
 #include <vector>
+#include <chrono>
 
 #define GLEW_STATIC
 #include <GL/glew.h>
@@ -13,34 +15,71 @@
 
 #include "Particle.hpp"
 #include "Spring.hpp"
+#include "Bending.hpp"
 #include "Integrator.hpp"
 #include "ForwardEuler.hpp"
 #include "Midpoint.hpp"
 #include "ModifiedMidpoint.hpp"
 #include "RK4.hpp"
 #include "SymplecticEuler.hpp"
+#include "MultiRate.hpp"
+#include "SplitFunction.hpp"
 #include "Filter.hpp"
+#include "TopologyListener.hpp"
+#include "BlockSparseMatrix.hpp"
+#include "ConjugateGradient.hpp"
+#include "DirectSolver.hpp"
+#include "XPBD.hpp"
+#include "ProjectiveDynamics.hpp"
+#include "ParticleOrdering.hpp"
+#include "Colliders.hpp"
+#include "Diagnostics.hpp"
+#include "Islands.hpp"
+#include "Domains.hpp"
+#include "Backend.hpp"
+#include "ForceCache.hpp"
 
 #include <Eigen/Dense>
-using Eigen::MatrixXf;
-using Eigen::VectorXf;
+#include "Precision.hpp"
 
 using namespace std;
 /**
  * Implementation of a simple particle system
  * @author kry
  */
-class ParticleSystem : public Function, Filter {
+class ParticleSystem : public SplitFunction, Filter, TopologyListener {
     
 public:
     std::vector<Particle*> particles;
     std::vector<Spring*> springs;
+
+    /** 
+     * Three particle bending elements, stored by value so that the force pass 
+     * streams through them.  These are used by all the integrators except 
+     * projective dynamics, which ignores them.  XPBD treats them as angle constraints.
+     */
+    std::vector<BendingElement> bendingElements;
+
+    /** 
+     * Incremented whenever particles or springs are added or removed, so that
+     * solvers can tell when their cached topology dependent data is stale 
+     */
+    int topologyVersion = 0;
+
+    /** 
+     * Objects notified of every particle and spring addition and removal so that
+     * they can update their topology dependent data incrementally 
+     */
+    std::vector<TopologyListener*> listeners;
     
     /**
      * Creates an empty particle system
      */
     ParticleSystem() {
-        // do nothing
+        listeners.push_back( this );
+        listeners.push_back( &xpbd );
+        listeners.push_back( &projectiveDynamics );
+        listeners.push_back( &islands );
     }
 
     /**
@@ -48,17 +87,12 @@ public:
      * @param which
      */
     void createSystem( int which ) {
-        
         if ( which == 1) {        
             glm::vec2 p( 100, 100 );
             glm::vec2 d( 20, 0 );            
-            Particle* p1 = new Particle( p.x - d.y, p.y + d.x, 0, 0 );
-            p1->index = particles.size();
-            particles.push_back( p1 );
-            Particle* p2 = new Particle( p.x + d.y, p.y - d.x, 0, 0 );
-            p2->index = particles.size();
-            particles.push_back( p2 );
-            springs.push_back( new Spring ( p1, p2 ) );           
+            Particle* p1 = createParticle( p.x - d.y, p.y + d.x, 0, 0 );
+            Particle* p2 = createParticle( p.x + d.y, p.y - d.x, 0, 0 );
+            createSpring( p1, p2 );           
             p1->pinned = true;
             p2->pinned = true;            
             p += d;
@@ -66,54 +100,260 @@ public:
             int N = 10;
             for (int i = 1; i < N; i++ ) {                
                 //d.set( 20*Math.cos(i*Math.PI/N), 20*Math.sin(i*Math.PI/N) );                
-                Particle* p3 = new Particle( p.x - d.y, p.y + d.x, 0, 0 );
-                p3->index = particles.size();
-                particles.push_back( p3 );
-                Particle* p4 = new Particle( p.x + d.y, p.y - d.x, 0, 0 );
-                p4->index = particles.size();
-                particles.push_back( p4 );
-                springs.push_back( new Spring (p3, p1 ) );
-                springs.push_back( new Spring (p3, p2 ) );
-                springs.push_back( new Spring (p3, p2 ) );
-                springs.push_back( new Spring (p4, p1 ) );
-                springs.push_back( new Spring (p4, p2 ) );
-                springs.push_back( new Spring (p4, p3 ) );
+                Particle* p3 = createParticle( p.x - d.y, p.y + d.x, 0, 0 );
+                Particle* p4 = createParticle( p.x + d.y, p.y - d.x, 0, 0 );
+                createSpring( p3, p1 );
+                createSpring( p3, p2 );
+                createSpring( p3, p2 );
+                createSpring( p4, p1 );
+                createSpring( p4, p2 );
+                createSpring( p4, p3 );
                 p1 = p3;
                 p2 = p4;                
                 p += d;
                 p += d;            
             }
         } else if ( which == 2) {
-            Particle* p1 = new Particle( 320, 100, 0, 0 );
-            p1->index = particles.size();
-            particles.push_back( p1 );
-            Particle* p2 = new Particle( 320, 200, 0, 0 );
-            p2->index = particles.size();
-            particles.push_back( p2 );
+            Particle* p1 = createParticle( 320, 100, 0, 0 );
+            Particle* p2 = createParticle( 320, 200, 0, 0 );
             p1->pinned = true;
-            springs.push_back( new Spring( p1, p2 ) );
+            createSpring( p1, p2 );
         } else if ( which == 3 ) {
-            float ypos = 100;
+            Real ypos = 100;
             Particle* p0 = NULL;
-            Particle* p1 = new Particle(320, ypos, 0, 0);
+            Particle* p1 = createParticle(320, ypos, 0, 0);
             Particle* p2;
-            p1->index = particles.size();
             p1->pinned = true;            
-            particles.push_back( p1 );
             int N = 10;
             for ( int i = 0; i < N; i++ ) {
                 ypos += 20;
-                p2 = new Particle( 320, ypos, 0, 0 );
-                p2->index = particles.size();
-                particles.push_back( p2 );
-                springs.push_back( new Spring( p1, p2 ) );                
-                // Hum.. this is not great in comparison to a proper bending energy...
-                // use Maple to generate some code though, as it is painful to write by hand! :(
-                if ( p0 != NULL ) springs.push_back( new Spring( p2, p0 ) );
+                p2 = createParticle( 320, ypos, 0, 0 );
+                createSpring( p1, p2 );                
+                if ( p0 != NULL ) createBendingElement( p0, p1, p2 );
                 p0 = p1;
                 p1 = p2;
             }
         }
+        if ( reorderMethod != NO_REORDERING ) {
+            reorderParticles();
+        }
+    }
+
+    /** 
+     * Cache friendly particle orderings, see ParticleOrdering.  GRAPH_PARTITION
+     * also sets up the domains for the parallel force pass.
+     */
+    enum ReorderMethod { NO_REORDERING, MORTON, REVERSE_CUTHILL_MCKEE, GRAPH_PARTITION };
+
+    /** Ordering applied when a test system is created and every reorderInterval steps */
+    ReorderMethod reorderMethod = NO_REORDERING;
+
+    /** Number of steps between reorderings, or zero to only reorder at scene load */
+    int reorderInterval = 0;
+
+    /** Number of domains made by GRAPH_PARTITION, or zero for one per thread */
+    int domainCount = 0;
+
+    /** 
+     * Domains of the parallel force pass.  Spring breaking and interactive edits keep
+     * the particle ranges of the domains until the next reordering, see updateDomains
+     * and reorderInterval.
+     */
+    DomainDecomposition domains;
+
+    /** Number of steps taken since the last reordering */
+    int stepsSinceReorder = 0;
+
+    /**
+     * Reorders the particles with the current reorder method.
+     */
+    void reorderParticles() {
+        if ( reorderMethod != GRAPH_PARTITION ) domains.clear();
+        if ( reorderMethod == MORTON ) {
+            setParticleOrder( ParticleOrdering::morton( particles ) );
+        } else if ( reorderMethod == REVERSE_CUTHILL_MCKEE ) {
+            setParticleOrder( ParticleOrdering::reverseCuthillMcKee( particles ) );
+        } else if ( reorderMethod == GRAPH_PARTITION ) {
+            std::vector<int> start;
+            int count = domainCount > 0 ? domainCount : DomainDecomposition::defaultCount();
+            setParticleOrder( ParticleOrdering::graphPartition( particles, bendingElements, count, start ), start );
+        }
+        stepsSinceReorder = 0;
+    }
+
+    /**
+     * Rebuilds the domains for the current topology if it changed since they were
+     * built, see DomainDecomposition::rebuild
+     * @return true if the force pass uses the domains
+     */
+    bool updateDomains() {
+        if ( domains.version != topologyVersion && !domains.domains.empty() ) {
+            domains.rebuild( springs, bendingElements, particles.size(), topologyVersion );
+        }
+        return domains.valid( topologyVersion );
+    }
+
+    /**
+     * Permutes the particles so that the particle at index order[k] moves to index k,
+     * then orients each spring so that p1 has the smaller index and sorts the springs
+     * by their first endpoint.  The springs are reallocated in sorted order so that
+     * they are also visited in memory order.  All topology dependent data is rebuilt.
+     * @param order
+     * @param domainStart first new index of each domain of the parallel force pass, 
+     * with a final entry of n, or empty to keep the force pass serial
+     */
+    void setParticleOrder( const std::vector<int>& order, const std::vector<int>& domainStart = std::vector<int>() ) {
+        std::vector<Particle*> old = particles;
+        for ( size_t k = 0; k < order.size(); k++ ) {
+            particles[k] = old[order[k]];
+            particles[k]->index = k;
+        }
+        for ( Spring* s : springs ) {
+            if ( s->p1->index > s->p2->index ) std::swap( s->p1, s->p2 );
+        }
+        std::vector<int> newIndex( order.size() );
+        for ( size_t k = 0; k < order.size(); k++ ) newIndex[order[k]] = k;
+        for ( BendingElement& e : bendingElements ) {
+            e.i0 = newIndex[e.i0];
+            e.i1 = newIndex[e.i1];
+            e.i2 = newIndex[e.i2];
+        }
+        std::sort( springs.begin(), springs.end(), []( Spring* a, Spring* b ) {
+            return a->p1->index < b->p1->index || ( a->p1->index == b->p1->index && a->p2->index < b->p2->index );
+        } );
+        topologyVersion++;
+        if ( !domainStart.empty() ) {
+            domains.build( springs, bendingElements, domainStart, topologyVersion );
+            placeDomains();
+            // placeDomains rebuilt the implicit solver storage of this system
+            rebuildListeners( this );
+            return;
+        }
+        for ( Particle* p : particles ) {
+            p->springs.clear();
+        }
+        for ( Spring*& s : springs ) {
+            Spring* copy = new Spring( *s );
+            delete s;
+            s = copy;
+            s->p1->springs.push_back( s );
+            s->p2->springs.push_back( s );
+        }
+        rebuildListeners();
+    }
+
+    /**
+     * Reallocates the data of each domain from the thread that owns it, in one parallel
+     * region with the same static schedule as the force pass, so that first touch places
+     * it in memory local to that thread.  The springs, which are sorted by p1, belong to
+     * the domain of p1.  Once they are all copied, each domain rebuilds the spring lists
+     * of its particles, its own spring and bending element lists, its range of the split
+     * arrays, and its block rows of the implicit solver matrices.
+     */
+    void placeDomains() {
+        updateSpringEnds();
+        updateIncidence();
+        int n = particles.size();
+        int m = springs.size();
+        int count = domains.domains.size();
+        std::vector<int> firstSpring( count + 1, m );
+        for ( int d = count - 1, k = m; d >= 0; d-- ) {
+            while ( k > 0 && springEnds[2 * ( k - 1 )] >= domains.domains[d].begin ) k--;
+            firstSpring[d] = k;
+        }
+        positions.resize( 2 * n );
+        velocities.resize( 2 * n );
+        forces.resize( 2 * n );
+        A.clear();
+        dfdx.clear();
+        dfdv.clear();
+        A.rows.resize( n );
+        dfdx.rows.resize( n );
+        dfdv.rows.resize( n );
+        deltaxdot.setZero( 2 * n );
+        b.resize( 2 * n );
+        #pragma omp parallel
+        {
+            #pragma omp for schedule(static, 1)
+            for ( int d = 0; d < count; d++ ) {
+                for ( int k = firstSpring[d]; k < firstSpring[d + 1]; k++ ) {
+                    Spring* copy = new Spring( *springs[k] );
+                    delete springs[k];
+                    springs[k] = copy;
+                }
+            }
+            #pragma omp for schedule(static, 1)
+            for ( int d = 0; d < count; d++ ) {
+                domains.place( d );
+                for ( int i = domains.domains[d].begin; i < domains.domains[d].end; i++ ) {
+                    std::vector<Spring*> list;
+                    list.reserve( incidenceStart[i + 1] - incidenceStart[i] );
+                    for ( int q = incidenceStart[i]; q < incidenceStart[i + 1]; q++ ) {
+                        list.push_back( springs[incidence[q] >> 1] );
+                    }
+                    particles[i]->springs.swap( list );
+                    for ( int j = 2 * i; j < 2 * i + 2; j++ ) positions[j] = velocities[j] = forces[j] = 0;
+                    placeRow( i );
+                }
+            }
+        }
+        implicitStorageValid = true;
+        jacobianCache.invalidate();
+    }
+
+    /**
+     * Builds block row i of the implicit solver matrices from the incidence lists, with
+     * the same blocks in the same order as adding the particles, the springs, and the
+     * bending elements one by one does
+     * @param i
+     */
+    void placeRow( int i ) {
+        std::vector<BlockSparseMatrix::Block> row;
+        row.push_back( BlockSparseMatrix::Block{ i, 1, { 0, 0, 0, 0 } } );
+        auto addRef = [&]( int c ) {
+            for ( BlockSparseMatrix::Block& block : row ) {
+                if ( block.col == c ) {
+                    block.refs++;
+                    return;
+                }
+            }
+            row.push_back( BlockSparseMatrix::Block{ c, 1, { 0, 0, 0, 0 } } );
+        };
+        for ( int q = incidenceStart[i]; q < incidenceStart[i + 1]; q++ ) {
+            int k = incidence[q] >> 1;
+            addRef( springEnds[2 * k + 1 - ( incidence[q] & 1 )] );
+        }
+        for ( int q = bendingIncidenceStart[i]; q < bendingIncidenceStart[i + 1]; q++ ) {
+            const BendingElement& e = bendingElements[bendingIncidence[q] / 3];
+            // addBendingPattern adds the pairs (i0,i1), (i1,i2), and (i0,i2)
+            int a = bendingIncidence[q] % 3;
+            if ( a == 0 ) {
+                addRef( e.i1 );
+                addRef( e.i2 );
+            } else if ( a == 1 ) {
+                addRef( e.i0 );
+                addRef( e.i2 );
+            } else {
+                addRef( e.i1 );
+                addRef( e.i0 );
+            }
+        }
+        A.rows[i] = row;
+        dfdx.rows[i] = row;
+        dfdv.rows[i] = row;
+    }
+
+    /**
+     * Has all listeners rebuild their topology dependent data from scratch
+     * @param skip a listener whose data is already rebuilt, or NULL
+     */
+    void rebuildListeners( TopologyListener* skip = NULL ) {
+        for ( TopologyListener* l : listeners ) {
+            if ( l == skip ) continue;
+            l->topologyCleared();
+            for ( Particle* p : particles ) l->particleAdded( p );
+            for ( Spring* s : springs ) l->springAdded( s );
+        }
     }
    
     
@@ -125,6 +365,9 @@ public:
             p->reset();
         }
         time = 0;
+        stateChanged();
+        diagnostics.clear();
+        wakeAll();
     }
     
     /**
@@ -135,13 +378,20 @@ public:
         particles.clear();
         for (Spring* s : springs) { delete s; }
         springs.clear();
+        bendingElements.clear();
+        brokenSprings.clear();
+        diagnostics.clear();
+        sleepingIndices.clear();
+        domains.clear();
+        topologyVersion++;
+        for ( TopologyListener* l : listeners ) l->topologyCleared();
     }
     
     /**
      * Gets the phase space state of the particle system
      * @param phaseSpaceState
      */
-    void getPhaseSpace( VectorXf& phaseSpaceState ) {
+    void getPhaseSpace( VectorXr& phaseSpaceState ) {
         int count = 0;
         for ( Particle* p : particles ) {
             phaseSpaceState[count++] = p->p.x;
@@ -161,20 +411,53 @@ public:
     }
     
     /**
-     * Sets the phase space state of the particle system
+     * Sets the phase space state of the particle system.  Pinned particles have zero 
+     * derivatives so their positions come back unchanged, and their velocities are zeroed.
      * @param phaseSpaceState
      */
-    void setPhaseSpace( VectorXf& phaseSpaceState ) {
+    void setPhaseSpace( VectorXr& phaseSpaceState ) {
         int count = 0;
         for ( Particle* p : particles ) {
-            if ( p->pinned ) {
-                count += 4;
-            } else {
-                p->p.x = phaseSpaceState[count++];
-                p->p.y = phaseSpaceState[count++];
-                p->v.x = phaseSpaceState[count++];
-                p->v.y = phaseSpaceState[count++];
+            p->p.x = phaseSpaceState[count++];
+            p->p.y = phaseSpaceState[count++];
+            p->v.x = phaseSpaceState[count++];
+            p->v.y = phaseSpaceState[count++];
+        }
+        for ( int i : pinnedIndices ) {
+            particles[i]->v = vec2r(0, 0);
+        }
+        for ( int i : sleepingIndices ) {
+            particles[i]->v = vec2r(0, 0);
+        }
+    }
+
+    /** Indices of the pinned particles, rebuilt by updatePinned at the start of each advance */
+    std::vector<int> pinnedIndices;
+
+    /**
+     * Rebuilds the list of pinned particles.  The pinned flags are set directly by the
+     * interface, so this is done once per call to advance rather than tracked.
+     */
+    void updatePinned() {
+        size_t count = 0;
+        bool changed = false;
+        for ( Particle* p : particles ) {
+            if ( !p->pinned ) continue;
+            if ( count == pinnedIndices.size() ) {
+                pinnedIndices.push_back( p->index );
+                changed = true;
+            } else if ( pinnedIndices[count] != p->index ) {
+                pinnedIndices[count] = p->index;
+                changed = true;
             }
+            count++;
+        }
+        changed |= count != pinnedIndices.size();
+        pinnedIndices.resize( count );
+        if ( changed ) {
+            invalidateMasses();
+            wakeAll();
+            fixedVersion++;
         }
     }
     
@@ -182,87 +465,74 @@ public:
      * Fixes positions and velocities after a step to deal with collisions 
      */
     void postStepFix() {
-        for ( Particle* p : particles ) {
-            if ( p->pinned ) {
-                p->v = glm::vec2(0,0);
-            }
+        for ( int i : pinnedIndices ) {
+            particles[i]->v = vec2r(0,0);
         }
         // do wall collisions
-        float r = restitution;
+        Real r = restitution;
         for ( Particle* p : particles ) {            
-            if ( p->p.x <= 0 ) {
-                p->p.x = 0;
-                if ( p->v.x < 0 ) p->v.x = - p->v.x * r;
-                if ( p->f.x < 0 ) p->f.x = 0;                
-            }
-            if ( p->p.x >= width ) {
-                p->p.x = width;
-                if (p->v.x > 0 ) p->v.x = - p->v.x * r;
-                if (p->f.x > 0 ) p->f.x = 0;
-            } 
-            
-            if ( p->p.y >= height ) {
-                p->p.y = height;
-                if ( p->v.y > 0 ) p->v.y = - p->v.y * r;
-                if ( p->f.y > 0 ) p->f.y = 0;
-            } 
-            if ( p->p.y <= 0 ) {
-                p->p.y = 0;
-                if ( p->v.y < 0 ) p->v.y = - p->v.y * r;
-                if ( p->f.y < 0 ) p->f.y = 0;
-            }
+            wall( p->p.x, p->v.x, p->f.x, 0, width, r );
+            wall( p->p.y, p->v.y, p->f.y, 0, height, r );
         }
     }
+
+    /**
+     * Branch free wall collision of one coordinate against the interval [lo, hi].  The
+     * coordinate is clamped, an outgoing velocity is reflected and scaled by the 
+     * restitution, and an outgoing force is removed.
+     */
+    static inline void wall( Real& x, Real& v, Real& f, Real lo, Real hi, Real r ) {
+        bool below = x <= lo;
+        bool above = x >= hi;
+        bool out = ( below & ( v < 0 ) ) | ( above & ( v > 0 ) );
+        bool push = ( below & ( f < 0 ) ) | ( above & ( f > 0 ) );
+        x = std::min( std::max( x, lo ), hi );
+        v = out ? -v * r : v;
+        f = push ? 0 : f;
+    }
     
     /** Elapsed simulation time */
     double time = 0;
 
     /** The explicit integrator to use, if not performing backward Euler implicit integration */
-    Integrator* integrator;
+    Integrator* integrator = NULL;
     
-    VectorXf state;
-    VectorXf stateOut;
-
-    // these get created in init() and are probably useful for Backward Euler computations
-    //ConjugateGradientMTJ CG;
-    MatrixXf A;
-    MatrixXf dfdx;
-    MatrixXf dfdv;
-    VectorXf deltaxdot;
-    VectorXf b;
-    VectorXf f;
-    VectorXf xdot;
+    VectorXr state;
+    VectorXr stateOut;
+
+    // these get created in init() and kept up to date incrementally as the topology changes
+    ConjugateGradient CG;
+    BlockSparseMatrix A;
+    BlockSparseMatrix dfdx;
+    BlockSparseMatrix dfdv;
+    VectorXr deltaxdot;
+    VectorXr b;
     
     /**
      * Fills in the provided vector with the particle velocities.
      * @param xd
      */
-    void getVelocities(VectorXf& xd) {
+    void getVelocities(VectorXr& xd) {
         for ( Particle* p : particles ) {
             int j = p->index * 2;
-            if( p->pinned ) {
-                xd[j] = 0;
-                xd[j + 1]= 0;
-            } else {
-                xd[j] = p->v.x;
-                xd[j + 1] = p->v.y;
-            }
-        }       
+            xd[j] = p->v.x;
+            xd[j + 1] = p->v.y;
+        }
+        filter( xd );
     }
 
     /**
      * Sets the velocities of the particles given a vector
      * @param xd
      */
-    void setVelocities(VectorXf& xd) {
+    void setVelocities(VectorXr& xd) {
         for ( Particle* p : particles ) {
             int j = p->index * 2;
-            if( p->pinned ) {
-                p->v = glm::vec2(0, 0);
-            } else {
-                p->v.x = xd[j];
-                p->v.y = xd[j + 1];
-            }
+            p->v.x = xd[j];
+            p->v.y = xd[j + 1];
+        }
+        for ( int i : pinnedIndices ) {
+            particles[i]->v = vec2r(0, 0);
         }
     }
     
@@ -272,177 +542,2498 @@ public:
      * @param p phase space state (don't modify)
      * @param dydt to be filled with the derivative
      */
-    void derivs(float t, VectorXf& p, VectorXf& dpdt) {
+    void derivs(float t, VectorXr& p, VectorXr& dpdt) {
         // set particle positions to given values
         setPhaseSpace( p );
+        ForceCache::Context context = forceContext();
+        if ( !diagnosticsPending && derivsCache.lookup( context, p, VectorXr() ) ) {
+            dpdt = derivsCache.values;
+            const VectorXr& f = derivsCache.forces;
+            for ( Particle* q : particles ) q->f = vec2r( f[2 * q->index], f[2 * q->index + 1] );
+            return;
+        }
         
-        // TODO: Objective 2, for explicit integrators, compute forces, and accelerations, and set dpdt
-        
-        
+        for ( Particle* p : particles ) {
+            p->clearForce();
+            if ( useGravity ) p->addForce( vec2r( 0, p->mass * gravity ) );
+            p->addForce( p->v * -viscousDamping );
+        }
+        if ( diagnosticsPending ) {
+            derivsForcesAndDiagnostics();
+        } else {
+            for ( Spring* s : springs ) {
+                if ( s->p1->asleep && s->p2->asleep ) continue;
+                checkBreaking( s, s->apply() );
+            }
+            for ( BendingElement& e : bendingElements ) {
+                e.apply( particles );
+            }
+        }
+        int count = 0;
+        for ( Particle* p : particles ) {
+            if ( p->fixed() ) {
+                dpdt.segment<4>( count ).setZero();
+                count += 4;
+            } else {
+                dpdt[count++] = p->v.x;
+                dpdt[count++] = p->v.y;
+                dpdt[count++] = p->f.x / p->mass;
+                dpdt[count++] = p->f.y / p->mass;
+            }
+        }
+        if ( derivsCache.store( context, p, VectorXr() ) ) {
+            derivsCache.values = dpdt;
+            derivsCache.forces.resize( 2 * particles.size() );
+            for ( Particle* q : particles ) {
+                derivsCache.forces[2 * q->index] = q->f.x;
+                derivsCache.forces[2 * q->index + 1] = q->f.y;
+            }
+        }
+    }
+
+    /**
+     * Caches of the last derivatives, split array forces, and force Jacobians, so that
+     * evaluating them again at the same state is skipped, see ForceCache
+     */
+    ForceCache derivsCache;
+    ForceCache forceCache;
+    ForceCache jacobianCache;
+
+    /** Incremented when particles are pinned, unpinned, put to sleep, or woken */
+    int fixedVersion = 0;
 
+    /**
+     * @return everything besides the state that the forces depend on, for the force caches
+     */
+    ForceCache::Context forceContext() const {
+        return ForceCache::Context{ topologyVersion, parameterVersion, massVersion, fixedVersion, 
+            useGravity ? gravity : 0, viscousDamping, breakingStrain };
     }
-    
-    /** Time in seconds that was necessary to advance the system */
-    float computeTime;
-    
+
     /**
-     * Advances the state of the system
-     * @param elapsed
+     * Computes the forces from split arrays as computeForces, unless they were last
+     * computed at the same state and can be copied from the force cache.  Used by the
+     * implicit solvers, which can evaluate the same state more than once.  Forces are
+     * always computed when diagnostics are pending, as they are measured in the same pass.
+     * @param x positions
+     * @param xd velocities
+     * @param force to be filled with the total force on each particle
      */
-    void advanceTime( float elapsed ) {
-        for (Spring* s : springs) {
-            s->k = springStiffness;
-            s->c = springDamping;
+    void evaluateForces( const VectorXr& x, const VectorXr& xd, VectorXr& force ) {
+        ForceCache::Context context = forceContext();
+        if ( !diagnosticsPending && forceCache.lookup( context, x, xd ) ) {
+            force = forceCache.values;
+            return;
+        }
+        computeForces( x, xd, force );
+        if ( forceCache.store( context, x, xd ) ) {
+            forceCache.values = force;
         }
-            
-        int n = getPhaseSpaceDim();
-        
-        double now = glfwGetTime();
-        
-        if (useExplicitIntegration) {
-            if ( n != state.size() ) {
-                state.resize(n);;
-                stateOut.resize(n);
-            }
-            // TODO: See explicit stepping here
-            getPhaseSpace(state);         
-            integrator->step( state, n, time, elapsed, stateOut, this);                
-            setPhaseSpace(stateOut);
-        } else {        
-            if ( f.size() != n ) {
-                init();
-            }
-            
-            // TODO: Objective 8, your backward Euler implementation will go here!
-            // Note that the init() method called above creates a bunch of very 
-            // useful MTJ working variables for you, and the ConjugateGradientMTJ object.
-            // Go look at that code now!
-            
-            
-            
-            
-        }
-        time = time + elapsed;
-        postStepFix();
-        computeTime = (glfwGetTime() - now);
     }
-    
-    void filter(VectorXf& v) {
-        for ( Particle* p : particles ) {
-            if ( !p->pinned ) continue;
-            v[ p->index*2+0] = 0;
-            v[ p->index*2+1] = 0;
+
+    /**
+     * Fills dfdx and dfdv at the split array positions, unless they are already
+     * at these positions
+     */
+    void assembleJacobians() {
+        bool free = matrixFree();
+        if ( free != jacobiansMatrixFree ) {
+            jacobianCache.invalidate();
+            jacobiansMatrixFree = free;
         }
+        ForceCache::Context context = forceContext();
+        if ( jacobianCache.lookup( context, positions, VectorXr() ) ) return;
+        assembleSpringJacobians();
+        if ( !free ) {
+            assembleBendingJacobians();
+            gatherJacobians();
+        }
+        // dfdx and dfdv hold the result, so a skipped store must forget the old state
+        if ( !jacobianCache.store( context, positions, VectorXr() ) ) jacobianCache.invalidate();
+    }
+
+    /** 
+     * Solve the implicit systems with conjugate gradients on products computed from
+     * the springs by the backend, see Backend::springMultiply, instead of assembling
+     * dfdx, dfdv, and the system matrix.  This needs a backend and is only used for 
+     * scenes without bending elements, and never with the direct solver.
+     */
+    bool useMatrixFree = false;
+
+    /** True if the Jacobians were last evaluated for matrix free solves */
+    bool jacobiansMatrixFree = false;
+
+    /** 
+     * Blocks of dfdx, dfdv, and the implicit system matrix of each spring, as used by
+     * Backend::springMultiply, the system matrix diagonal of each particle without 
+     * the springs, and the diagonal of the whole system matrix, for matrix free solves
+     */
+    VectorXr springDfdx;
+    VectorXr springDfdv;
+    VectorXr springSystem;
+    VectorXr systemDiagonal;
+    VectorXr systemPreconditioner;
+
+    /** @return true if the implicit solves are matrix free, see useMatrixFree */
+    bool matrixFree() {
+        return useMatrixFree && backend != NULL && bendingElements.empty();
     }
 
     /**
-     * Creates a new particle and adds it to the system
-     * @param x
-     * @param y
-     * @param vx
-     * @param vy
-     * @return the new particle
+     * Calls body( begin, end ) over chunks of the indices from 0 to n - 1, with the
+     * backend if there is one and with OpenMP otherwise, in the same fixed chunks
+     * @param n
+     * @param body
      */
-    Particle* createParticle( float x, float y, float vx, float vy ) {
-        Particle* p = new Particle( x, y, vx, vy );
-        p->index = particles.size();
-        particles.push_back( p );
-        return p;
+    void parallelFor( int n, const std::function<void( int, int )>& body ) {
+        if ( backend != NULL ) {
+            backend->parallelFor( n, body );
+            return;
+        }
+        int chunks = ( n + Backend::grain - 1 ) / Backend::grain;
+        #pragma omp parallel for schedule(dynamic)
+        for ( int c = 0; c < chunks; c++ ) {
+            body( c * Backend::grain, std::min( n, ( c + 1 ) * Backend::grain ) );
+        }
     }
-    
-    void remove( Particle* p ) {
-    	for ( Spring* s : p->springs ) {
-    		Particle* other = s->p1 == p ? s->p2 : s->p1; 
-            // remove from the other particle's spring list
-            vector<Spring*>::iterator osi = std::remove(other->springs.begin(), other->springs.end(), s);
-            other->springs.erase(osi);
-            // and remove from the master list
-            vector<Spring*>::iterator si = std::remove(springs.begin(), springs.end(), s);
-            springs.erase(si);
-            delete s;
-    	}
 
-    	particles.erase( std::remove(particles.begin(),particles.end(), p ) );
-    	// reset indices of each particle :(
-    	for ( int i = 0 ; i < particles.size(); i++ ) {
-    		particles[i]->index = i;
-    	}
+    /**
+     * Fills the spring blocks of dfdx and dfdv at the split array positions, for
+     * matrix free solves and for gatherJacobians.  The block of a spring in 
+     * Backend::springMultiply is the diagonal block it adds to the assembled matrix.
+     */
+    void assembleSpringJacobians() {
+        updateSpringEnds();
+        updateIncidence();
+        int m = springs.size();
+        springDfdx.resize( 4 * m );
+        springDfdv.resize( 4 * m );
+        const int* ends = springEnds.data();
+        Real* K = springDfdx.data();
+        Real* D = springDfdv.data();
+        parallelFor( m, [&]( int begin, int end ) {
+            for ( int k = begin; k < end; k++ ) {
+                springs[k]->stiffnessBlock( ends[2 * k], ends[2 * k + 1], positions, K + 4 * k );
+                springs[k]->dampingBlock( ends[2 * k], ends[2 * k + 1], positions, D + 4 * k );
+                for ( int j = 0; j < 4; j++ ) {
+                    K[4 * k + j] = -K[4 * k + j];
+                    D[4 * k + j] = -D[4 * k + j];
+                }
+            }
+        } );
     }
-    
+
+    /** Nine blocks of dfdx and of dfdv of each bending element, see BendingElement::stiffnessBlocks */
+    VectorXr bendingDfdx;
+    VectorXr bendingDfdv;
+
     /**
-     * Creates a new spring between two particles and adds it to the system.
-     * @param p1
-     * @param p2
-     * @return the new spring
+     * Fills the bending element blocks of dfdx and dfdv at the split array positions
      */
-    Spring* createSpring( Particle* p1, Particle* p2 ) {
-        Spring* s = new Spring( p1, p2 ); 
-        springs.push_back( s );         
-        return s;
+    void assembleBendingJacobians() {
+        int nb = bendingElements.size();
+        bendingDfdx.resize( 36 * nb );
+        bendingDfdv.resize( 36 * nb );
+        Real* K = bendingDfdx.data();
+        Real* D = bendingDfdv.data();
+        parallelFor( nb, [&]( int begin, int end ) {
+            for ( int e = begin; e < end; e++ ) {
+                bendingElements[e].stiffnessBlocks( positions, K + 36 * e );
+                bendingElements[e].dampingBlocks( positions, D + 36 * e );
+            }
+        } );
     }
-    
+
     /**
-     * Removes a spring between p1 and p2 if it exists, does nothing otherwise
-     * @param p1
-     * @param p2
-     * @return true if the spring was found and removed
+     * Fills dfdx and dfdv from the spring and bending element blocks, one block row per
+     * particle in parallel.  Each row adds the blocks of its springs in spring order and
+     * then those of its bending elements in element order, which is the order the
+     * elements' addDfdx and addDfdv add them in, so the result is exactly the same.
      */
-    bool removeSpring( Particle* p1 = new Particle, Particle* p2 = new Particle ) {
-    	Spring* found = NULL;
-    	for ( Spring* s : springs ) {
-    		if ( ( s->p1 == p1 && s->p2 == p2 ) || ( s->p1 == p2 && s->p2 == p1 ) ) {
-    			found = s;
-    			break;
-    		}
-    	}
-    	if ( found != NULL ) {
-            found->p1->springs.erase(std::remove(found->p1->springs.begin(), found->p1->springs.end(), found));
-            found->p2->springs.erase(std::remove(found->p2->springs.begin(), found->p2->springs.end(), found));
-            springs.erase(std::remove(springs.begin(),springs.end(), found));
-			return true;
-    	}
-    	return false;
+    void gatherJacobians() {
+        int n = particles.size();
+        const int* ends = springEnds.data();
+        const int* start = incidenceStart.data();
+        const int* inc = incidence.data();
+        const int* bstart = bendingIncidenceStart.data();
+        const int* binc = bendingIncidence.data();
+        const Real* sK = springDfdx.data();
+        const Real* sD = springDfdv.data();
+        const Real* bK = bendingDfdx.data();
+        const Real* bD = bendingDfdv.data();
+        parallelFor( n, [&]( int begin, int end ) {
+            for ( int i = begin; i < end; i++ ) {
+                for ( BlockSparseMatrix::Block& b : dfdx.rows[i] ) std::fill( b.m, b.m + 4, Real( 0 ) );
+                for ( BlockSparseMatrix::Block& b : dfdv.rows[i] ) std::fill( b.m, b.m + 4, Real( 0 ) );
+                Real* Kii = dfdx.rows[i][0].m;
+                Real* Dii = dfdv.rows[i][0].m;
+                for ( int q = start[i]; q < start[i + 1]; q++ ) {
+                    int k = inc[q] >> 1;
+                    int other = ends[2 * k + 1 - ( inc[q] & 1 )];
+                    const Real* K = sK + 4 * k;
+                    const Real* D = sD + 4 * k;
+                    Real* Kij = dfdx.block( i, other ).m;
+                    Real* Dij = dfdv.block( i, other ).m;
+                    for ( int j = 0; j < 4; j++ ) {
+                        Kii[j] += K[j];
+                        Kij[j] -= K[j];
+                        Dii[j] += D[j];
+                        Dij[j] -= D[j];
+                    }
+                }
+                for ( int q = bstart[i]; q < bstart[i + 1]; q++ ) {
+                    const BendingElement& e = bendingElements[binc[q] / 3];
+                    int a = binc[q] % 3;
+                    int idx[3] = { e.i0, e.i1, e.i2 };
+                    for ( int b = 0; b < 3; b++ ) {
+                        int o = 36 * ( binc[q] / 3 ) + 4 * ( 3 * a + b );
+                        Real* K = dfdx.block( i, idx[b] ).m;
+                        Real* D = dfdv.block( i, idx[b] ).m;
+                        for ( int j = 0; j < 4; j++ ) {
+                            K[j] -= bK[o + j];
+                            D[j] -= bD[o + j];
+                        }
+                    }
+                }
+            }
+        } );
     }
-    
-    void init() {
-        // do nothing
+
+    /**
+     * Computes y = dfdx x, from the spring blocks for matrix free solves
+     */
+    void multiplyStiffness( const VectorXr& x, VectorXr& y ) {
+        if ( jacobiansMatrixFree ) {
+            backend->springMultiply( VectorXr(), springDfdx, springEnds, incidenceStart, incidence, x, y );
+        } else {
+            multiply( dfdx, x, y );
+        }
     }
 
-    int height;
-    int width;
+    /** Springs, bending elements, and particles of the fast part for multi-rate integration */
+    std::vector<Spring*> fastSprings;
+    std::vector<Spring*> slowSprings;
+    std::vector<BendingElement> fastBendingElements;
+    std::vector<int> slowBendingElements;
+    std::vector<int> fastParticleIndices;
+    /** Fast spring ends, indexing the fast particles */
+    std::vector<int> fastSpringEnds;
+    /** Positions, velocities, and forces of the fast particles, gathered for each fast substep */
+    VectorXr fastPositions;
+    VectorXr fastVelocities;
+    VectorXr fastForces;
+    /** State for which the partition was made */
+    int partitionTopologyVersion = -1;
+    int partitionParameterVersion = -1;
+    float partitionStepSize = -1;
+    float partitionMargin = -1;
+    int partitionSubsteps = 1;
 
-    void display() {
+    /**
+     * Splits the springs and bending elements for multi-rate integration.  A particle
+     * is stiff when its Gershgorin frequency bound, as in estimateMaxFrequency, is 
+     * above the symplectic Euler limit at step h scaled by the stability margin.
+     * Every spring and bending element touching a stiff particle is fast, and the
+     * fast particles are all those touched by fast forces, so the slow forces only
+     * act among particles that are stable at step h.  The partition is only made
+     * again when the topology, parameters, masses, step size, or margin change.
+     * @param h step size of the slow part
+     * @return number of fast substeps per step
+     */
+    int partition( float h ) {
+        if ( massVersion != topologyVersion ) updateMasses();
+        if ( partitionTopologyVersion == topologyVersion && partitionParameterVersion == parameterVersion 
+            && partitionStepSize == h && partitionMargin == stabilityMargin ) return partitionSubsteps;
+        int n = particles.size();
+        VectorXr rowSum = VectorXr::Zero( n );
+        for ( Spring* s : springs ) {
+            rowSum[s->p1->index] += 2 * s->k;
+            rowSum[s->p2->index] += 2 * s->k;
+        }
+        for ( const BendingElement& e : bendingElements ) {
+            vec2r g[3];
+            vec2r xs[3] = { particles[e.i0]->p, particles[e.i1]->p, particles[e.i2]->p };
+            BendingElement::gradient( xs, g );
+            Real sum = glm::length( g[0] ) + glm::length( g[1] ) + glm::length( g[2] );
+            int idx[3] = { e.i0, e.i1, e.i2 };
+            for ( int a = 0; a < 3; a++ ) rowSum[idx[a]] += e.k * glm::length( g[a] ) * sum;
+        }
+        Real limit = 2 * stabilityMargin / h;
+        Real fastest = 0;
+        std::vector<char> stiff( n ), fast( n );
+        for ( int i = 0; i < n; i++ ) {
+            Real omega = std::sqrt( rowSum[i] * invMass[i] );
+            stiff[i] = omega > limit;
+            if ( stiff[i] ) fastest = std::max( fastest, omega );
+        }
+        fastSprings.clear();
+        slowSprings.clear();
+        for ( Spring* s : springs ) {
+            if ( stiff[s->p1->index] || stiff[s->p2->index] ) {
+                fastSprings.push_back( s );
+                fast[s->p1->index] = fast[s->p2->index] = true;
+            } else {
+                slowSprings.push_back( s );
+            }
+        }
+        fastBendingElements.clear();
+        slowBendingElements.clear();
+        for ( size_t k = 0; k < bendingElements.size(); k++ ) {
+            const BendingElement& e = bendingElements[k];
+            if ( stiff[e.i0] || stiff[e.i1] || stiff[e.i2] ) {
+                fast[e.i0] = fast[e.i1] = fast[e.i2] = true;
+            } else {
+                slowBendingElements.push_back( k );
+            }
+        }
+        fastParticleIndices.clear();
+        std::vector<int> local( n, -1 );
+        for ( int i = 0; i < n; i++ ) {
+            if ( !fast[i] ) continue;
+            local[i] = fastParticleIndices.size();
+            fastParticleIndices.push_back( i );
+        }
+        fastSpringEnds.resize( 2 * fastSprings.size() );
+        for ( size_t k = 0; k < fastSprings.size(); k++ ) {
+            fastSpringEnds[2 * k] = local[fastSprings[k]->p1->index];
+            fastSpringEnds[2 * k + 1] = local[fastSprings[k]->p2->index];
+        }
+        for ( const BendingElement& e : bendingElements ) {
+            if ( !( stiff[e.i0] || stiff[e.i1] || stiff[e.i2] ) ) continue;
+            BendingElement copy = e;
+            copy.i0 = local[e.i0];
+            copy.i1 = local[e.i1];
+            copy.i2 = local[e.i2];
+            fastBendingElements.push_back( copy );
+        }
+        int nf = fastParticleIndices.size();
+        fastPositions.resize( 2 * nf );
+        fastVelocities.resize( 2 * nf );
+        fastForces.resize( 2 * nf );
+        partitionSubsteps = std::max( 1, (int) std::ceil( fastest / limit ) );
+        partitionTopologyVersion = topologyVersion;
+        partitionParameterVersion = parameterVersion;
+        partitionStepSize = h;
+        partitionMargin = stabilityMargin;
+        return partitionSubsteps;
+    }
 
-        glPointSize( 10 );
-        glBegin( GL_POINTS );
+    const std::vector<int>& fastParticles() {
+        return fastParticleIndices;
+    }
+
+    /**
+     * Evaluates derivatives for all particles with gravity, viscous damping, and the
+     * slow springs and bending elements, as derivs does for all of them.
+     * @param t time 
+     * @param p phase space state (don't modify)
+     * @param dpdt to be filled with the derivative
+     */
+    void slowDerivs( float t, VectorXr& p, VectorXr& dpdt ) {
+        // the diagnostics measure the whole system, so take them with a full evaluation
+        if ( diagnosticsPending ) derivs( t, p, dpdt );
+        setPhaseSpace( p );
         for ( Particle* p : particles ) {
-            double alpha = 0.5;
-            if ( p->pinned ) {
-                glColor4d( 1, 0, 0, alpha );
+            p->clearForce();
+            if ( useGravity ) p->addForce( vec2r( 0, p->mass * gravity ) );
+            p->addForce( p->v * -viscousDamping );
+        }
+        for ( Spring* s : slowSprings ) {
+            checkBreaking( s, s->apply() );
+        }
+        for ( int k : slowBendingElements ) {
+            bendingElements[k].apply( particles );
+        }
+        int count = 0;
+        for ( Particle* p : particles ) {
+            if ( p->fixed() ) {
+                dpdt.segment<4>( count ).setZero();
+                count += 4;
             } else {
-                glColor4d( p->color.x, p->color.y, p->color.z, alpha );
+                dpdt[count++] = p->v.x;
+                dpdt[count++] = p->v.y;
+                dpdt[count++] = p->f.x / p->mass;
+                dpdt[count++] = p->f.y / p->mass;
             }
-            glVertex2d( p->p.x, p->p.y );
         }
-        glEnd();
-        
-        glColor4d(0,.5,.5,.5);
-        glLineWidth(2.0f);
-        glBegin( GL_LINES );
-        for (Spring* s : springs) {
-            glVertex2d( s->p1->p.x, s->p1->p.y );
-            glVertex2d( s->p2->p.x, s->p2->p.y );
+    }
+
+    /**
+     * Evaluates derivatives for the fast particles with only the fast springs and
+     * bending elements, working on the gathered fast particle state so that the
+     * cost is independent of the rest of the system.
+     * @param t time 
+     * @param p phase space state (don't modify)
+     * @param dpdt to be filled with the derivative of the fast particles
+     */
+    void fastDerivs( float t, VectorXr& p, VectorXr& dpdt ) {
+        int nf = fastParticleIndices.size();
+        for ( int k = 0; k < nf; k++ ) {
+            int j = 4 * fastParticleIndices[k];
+            fastPositions[2 * k] = p[j];
+            fastPositions[2 * k + 1] = p[j + 1];
+            fastVelocities[2 * k] = p[j + 2];
+            fastVelocities[2 * k + 1] = p[j + 3];
+        }
+        fastForces.setZero();
+        int m = fastSprings.size();
+        for ( int k = 0; k < m; k++ ) {
+            checkBreaking( fastSprings[k], fastSprings[k]->addForce( fastSpringEnds[2 * k], fastSpringEnds[2 * k + 1], 
+                fastPositions, fastVelocities, fastForces ) );
+        }
+        for ( const BendingElement& e : fastBendingElements ) {
+            e.addForce( fastPositions, fastVelocities, fastForces );
+        }
+        for ( int k = 0; k < nf; k++ ) {
+            int i = fastParticleIndices[k];
+            int j = 4 * i;
+            dpdt[j] = p[j + 2];
+            dpdt[j + 1] = p[j + 3];
+            dpdt[j + 2] = fastForces[2 * k] * invMass[i];
+            dpdt[j + 3] = fastForces[2 * k + 1] * invMass[i];
         }
-        glEnd();
     }
-    
-    bool useGravity = true;
-    float gravity = 9.8;
+
+    /** Energy and momentum measurements, see Diagnostics */
+    Diagnostics diagnostics;
+
+    /** Set at the start of each step while diagnostics are enabled, and cleared by the first force evaluation */
+    bool diagnosticsPending = false;
+
+    /**
+     * Applies the spring and bending forces to the particles as derivs does, and 
+     * measures the energies, momentum, and largest spring strain of the particle
+     * state in the same passes.
+     */
+    void derivsForcesAndDiagnostics() {
+        diagnosticsPending = false;
+        Diagnostics::Sample sample = {};
+        sample.time = time;
+        Real g = useGravity ? gravity : 0;
+        for ( Particle* p : particles ) {
+            sample.kinetic += 0.5 * p->mass * ( p->v.x * p->v.x + p->v.y * p->v.y );
+            sample.gravitational -= p->mass * g * p->p.y;
+            sample.px += p->mass * p->v.x;
+            sample.py += p->mass * p->v.y;
+        }
+        for ( Spring* s : springs ) {
+            Real l = s->apply();
+            checkBreaking( s, l );
+            addSpringDiagnostics( s, l, sample );
+        }
+        for ( BendingElement& e : bendingElements ) {
+            Real d = e.apply( particles );
+            sample.bending += 0.5 * e.k * d * d;
+        }
+        diagnostics.push( sample );
+    }
+
+    /**
+     * Same as computeForces, but also measures the energies, momentum, and largest
+     * spring strain of the given state in the same passes, and adds a sample to
+     * the diagnostics.  Used for the first force evaluation of each step while 
+     * diagnostics are enabled.
+     * @param x positions
+     * @param xd velocities
+     * @param force to be filled with the total force on each particle
+     */
+    void computeForcesAndDiagnostics(const VectorXr& x, const VectorXr& xd, VectorXr& force) {
+        diagnosticsPending = false;
+        Diagnostics::Sample sample = {};
+        sample.time = time;
+        int n = particles.size();
+        Real g = useGravity ? gravity : 0;
+        const Real* m = mass.data();
+        for ( int i = 0; i < n; i++ ) {
+            Real vx = xd[2 * i];
+            Real vy = xd[2 * i + 1];
+            force[2 * i] = -viscousDamping * vx;
+            force[2 * i + 1] = m[i] * g - viscousDamping * vy;
+            sample.kinetic += 0.5 * m[i] * ( vx * vx + vy * vy );
+            sample.gravitational -= m[i] * g * x[2 * i + 1];
+            sample.px += m[i] * vx;
+            sample.py += m[i] * vy;
+        }
+        updateSpringEnds();
+        int ns = springs.size();
+        const int* ends = springEnds.data();
+        for ( int k = 0; k < ns; k++ ) {
+            Real l = springs[k]->addForce( ends[2 * k], ends[2 * k + 1], x, xd, force );
+            checkBreaking( springs[k], l );
+            addSpringDiagnostics( springs[k], l, sample );
+        }
+        for ( const BendingElement& e : bendingElements ) {
+            Real d = e.addForce( x, xd, force );
+            sample.bending += 0.5 * e.k * d * d;
+        }
+        diagnostics.push( sample );
+    }
+
+    inline void addSpringDiagnostics( const Spring* s, Real l, Diagnostics::Sample& sample ) {
+        double e = l - s->l0;
+        sample.spring += 0.5 * s->k * e * e;
+        if ( s->l0 > 0 ) sample.maxStrain = std::max( sample.maxStrain, std::abs( e ) / s->l0 );
+    }
+
+    /** Split position array for the fused stepping code (x and y interleaved per particle) */
+    VectorXr positions;
+    /** Split velocity array for the fused stepping code */
+    VectorXr velocities;
+    /** Force accumulator for the fused stepping code */
+    VectorXr forces;
+    /** Inverse masses for the fused stepping code, zero for pinned particles */
+    VectorXr invMass;
+    /** Particle masses, contiguous for the force and implicit solver loops */
+    VectorXr mass;
+    /** Topology version for which mass and invMass were computed, -1 when stale */
+    int massVersion = -1;
+
+    /**
+     * Fills the contiguous mass and inverse mass arrays.  This is done only when the
+     * topology or the pinned particles change, so call invalidateMasses after setting
+     * the mass of an existing particle.
+     */
+    void updateMasses() {
+        int n = particles.size();
+        mass.resize( n );
+        invMass.resize( n );
+        for ( int i = 0; i < n; i++ ) {
+            Particle* p = particles[i];
+            mass[i] = p->mass;
+            invMass[i] = p->fixed() ? 0 : 1 / p->mass;
+        }
+        massVersion = topologyVersion;
+        parameterVersion++;
+    }
+
+    void invalidateMasses() {
+        massVersion = -1;
+    }
+
+    /** 
+     * Use the fused symplectic Euler kernel on split arrays rather than the
+     * generic phase space stepping when the symplectic Euler integrator is selected
+     */
+    bool useFusedSymplecticEuler = true;
+
+    /** 
+     * Backend for the force pass, the fused updates, the explicit integrator state 
+     * updates, the implicit solves, and the wall collisions on the split arrays, or 
+     * NULL for the built in loops, see Backend
+     */
+    Backend* backend = NULL;
+
+    /**
+     * Copies particle state into the split position, velocity, and inverse mass arrays.
+     * Pinned particles get zero velocity and zero inverse mass so that the stepping
+     * code needs no special case for them.
+     */
+    void gatherState() {
+        int n = particles.size();
+        if ( positions.size() != 2 * n ) {
+            positions.resize( 2 * n );
+            velocities.resize( 2 * n );
+            forces.resize( 2 * n );
+            if ( updateDomains() ) {
+                domains.firstTouch( positions, 2 );
+                domains.firstTouch( velocities, 2 );
+                domains.firstTouch( forces, 2 );
+            }
+        }
+        if ( massVersion != topologyVersion ) updateMasses();
+        for ( int i = 0; i < n; i++ ) {
+            Particle* p = particles[i];
+            positions[2 * i] = p->p.x;
+            positions[2 * i + 1] = p->p.y;
+            bool free = invMass[i] != 0;
+            velocities[2 * i] = free ? p->v.x : 0;
+            velocities[2 * i + 1] = free ? p->v.y : 0;
+        }
+    }
+
+    /**
+     * Copies the split arrays back into the particles, leaving pinned and sleeping particles alone.
+     */
+    void scatterState() {
+        int n = particles.size();
+        for ( int i = 0; i < n; i++ ) {
+            Particle* p = particles[i];
+            if ( p->fixed() ) continue;
+            p->p = vec2r( positions[2 * i], positions[2 * i + 1] );
+            p->v = vec2r( velocities[2 * i], velocities[2 * i + 1] );
+            p->f = vec2r( forces[2 * i], forces[2 * i + 1] );
+        }
+    }
+
+    /**
+     * Sets the force array to gravity and viscous damping forces, i.e., everything but springs.
+     * @param xd velocities
+     * @param force to be filled with the external forces
+     */
+    void computeExternalForces(const VectorXr& xd, VectorXr& force) {
+        int n = particles.size();
+        Real g = useGravity ? gravity : 0;
+        const Real* m = mass.data();
+        for ( int i = 0; i < n; i++ ) {
+            force[2 * i] = -viscousDamping * xd[2 * i];
+            force[2 * i + 1] = m[i] * g - viscousDamping * xd[2 * i + 1];
+        }
+    }
+
+    /**
+     * Computes gravity, viscous damping, spring, and bending forces from split arrays.
+     * @param x positions
+     * @param xd velocities
+     * @param force to be filled with the total force on each particle
+     */
+    void computeForces(const VectorXr& x, const VectorXr& xd, VectorXr& force) {
+        if ( diagnosticsPending ) {
+            computeForcesAndDiagnostics( x, xd, force );
+            return;
+        }
+        if ( backend != NULL && sleepingIndices.empty() ) {
+            computeBackendForces( x, xd, force );
+            return;
+        }
+        if ( sleepingIndices.empty() && updateDomains() ) {
+            computeDomainForces( x, xd, force );
+            return;
+        }
+        computeExternalForces( xd, force );
+        updateSpringEnds();
+        int m = springs.size();
+        const int* ends = springEnds.data();
+        if ( !sleepingIndices.empty() ) {
+            // springs of sleeping islands only join particles that do not move
+            if ( awakeSpringsVersion != topologyVersion ) updateAwakeSprings();
+            for ( int k : awakeSprings ) {
+                checkBreaking( springs[k], springs[k]->addForce( ends[2 * k], ends[2 * k + 1], x, xd, force ) );
+            }
+        } else if ( breakingStrain > 0 ) {
+            for ( int k = 0; k < m; k++ ) {
+                checkBreaking( springs[k], springs[k]->addForce( ends[2 * k], ends[2 * k + 1], x, xd, force ) );
+            }
+        } else {
+            for ( int k = 0; k < m; k++ ) {
+                springs[k]->addForce( ends[2 * k], ends[2 * k + 1], x, xd, force );
+            }
+        }
+        for ( const BendingElement& e : bendingElements ) {
+            e.addForce( x, xd, force );
+        }
+    }
+
+    /**
+     * Computes the same forces as computeForces with one thread per domain, see
+     * DomainDecomposition.  Each domain sets the external forces of its particles
+     * and adds its interior springs, its end of the crossing springs, and the forces
+     * on its own particles of the bending elements touching it.
+     * @param x positions
+     * @param xd velocities
+     * @param force to be filled with the total force on each particle
+     */
+    void computeDomainForces(const VectorXr& x, const VectorXr& xd, VectorXr& force) {
+        updateSpringEnds();
+        Real g = useGravity ? gravity : 0;
+        const Real* m = mass.data();
+        const int* ends = springEnds.data();
+        int count = domains.domains.size();
+        domainBrokenSprings.resize( count );
+        #pragma omp parallel for schedule(static, 1)
+        for ( int d = 0; d < count; d++ ) {
+            const DomainDecomposition::Domain& domain = domains.domains[d];
+            std::vector<Spring*>& broken = domainBrokenSprings[d];
+            for ( int i = domain.begin; i < domain.end; i++ ) {
+                force[2 * i] = -viscousDamping * xd[2 * i];
+                force[2 * i + 1] = m[i] * g - viscousDamping * xd[2 * i + 1];
+            }
+            for ( int k : domain.interior ) {
+                Real l = springs[k]->addForce( ends[2 * k], ends[2 * k + 1], x, xd, force );
+                if ( breakingStrain > 0 ) checkBreaking( springs[k], l, broken );
+            }
+            for ( int k : domain.firstEnds ) {
+                Real l = springs[k]->addForceToEnd( ends[2 * k], ends[2 * k + 1], x, xd, force, true );
+                if ( breakingStrain > 0 ) checkBreaking( springs[k], l, broken );
+            }
+            for ( int k : domain.secondEnds ) {
+                springs[k]->addForceToEnd( ends[2 * k], ends[2 * k + 1], x, xd, force, false );
+            }
+            for ( int e : domain.bending ) {
+                const BendingElement& b = bendingElements[e];
+                Real fe[6];
+                b.computeForce( x, xd, fe );
+                int idx[3] = { b.i0, b.i1, b.i2 };
+                for ( int a = 0; a < 3; a++ ) {
+                    if ( idx[a] < domain.begin || idx[a] >= domain.end ) continue;
+                    force[2 * idx[a]] += fe[2 * a];
+                    force[2 * idx[a] + 1] += fe[2 * a + 1];
+                }
+            }
+        }
+        for ( std::vector<Spring*>& broken : domainBrokenSprings ) queueBroken( broken );
+    }
+
+    /** Springs each domain found over the breaking strain in the domain force pass */
+    std::vector<std::vector<Spring*>> domainBrokenSprings;
+
+    /**
+     * Computes the same forces as computeForces with the backend, in two passes that
+     * each write only their own entries.  The first computes the force of every spring
+     * and bending element, and the second sets the external force of every particle and 
+     * adds the forces of its springs in spring order and then of its bending elements in
+     * element order, which is the order the serial loop adds them in, so the result is
+     * exactly the same.
+     * @param x positions
+     * @param xd velocities
+     * @param force to be filled with the total force on each particle
+     */
+    void computeBackendForces(const VectorXr& x, const VectorXr& xd, VectorXr& force) {
+        updateSpringEnds();
+        updateIncidence();
+        int n = particles.size();
+        int m = springs.size();
+        int nb = bendingElements.size();
+        if ( springForces.size() != 2 * m ) {
+            springForces.resize( 2 * m );
+            springLengths.resize( m );
+        }
+        bendingForces.resize( 6 * nb );
+        const int* ends = springEnds.data();
+        Real* sf = springForces.data();
+        Real* sl = springLengths.data();
+        Real* bf = bendingForces.data();
+        backend->parallelFor( m + nb, [&]( int begin, int end ) {
+            for ( int k = begin; k < std::min( end, m ); k++ ) {
+                sl[k] = springs[k]->computeForce( ends[2 * k], ends[2 * k + 1], x, xd, sf + 2 * k );
+            }
+            for ( int e = std::max( begin, m ) - m; e < end - m; e++ ) {
+                bendingElements[e].computeForce( x, xd, bf + 6 * e );
+            }
+        } );
+        Real g = useGravity ? gravity : 0;
+        const Real* ms = mass.data();
+        const int* start = incidenceStart.data();
+        const int* inc = incidence.data();
+        const int* bstart = bendingIncidenceStart.data();
+        const int* binc = bendingIncidence.data();
+        backend->parallelFor( n, [&]( int begin, int end ) {
+            for ( int i = begin; i < end; i++ ) {
+                Real fx = -viscousDamping * xd[2 * i];
+                Real fy = ms[i] * g - viscousDamping * xd[2 * i + 1];
+                for ( int q = start[i]; q < start[i + 1]; q++ ) {
+                    const Real* fk = sf + 2 * ( inc[q] >> 1 );
+                    if ( inc[q] & 1 ) {
+                        fx -= fk[0];
+                        fy -= fk[1];
+                    } else {
+                        fx += fk[0];
+                        fy += fk[1];
+                    }
+                }
+                for ( int q = bstart[i]; q < bstart[i + 1]; q++ ) {
+                    const Real* fe = bf + 6 * ( binc[q] / 3 ) + 2 * ( binc[q] % 3 );
+                    fx += fe[0];
+                    fy += fe[1];
+                }
+                force[2 * i] = fx;
+                force[2 * i + 1] = fy;
+            }
+        } );
+        if ( breakingStrain > 0 ) {
+            for ( int k = 0; k < m; k++ ) checkBreaking( springs[k], sl[k] );
+        }
+    }
+
+    /** Force on p1 and length of each spring, for the backend force pass */
+    VectorXr springForces;
+    VectorXr springLengths;
+    /** Forces on the three particles of each bending element, for the backend force pass */
+    VectorXr bendingForces;
+
+    /** 
+     * Springs of each particle in increasing order, as 2 k for springs it is p1 of and
+     * 2 k + 1 for springs it is p2 of, with the entries of particle i starting at
+     * incidenceStart[i]
+     */
+    std::vector<int> incidence;
+    std::vector<int> incidenceStart;
+    int incidenceVersion = -1;
+
+    /**
+     * Bending elements of each particle in increasing order, as 3 e + a where a is 0, 1,
+     * or 2 as the particle is i0, i1, or i2 of element e, with the entries of particle i
+     * starting at bendingIncidenceStart[i]
+     */
+    std::vector<int> bendingIncidence;
+    std::vector<int> bendingIncidenceStart;
+
+    /**
+     * Rebuilds the particle to spring and bending element incidence lists if the 
+     * topology changed
+     */
+    void updateIncidence() {
+        if ( incidenceVersion == topologyVersion ) return;
+        int n = particles.size();
+        int m = springs.size();
+        incidenceStart.assign( n + 1, 0 );
+        for ( int k = 0; k < 2 * m; k++ ) incidenceStart[springEnds[k] + 1]++;
+        for ( int i = 0; i < n; i++ ) incidenceStart[i + 1] += incidenceStart[i];
+        incidence.resize( 2 * m );
+        std::vector<int> next( incidenceStart.begin(), incidenceStart.end() - 1 );
+        for ( int k = 0; k < 2 * m; k++ ) incidence[next[springEnds[k]]++] = k;
+        int nb = bendingElements.size();
+        bendingIncidenceStart.assign( n + 1, 0 );
+        for ( const BendingElement& e : bendingElements ) {
+            bendingIncidenceStart[e.i0 + 1]++;
+            bendingIncidenceStart[e.i1 + 1]++;
+            bendingIncidenceStart[e.i2 + 1]++;
+        }
+        for ( int i = 0; i < n; i++ ) bendingIncidenceStart[i + 1] += bendingIncidenceStart[i];
+        bendingIncidence.resize( 3 * nb );
+        next.assign( bendingIncidenceStart.begin(), bendingIncidenceStart.end() - 1 );
+        for ( int e = 0; e < nb; e++ ) {
+            const BendingElement& b = bendingElements[e];
+            bendingIncidence[next[b.i0]++] = 3 * e;
+            bendingIncidence[next[b.i1]++] = 3 * e + 1;
+            bendingIncidence[next[b.i2]++] = 3 * e + 2;
+        }
+        incidenceVersion = topologyVersion;
+    }
+
+    /**
+     * Same as checkBreaking but adds the spring to a buffer of the calling thread, for
+     * the parallel force pass, which checks each spring in one thread only and queues 
+     * the buffers in a fixed order with queueBroken afterwards, without locking.
+     * @param s
+     * @param l current length of s
+     * @param buffer
+     */
+    inline void checkBreaking( Spring* s, Real l, std::vector<Spring*>& buffer ) {
+        if ( !s->broken && l > ( 1 + breakingStrain ) * s->l0 ) buffer.push_back( s );
+    }
+
+    /**
+     * Queues the springs of a buffer filled by the parallel force pass for removal, and
+     * clears the buffer
+     * @param buffer
+     */
+    void queueBroken( std::vector<Spring*>& buffer ) {
+        for ( Spring* s : buffer ) {
+            if ( s->broken ) continue;
+            s->broken = true;
+            brokenSprings.push_back( s );
+        }
+        buffer.clear();
+    }
+
+    /** Strain (l - l0) / l0 beyond which springs break, or zero for unbreakable springs */
+    float breakingStrain = 0;
+
+    /** Springs that exceeded the breaking strain in the current step, removed together after it */
+    std::vector<Spring*> brokenSprings;
+
+    /**
+     * Queues the spring for removal at the end of the step if the given length exceeds
+     * the breaking strain.
+     * @param s
+     * @param l current length of s
+     */
+    inline void checkBreaking( Spring* s, Real l ) {
+        if ( breakingStrain > 0 && !s->broken && l > ( 1 + breakingStrain ) * s->l0 ) {
+            s->broken = true;
+            brokenSprings.push_back( s );
+        }
+    }
+
+    /**
+     * Checks the breaking strain of all springs from split array positions, for the 
+     * solvers that do not evaluate spring forces.
+     * @param x positions
+     */
+    void checkBreaking( const VectorXr& x ) {
+        if ( breakingStrain <= 0 ) return;
+        updateSpringEnds();
+        int m = springs.size();
+        const int* ends = springEnds.data();
+        for ( int k = 0; k < m; k++ ) {
+            int i = 2 * ends[2 * k];
+            int j = 2 * ends[2 * k + 1];
+            Real dx = x[j] - x[i];
+            Real dy = x[j + 1] - x[i + 1];
+            checkBreaking( springs[k], sqrt( dx * dx + dy * dy ) );
+        }
+    }
+
+    /** Particle indices of the two ends of each spring, contiguous for the force pass */
+    std::vector<int> springEnds;
+    int springEndsVersion = -1;
+
+    /**
+     * Rebuilds the spring end index array if the topology changed
+     */
+    void updateSpringEnds() {
+        if ( springEndsVersion == topologyVersion ) return;
+        springEnds.resize( 2 * springs.size() );
+        for ( size_t k = 0; k < springs.size(); k++ ) {
+            springEnds[2 * k] = springs[k]->p1->index;
+            springEnds[2 * k + 1] = springs[k]->p2->index;
+        }
+        springEndsVersion = topologyVersion;
+    }
+
+    /**
+     * Symplectic Euler step working directly on the split arrays.  After the force
+     * pass, velocities and positions are updated together in a single streaming loop.
+     * Pinned particles have zero inverse mass and zero velocity, so they stay put.
+     * @param h step size
+     */
+    void stepSymplecticEuler(float h) {
+        computeForces( positions, velocities, forces );
+        int n = particles.size();
+        updateStateErrors();
+        if ( backend != NULL ) {
+            Real* x = positions.data();
+            Real* v = velocities.data();
+            Real* f = forces.data();
+            Real* w = invMass.data();
+            Real* ex = positionError.data();
+            Real* ev = velocityError.data();
+            backend->parallelFor( n, [=]( int begin, int end ) {
+                int o = 2 * begin;
+                SymplecticEuler::update<Precision>( end - begin, Real( h ), x + o, v + o, f + o, w + begin, ex + o, ev + o );
+            } );
+            return;
+        }
+        SymplecticEuler::update<Precision>( n, Real( h ), positions.data(), velocities.data(), forces.data(), invMass.data(), 
+            positionError.data(), velocityError.data() );
+    }
+
+    /** 
+     * Rounding errors carried between steps by the compensated precision policy, for
+     * the fused symplectic Euler kernel and the implicit steppers, reset whenever the
+     * topology changes
+     */
+    VectorXr positionError;
+    VectorXr velocityError;
+    int errorVersion = -1;
+
+    /**
+     * Resizes and zeroes the rounding error arrays if the topology changed
+     */
+    void updateStateErrors() {
+        int n = particles.size();
+        if ( positionError.size() != 2 * n || errorVersion != topologyVersion ) {
+            positionError.setZero( 2 * n );
+            velocityError.setZero( 2 * n );
+            errorVersion = topologyVersion;
+        }
+    }
+
+    /**
+     * Computes x += dx for a state update of the implicit steppers, with the addition
+     * of the precision policy, which for the compensated policy carries the rounding
+     * error of each entry in e.  Otherwise this is the plain vector expression.
+     * @param x positions or velocities
+     * @param dx update
+     * @param e positionError or velocityError
+     */
+    template <typename Derived>
+    void accumulate( VectorXr& x, const Eigen::MatrixBase<Derived>& dx, VectorXr& e ) {
+        if ( !Precision::compensated ) {
+            x += dx;
+            return;
+        }
+        int n = x.size();
+        for ( int i = 0; i < n; i++ ) Precision::add( x[i], dx[i], e[i] );
+    }
+    
+    /** Solvers available when not using an explicit integrator */
+    enum ImplicitSolver { BACKWARD_EULER, XPBD, PROJECTIVE_DYNAMICS, IMPLICIT_MIDPOINT, BDF2 };
+
+    /** The solver to use when useExplicitIntegration is false */
+    ImplicitSolver implicitSolver = BACKWARD_EULER;
+
+    XPBDSolver xpbd;
+
+    /**
+     * Advances the system with the XPBD solver, treating springs as compliant
+     * distance constraints and bending elements as compliant angle constraints.
+     * Uses solverIterations Gauss-Seidel sweeps.
+     * @param h step size
+     */
+    void stepXPBD(float h) {
+        if ( !xpbd.colored ) xpbd.color( springs );
+        if ( xpbd.bendingVersion != topologyVersion ) {
+            xpbd.colorBending( bendingElements, particles.size() );
+            xpbd.bendingVersion = topologyVersion;
+        }
+        computeExternalForces( velocities, forces );
+        xpbd.step( bendingElements, positions, velocities, invMass, forces, h, solverIterations );
+    }
+
+    ProjectiveDynamicsSolver projectiveDynamics;
+
+    /**
+     * Advances the system with projective dynamics.  The system matrix is only
+     * refactored when the topology, step size, stiffness, or pinned particles change,
+     * which advance checks once per call with projectiveDynamics.update.
+     * @param h step size
+     */
+    void stepProjectiveDynamics(float h) {
+        computeExternalForces( velocities, forces );
+        projectiveDynamics.step( springs, positions, velocities, invMass, forces, h, projectiveDynamicsIterations );
+    }
+
+    /**
+     * Evaluates the forces and their derivatives at the split array state and fills 
+     * A = M - a dfdv - a^2 dfdx, where viscous damping adds -c I to dfdv.  The 
+     * linearized implicit integrators below all solve with this matrix, and differ
+     * only in a and the right hand side.
+     * @param a
+     */
+    void assembleImplicit( Real a ) {
+        if ( !implicitStorageValid ) init();
+        evaluateForces( positions, velocities, forces );
+        assembleJacobians();
+        assembleSystemMatrix( a );
+    }
+
+    /**
+     * Fills A = M - a dfdv - a^2 dfdx from the current dfdx and dfdv
+     * @param a
+     */
+    void assembleSystemMatrix( Real a ) {
+        if ( jacobiansMatrixFree ) {
+            assembleSpringSystem( a );
+            return;
+        }
+        // all three matrices share the same pattern and block order
+        int n = particles.size();
+        Real a2 = a * a;
+        #pragma omp parallel for
+        for ( int i = 0; i < n; i++ ) {
+            std::vector<BlockSparseMatrix::Block>& Ai = A.rows[i];
+            std::vector<BlockSparseMatrix::Block>& Ki = dfdx.rows[i];
+            std::vector<BlockSparseMatrix::Block>& Di = dfdv.rows[i];
+            for ( size_t k = 0; k < Ai.size(); k++ ) {
+                for ( int j = 0; j < 4; j++ ) {
+                    Ai[k].m[j] = -a * Di[k].m[j] - a2 * Ki[k].m[j];
+                }
+            }
+            Real d = mass[i] + a * viscousDamping;
+            Ai[0].m[0] += d;
+            Ai[0].m[3] += d;
+        }
+    }
+
+    /**
+     * Fills the spring blocks and diagonals of A = M - a dfdv - a^2 dfdx for matrix
+     * free solves, from the current spring blocks of dfdx and dfdv
+     * @param a
+     */
+    void assembleSpringSystem( Real a ) {
+        int n = particles.size();
+        int m = springs.size();
+        Real a2 = a * a;
+        springSystem.resize( 4 * m );
+        systemDiagonal.resize( n );
+        systemPreconditioner.resize( 2 * n );
+        const Real* K = springDfdx.data();
+        const Real* D = springDfdv.data();
+        Real* S = springSystem.data();
+        backend->parallelFor( 4 * m, [=]( int begin, int end ) {
+            for ( int j = begin; j < end; j++ ) S[j] = -a * D[j] - a2 * K[j];
+        } );
+        const Real* ms = mass.data();
+        const int* start = incidenceStart.data();
+        const int* inc = incidence.data();
+        Real* d = systemDiagonal.data();
+        Real* pc = systemPreconditioner.data();
+        Real c = viscousDamping;
+        backend->parallelFor( n, [=]( int begin, int end ) {
+            for ( int i = begin; i < end; i++ ) {
+                d[i] = ms[i] + a * c;
+                Real px = d[i];
+                Real py = d[i];
+                for ( int q = start[i]; q < start[i + 1]; q++ ) {
+                    const Real* Sk = S + 4 * ( inc[q] >> 1 );
+                    px += Sk[0];
+                    py += Sk[3];
+                }
+                pc[2 * i] = px;
+                pc[2 * i + 1] = py;
+            }
+        } );
+    }
+
+    /**
+     * Computes y = M x with the backend if there is one
+     */
+    void multiply( const BlockSparseMatrix& M, const VectorXr& x, VectorXr& y ) {
+        if ( backend != NULL ) {
+            backend->multiply( M, x, y );
+        } else {
+            M.multiply( x, y );
+        }
+    }
+
+    /** Linear solvers for the implicit integrators, see solveImplicit */
+    enum LinearSolver { CONJUGATE_GRADIENT, SPARSE_DIRECT, AUTOMATIC_LINEAR_SOLVER };
+
+    /** The linear solver to use for the implicit integrators */
+    LinearSolver linearSolver = AUTOMATIC_LINEAR_SOLVER;
+
+    /** 
+     * Range of the number of degrees of freedom, twice the number of particles, in 
+     * which the automatic choice considers the direct solver.  Smaller systems take
+     * little time either way, and larger ones too much memory and time to factor.
+     */
+    int directSolverMinDofs = 2000;
+    int directSolverMaxDofs = 200000;
+
+    /** 
+     * Time of a multiply add of the factorization relative to that of a matrix entry
+     * in a CG iteration, as measured by Benchmark::directSolver
+     */
+    float directSolverFlopCost = 0.4f;
+
+    SparseDirectSolver directSolver;
+
+    /** True if the last implicit solve used the direct solver */
+    bool usedDirectSolver = false;
+
+    /** Parameter version at which the automatic choice last measured the CG iterations */
+    int automaticSolverVersion = -1;
+
+    /** Number of direct solves after which the automatic choice measures the CG iterations again */
+    int automaticSolverProbeInterval = 10;
+    int automaticDirectSolves = 0;
+
+    /**
+     * Chooses between conjugate gradients and the direct solver.  The automatic choice
+     * compares the cost of a factorization, known from the symbolic analysis, with 
+     * that of the iterations of the last CG solve, which grow with the stiffness and 
+     * the size of the system, or uses the direct solver if CG stopped at solverIterations
+     * before converging.  The iterations change as the motion settles, so while
+     * using the direct solver every so often one solve uses CG to measure them again,
+     * as does the first solve after the stiffness or masses change.
+     * @return true to use the direct solver
+     */
+    bool chooseDirectSolver() {
+        if ( linearSolver != AUTOMATIC_LINEAR_SOLVER ) return linearSolver == SPARSE_DIRECT;
+        int dofs = 2 * particles.size();
+        if ( dofs < directSolverMinDofs || dofs > directSolverMaxDofs ) return false;
+        if ( automaticSolverVersion != parameterVersion || automaticDirectSolves >= automaticSolverProbeInterval ) {
+            automaticSolverVersion = parameterVersion;
+            automaticDirectSolves = 0;
+            return false;
+        }
+        directSolver.update( A, this );
+        bool direct = CG.residual > solverTolerance 
+            || directSolverFlopCost * directSolver.factorFlops < (double) CG.iterations * directSolver.matrixEntries;
+        if ( direct ) automaticDirectSolves++;
+        return direct;
+    }
+
+    /**
+     * Solves A x = b for the free degrees of freedom with the chosen linear solver.
+     * The direct solver computes its ordering and symbolic factorization again only
+     * when the pattern of A or the pinned and sleeping particles change.  If its
+     * factorization fails, conjugate gradients are used instead.  Matrix free solves
+     * always use conjugate gradients, see useMatrixFree.  Conjugate gradient solves are
+     * split by island when there are several awake islands or some are asleep, see 
+     * solveIslands.
+     * @param b
+     * @param x initial guess for conjugate gradients, and solution
+     */
+    void solveImplicit( VectorXr& b, VectorXr& x ) {
+        usedIslandSolves = false;
+        if ( jacobiansMatrixFree ) {
+            usedDirectSolver = false;
+            if ( splitByIsland() ) {
+                solveIslands( b, x );
+                return;
+            }
+            Backend* be = backend;
+            CG.solve( *be, [this, be]( const VectorXr& v, VectorXr& y ) {
+                be->springMultiply( systemDiagonal, springSystem, springEnds, incidenceStart, incidence, v, y );
+            }, systemPreconditioner, b, x, solverIterations, solverTolerance, this );
+            return;
+        }
+        usedDirectSolver = chooseDirectSolver() && directSolver.solve( A, b, x, this );
+        if ( usedDirectSolver ) return;
+        if ( splitByIsland() ) {
+            solveIslands( b, x );
+        } else {
+            CG.solve( A, b, x, solverIterations, solverTolerance, this );
+        }
+    }
+
+    /** 
+     * Solve the conjugate gradient systems of the awake islands separately, see 
+     * solveIslands, rather than with one solve over all particles
+     */
+    bool useIslandSolves = true;
+
+    /** True if the last implicit solve was split by island */
+    bool usedIslandSolves = false;
+
+    /** 
+     * Free awake particles grouped by island in increasing order, with those of island c
+     * in islandParticles[islandStart[c], islandStart[c + 1])
+     */
+    std::vector<int> islandParticles;
+    std::vector<int> islandStart;
+    /** Index of each particle within its island, or -1 for pinned and sleeping particles */
+    std::vector<int> islandLocal;
+    /** Island number of each union find root, for grouping the particles */
+    std::vector<int> islandOfRoot;
+
+    /** Conjugate gradient solver and gathered vectors of one island */
+    struct IslandSolve {
+        ConjugateGradient CG;
+        VectorXr b;
+        VectorXr x;
+        VectorXr diagonal;
+    };
+    std::vector<IslandSolve> islandSolves;
+
+    /** Diagonal of A, for the island solves */
+    VectorXr systemMatrixDiagonal;
+
+    /**
+     * Groups the free awake particles by island
+     * @return the number of islands with free awake particles
+     */
+    int updateIslandParticles() {
+        if ( islands.dirty ) islands.rebuild( particles.size(), springs, bendingElements );
+        int n = particles.size();
+        islandLocal.assign( n, 0 );
+        for ( int i : pinnedIndices ) islandLocal[i] = -1;
+        for ( int i : sleepingIndices ) islandLocal[i] = -1;
+        islandOfRoot.assign( n, -1 );
+        islandStart.assign( 1, 0 );
+        for ( int i = 0; i < n; i++ ) {
+            if ( islandLocal[i] < 0 ) continue;
+            int& c = islandOfRoot[islands.find( i )];
+            if ( c < 0 ) {
+                c = islandStart.size() - 1;
+                islandStart.push_back( 0 );
+            }
+            islandStart[c + 1]++;
+        }
+        int count = islandStart.size() - 1;
+        for ( int c = 0; c < count; c++ ) islandStart[c + 1] += islandStart[c];
+        islandParticles.resize( islandStart[count] );
+        std::vector<int> next( islandStart.begin(), islandStart.end() - 1 );
+        for ( int i = 0; i < n; i++ ) {
+            if ( islandLocal[i] < 0 ) continue;
+            int c = islandOfRoot[islands.find( i )];
+            islandLocal[i] = next[c] - islandStart[c];
+            islandParticles[next[c]++] = i;
+        }
+        return count;
+    }
+
+    /**
+     * @return true if the conjugate gradient solves are split by island, which is when
+     * there is more than one awake island or some particles are asleep
+     */
+    bool splitByIsland() {
+        return useIslandSolves && ( updateIslandParticles() > 1 || !sleepingIndices.empty() );
+    }
+
+    /**
+     * Solves A x = b with one conjugate gradient solve per awake island, as islands 
+     * share no springs or bending elements and their blocks of A are independent.  The 
+     * islands are solved in parallel, by the backend if there is one, and each stops
+     * at its own tolerance relative to its part of b.  Pinned and sleeping particles are
+     * left out of the island vectors rather than filtered, and get zero in x.  CG holds
+     * the largest number of iterations and residual of the islands afterwards.
+     * @param b
+     * @param x initial guess, and solution
+     */
+    void solveIslands( VectorXr& b, VectorXr& x ) {
+        usedIslandSolves = true;
+        filter( b );
+        filter( x );
+        if ( !jacobiansMatrixFree ) A.getDiagonal( systemMatrixDiagonal );
+        const VectorXr& diagonal = jacobiansMatrixFree ? systemPreconditioner : systemMatrixDiagonal;
+        int count = islandStart.size() - 1;
+        islandSolves.resize( count );
+        std::function<void( int )> task = [&]( int c ) {
+            IslandSolve& island = islandSolves[c];
+            const int* members = islandParticles.data() + islandStart[c];
+            int size = islandStart[c + 1] - islandStart[c];
+            island.b.resize( 2 * size );
+            island.x.resize( 2 * size );
+            island.diagonal.resize( 2 * size );
+            for ( int r = 0; r < size; r++ ) {
+                for ( int j = 0; j < 2; j++ ) {
+                    island.b[2 * r + j] = b[2 * members[r] + j];
+                    island.x[2 * r + j] = x[2 * members[r] + j];
+                    island.diagonal[2 * r + j] = diagonal[2 * members[r] + j];
+                }
+            }
+            island.CG.solve( [this, members, size]( const VectorXr& v, VectorXr& y ) { multiplyIsland( members, size, v, y ); }, 
+                island.diagonal, island.b, island.x, solverIterations, solverTolerance, NULL );
+            for ( int r = 0; r < size; r++ ) {
+                x[2 * members[r]] = island.x[2 * r];
+                x[2 * members[r] + 1] = island.x[2 * r + 1];
+            }
+        };
+        if ( backend != NULL ) {
+            backend->run( count, task );
+        } else {
+            #pragma omp parallel for schedule(dynamic)
+            for ( int c = 0; c < count; c++ ) task( c );
+        }
+        CG.iterations = 0;
+        CG.residual = 0;
+        for ( const IslandSolve& island : islandSolves ) {
+            CG.iterations = std::max( CG.iterations, island.CG.iterations );
+            CG.residual = std::max( CG.residual, island.CG.residual );
+        }
+    }
+
+    /**
+     * Computes y = A x for the block of one island, from the assembled matrix or from
+     * the spring blocks for matrix free solves
+     * @param members particles of the island
+     * @param size number of particles of the island
+     * @param x island vector, two entries per member
+     * @param y island vector, two entries per member
+     */
+    void multiplyIsland( const int* members, int size, const VectorXr& x, VectorXr& y ) {
+        y.resize( 2 * size );
+        for ( int r = 0; r < size; r++ ) {
+            int i = members[r];
+            Real yx = 0;
+            Real yy = 0;
+            if ( jacobiansMatrixFree ) {
+                yx = systemDiagonal[i] * x[2 * r];
+                yy = systemDiagonal[i] * x[2 * r + 1];
+                for ( int q = incidenceStart[i]; q < incidenceStart[i + 1]; q++ ) {
+                    int k = incidence[q] >> 1;
+                    int o = islandLocal[springEnds[2 * k + 1 - ( incidence[q] & 1 )]];
+                    Real dx = x[2 * r] - ( o >= 0 ? x[2 * o] : 0 );
+                    Real dy = x[2 * r + 1] - ( o >= 0 ? x[2 * o + 1] : 0 );
+                    const Real* S = springSystem.data() + 4 * k;
+                    yx += S[0] * dx + S[1] * dy;
+                    yy += S[2] * dx + S[3] * dy;
+                }
+            } else {
+                for ( const BlockSparseMatrix::Block& block : A.rows[i] ) {
+                    int o = islandLocal[block.col];
+                    if ( o < 0 ) continue;
+                    yx += block.m[0] * x[2 * o] + block.m[1] * x[2 * o + 1];
+                    yy += block.m[2] * x[2 * o] + block.m[3] * x[2 * o + 1];
+                }
+            }
+            y[2 * r] = yx;
+            y[2 * r + 1] = yy;
+        }
+    }
+
+    /**
+     * Advances the system with one linearized backward Euler step, solving
+     * (M - h dfdv - h^2 dfdx) deltaxdot = h (f + h dfdx xdot) with solveImplicit.
+     * The previous deltaxdot is used as the initial guess.
+     * @param h step size
+     */
+    void stepBackwardEuler(float h) {
+        if ( useNewton ) {
+            stepBackwardEulerNewton( h );
+            return;
+        }
+        assembleImplicit( h );
+        multiplyStiffness( velocities, b );
+        b = h * ( forces + h * b );
+        solveImplicit( b, deltaxdot );
+        updateStateErrors();
+        accumulate( velocities, deltaxdot, velocityError );
+        accumulate( positions, h * velocities, positionError );
+    }
+
+    /** Solve backward Euler steps with Newton iterations rather than a single linearized solve */
+    bool useNewton = false;
+    /** Largest number of Newton iterations per step */
+    int newtonMaxIterations = 10;
+    /** Norm of the residual, relative to the norm of h f at the first iterate, at which Newton stops */
+    float newtonTolerance = 1e-3;
+    /** Largest number of times the line search halves a Newton step */
+    int lineSearchMaxHalvings = 8;
+
+    /** Newton iterations, line search halvings, and CG iterations in the last step */
+    int newtonIterations = 0;
+    int lineSearchHalvings = 0;
+    int newtonCGIterations = 0;
+    /** Time in seconds spent in the linear solves and in the force and Jacobian evaluations of the last step */
+    double newtonSolveTime = 0;
+    double newtonAssemblyTime = 0;
+
+    /** Start of step state, residual, and Newton direction for the Newton solver */
+    VectorXr newtonPositions;
+    VectorXr newtonVelocities;
+    VectorXr newtonResidual;
+    VectorXr newtonDirection;
+    VectorXr newtonTrial;
+
+    /**
+     * Sets the split arrays to the backward Euler state for the velocity change dv
+     * from the start of step state, evaluates the forces there, and computes the
+     * filtered residual r = h f(x0 + h (v0 + dv), v0 + dv) - M dv.
+     * @param dv velocity change
+     * @param h step size
+     * @param r residual
+     * @return the norm of the residual
+     */
+    Real backwardEulerResidual( const VectorXr& dv, Real h, VectorXr& r ) {
+        velocities = newtonVelocities + dv;
+        positions = newtonPositions + h * velocities;
+        evaluateForces( positions, velocities, forces );
+        int n = particles.size();
+        r = h * forces;
+        for ( int i = 0; i < n; i++ ) {
+            r[2 * i] -= mass[i] * dv[2 * i];
+            r[2 * i + 1] -= mass[i] * dv[2 * i + 1];
+        }
+        filter( r );
+        return r.norm();
+    }
+
+    /**
+     * Advances the system with one fully nonlinear backward Euler step, solving 
+     * M dv = h f(x0 + h (v0 + dv), v0 + dv) for dv with Newton's method.  Each 
+     * iteration solves (M - h dfdv - h^2 dfdx) delta = r with the Jacobians at the 
+     * current iterate, reusing the sparse pattern of the linearized solver, and the
+     * step along delta is halved until the residual norm decreases, stopping when it
+     * no longer does (at the precision of the state, for instance).  The first 
+     * iterate is the previous step's dv, and each CG solve starts from the previous
+     * Newton direction.
+     * @param h step size
+     */
+    void stepBackwardEulerNewton(float h) {
+        if ( !implicitStorageValid ) init();
+        // the first force evaluation below is not at the start of step state
+        if ( diagnosticsPending ) computeForces( positions, velocities, forces );
+        newtonPositions = positions;
+        newtonVelocities = velocities;
+        int n2 = positions.size();
+        if ( newtonDirection.size() != n2 ) newtonDirection.setZero( n2 );
+        filter( deltaxdot );
+        newtonIterations = 0;
+        lineSearchHalvings = 0;
+        newtonCGIterations = 0;
+        newtonSolveTime = 0;
+        newtonAssemblyTime = 0;
+        double start = seconds();
+        Real norm = backwardEulerResidual( deltaxdot, h, newtonResidual );
+        newtonTrial = h * forces;
+        filter( newtonTrial );
+        Real tolerance = newtonTolerance * newtonTrial.norm();
+        while ( newtonIterations < newtonMaxIterations && norm > tolerance && norm > 0 ) {
+            assembleJacobians();
+            assembleSystemMatrix( h );
+            double solveStart = seconds();
+            newtonAssemblyTime += solveStart - start;
+            solveImplicit( newtonResidual, newtonDirection );
+            if ( !usedDirectSolver ) newtonCGIterations += CG.iterations;
+            start = seconds();
+            newtonSolveTime += start - solveStart;
+            Real step = 1;
+            Real trialNorm = norm;
+            for ( int k = 0; k <= lineSearchMaxHalvings; k++ ) {
+                newtonTrial = deltaxdot + step * newtonDirection;
+                trialNorm = backwardEulerResidual( newtonTrial, h, newtonResidual );
+                if ( trialNorm < norm ) break;
+                step /= 2;
+                lineSearchHalvings++;
+            }
+            newtonIterations++;
+            if ( trialNorm >= norm ) {
+                // no decrease along delta, so go back to the current iterate and stop
+                backwardEulerResidual( deltaxdot, h, newtonResidual );
+                break;
+            }
+            deltaxdot = newtonTrial;
+            norm = trialNorm;
+        }
+        newtonAssemblyTime += seconds() - start;
+        // backwardEulerResidual left the split arrays at the final iterate, which the
+        // compensated policy recomputes from the start of step state with its errors
+        if ( Precision::compensated ) {
+            updateStateErrors();
+            velocities = newtonVelocities;
+            positions = newtonPositions;
+            accumulate( velocities, deltaxdot, velocityError );
+            accumulate( positions, h * velocities, positionError );
+        }
+    }
+
+    /**
+     * Advances the system with one linearized implicit midpoint step, with forces 
+     * evaluated at the midpoint state x + h/2 (xdot + deltaxdot/2), xdot + deltaxdot/2.
+     * This solves (M - h/2 dfdv - h^2/4 dfdx) deltaxdot = h (f + h/2 dfdx xdot), and 
+     * unlike backward Euler it does not damp the motion, so it keeps its energy at
+     * large steps.  For linear forces it is the same as the trapezoidal rule.
+     * @param h step size
+     */
+    void stepImplicitMidpoint(float h) {
+        Real a = Real( 0.5 ) * h;
+        assembleImplicit( a );
+        multiplyStiffness( velocities, b );
+        b = h * ( forces + a * b );
+        solveImplicit( b, deltaxdot );
+        updateStateErrors();
+        accumulate( positions, h * ( velocities + Real( 0.5 ) * deltaxdot ), positionError );
+        accumulate( velocities, deltaxdot, velocityError );
+    }
+
+    /** Positions and velocities at the start of the previous step, for BDF2 */
+    VectorXr previousStepPositions;
+    VectorXr previousStepVelocities;
+    /** Position change carried over from the history, (x - xprev) / 3 */
+    VectorXr bdf2Offset;
+    /** Topology and fixed particle versions, and step size, of the stored previous step */
+    int bdf2Version = -1;
+    int bdf2FixedVersion = -1;
+    float bdf2StepSize = 0;
+    /** Value of stepCount after the last BDF2 step, or -1 if the history is not valid */
+    long bdf2Step = -1;
+
+    /** Number of steps taken by advance, counting substeps */
+    long stepCount = 0;
+
+    /**
+     * Call after changing particle positions or velocities outside of advance, for
+     * instance to stop the particles, so that integrators that keep a history of 
+     * previous steps start over
+     */
+    void stateChanged() {
+        bdf2Step = -1;
+    }
+
+    /**
+     * Advances the system with one linearized second order backward differentiation 
+     * (BDF2) step,
+     *   x1 = 4/3 x - 1/3 xprev + 2/3 h xdot1,  xdot1 = 4/3 xdot - 1/3 xdotprev + 2/3 h M^-1 f1,
+     * which with a = 2/3 h and deltaxdot = xdot1 - xdot solves
+     *   (M - a dfdv - a^2 dfdx) deltaxdot = M (xdot - xdotprev)/3 + a (f + dfdx ((x - xprev)/3 + a xdot)).
+     * It is much less dissipative than backward Euler.  The history is only used if
+     * the previous step was a BDF2 step of the same size, with the same topology and
+     * fixed particles, and the state was not changed since, see stateChanged.  
+     * Otherwise the step is a backward Euler step that starts a new history.
+     * @param h step size
+     */
+    void stepBDF2(float h) {
+        bool valid = bdf2Step == stepCount && bdf2Version == topologyVersion 
+            && bdf2FixedVersion == fixedVersion && bdf2StepSize == h;
+        bdf2Step = stepCount + 1;
+        if ( !valid ) {
+            previousStepPositions = positions;
+            previousStepVelocities = velocities;
+            bdf2Version = topologyVersion;
+            bdf2FixedVersion = fixedVersion;
+            bdf2StepSize = h;
+            stepBackwardEuler( h );
+            return;
+        }
+        Real a = Real( 2.0 / 3.0 ) * h;
+        assembleImplicit( a );
+        bdf2Offset = ( positions - previousStepPositions ) / 3;
+        for ( int i : pinnedIndices ) bdf2Offset.segment<2>( 2 * i ).setZero();
+        multiplyStiffness( bdf2Offset + a * velocities, b );
+        b = a * ( forces + b );
+        int n = particles.size();
+        for ( int i = 0; i < n; i++ ) {
+            b[2 * i] += mass[i] * ( velocities[2 * i] - previousStepVelocities[2 * i] ) / 3;
+            b[2 * i + 1] += mass[i] * ( velocities[2 * i + 1] - previousStepVelocities[2 * i + 1] ) / 3;
+        }
+        solveImplicit( b, deltaxdot );
+        previousStepPositions = positions;
+        previousStepVelocities = velocities;
+        updateStateErrors();
+        accumulate( velocities, deltaxdot, velocityError );
+        accumulate( positions, bdf2Offset + a * velocities, positionError );
+    }
+
+    /** Time in seconds that was necessary to advance the system */
+    float computeTime;
+
+    /**
+     * @return time in seconds from a monotonic clock, which unlike glfwGetTime also
+     * works in headless runs before GLFW is initialized
+     */
+    static double seconds() {
+        return std::chrono::duration<double>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+    }
+    
+    /**
+     * Advances the state of the system by one step
+     * @param elapsed
+     */
+    void advanceTime( float elapsed ) {
+        advance( elapsed, 1 );
+    }
+
+    /**
+     * Advances the state of the system by the given total time in a number of equal
+     * substeps.  Spring parameters are propagated and working storage checked once per
+     * call, and the split array steppers keep the state in their arrays across the
+     * substeps, handling wall collisions there, so that particles are only written
+     * at the end.
+     * @param total time to advance
+     * @param substeps number of steps to take
+     */
+    void advance( float total, int substeps ) {
+        double now = seconds();
+        long samples = diagnostics.steps;
+        updatePinned();
+        updateSpringParameters();
+        updateBendingParameters();
+        wakeTouched();
+        CG.backend = backend;
+        // the method for this call, the automatic choice leaves the user's selection alone
+        bool explicitStep = useExplicitIntegration;
+        ImplicitSolver solver = implicitSolver;
+        if ( automaticStepping ) {
+            chooseStepping( total );
+            substeps = automaticSubsteps;
+            explicitStep = automaticExplicit;
+            if ( !automaticExplicit ) solver = automaticImplicitSolver;
+        }
+        float h = total / substeps;
+        bool fused = automaticStepping || ( useFusedSymplecticEuler && dynamic_cast<SymplecticEuler*>(integrator) != NULL );
+        if ( explicitStep && !fused ) {
+            integrator->backend = backend;
+            int n = getPhaseSpaceDim();
+            if ( n != state.size() ) {
+                state.resize(n);
+                stateOut.resize(n);
+            }
+            for ( int i = 0; i < substeps; i++ ) {
+                getPhaseSpace(state);         
+                diagnosticsPending = diagnostics.enabled;
+                integrator->step( state, n, time, h, stateOut, this);                
+                diagnosticsPending = false;
+                setPhaseSpace(stateOut);
+                time = time + h;
+                stepCount++;
+                postStepFix();
+                if ( !colliders.empty() ) {
+                    for ( Particle* p : particles ) {
+                        if ( p->fixed() ) continue;
+                        int j = p->index * 4;
+                        colliders.collide( vec2r( state[j], state[j + 1] ), p->p, p->v, p->f, restitution );
+                    }
+                }
+                removeSprings( brokenSprings );
+            }
+        } else {
+            if ( !explicitStep && solver == PROJECTIVE_DYNAMICS ) {
+                projectiveDynamics.update( particles, springs, h );
+            }
+            gatherState();
+            for ( int i = 0; i < substeps; i++ ) {
+                if ( !colliders.empty() ) previousPositions = positions;
+                diagnosticsPending = diagnostics.enabled;
+                if ( diagnosticsPending && !explicitStep && ( solver == XPBD || solver == PROJECTIVE_DYNAMICS ) ) {
+                    // these solvers do not evaluate spring forces, so measure separately
+                    computeForces( positions, velocities, forces );
+                }
+                if ( explicitStep ) {
+                    stepSymplecticEuler( h );
+                } else if ( solver == XPBD ) {
+                    stepXPBD( h );
+                    checkBreaking( positions );
+                } else if ( solver == PROJECTIVE_DYNAMICS ) {
+                    stepProjectiveDynamics( h );
+                    checkBreaking( positions );
+                } else if ( solver == IMPLICIT_MIDPOINT ) {
+                    stepImplicitMidpoint( h );
+                } else if ( solver == BDF2 ) {
+                    stepBDF2( h );
+                } else {
+                    // the working storage made in init() is kept up to date by the 
+                    // TopologyListener methods below, so no rebuild is needed here
+                    // unless the topology was cleared
+                    stepBackwardEuler( h );
+                }
+                diagnosticsPending = false;
+                time = time + h;
+                stepCount++;
+                wallCollisions( positions, velocities, forces );
+                colliders.collide( previousPositions, positions, velocities, forces, invMass, restitution );
+                if ( !brokenSprings.empty() ) {
+                    removeSprings( brokenSprings );
+                    if ( !explicitStep && solver == PROJECTIVE_DYNAMICS ) {
+                        projectiveDynamics.update( particles, springs, h );
+                    }
+                }
+            }
+            scatterState();
+        }
+        updateSleeping();
+        stepsSinceReorder += substeps;
+        if ( reorderMethod != NO_REORDERING && reorderInterval > 0 && stepsSinceReorder >= reorderInterval ) {
+            reorderParticles();
+        }
+        computeTime = (seconds() - now);
+        if ( diagnostics.steps > samples ) diagnostics.setStepTime( computeTime / substeps, diagnostics.steps - samples );
+    }
+
+    /** Put islands to sleep when they come to rest, see updateSleeping */
+    bool useSleeping = false;
+    /** Kinetic energy per free particle below which an island is calm */
+    Real sleepEnergy = 1e-3;
+    /** Number of consecutive calm calls to advance after which an island falls asleep */
+    int sleepSteps = 30;
+
+    /** Connected components of the spring and bending element graph */
+    Islands islands;
+    /** Indices of the sleeping particles, which are kept fixed like the pinned particles */
+    std::vector<int> sleepingIndices;
+    /** Springs with at least one awake end, used by the force pass while any island sleeps */
+    std::vector<int> awakeSprings;
+    int awakeSpringsVersion = -1;
+    /** Topology version for which sleepingIndices was built */
+    int sleepingVersion = -1;
+    /** Gravity when the islands fell asleep, they are woken when it changes */
+    float sleepGravity = 0;
+    bool sleepUseGravity = true;
+
+    /**
+     * Measures the kinetic energy of each awake island, and puts the islands that
+     * have been calm for sleepSteps calls to advance to sleep.  Sleeping particles
+     * get zero velocity and zero inverse mass, so every solver treats them as pinned
+     * and the force pass skips the springs between them.
+     */
+    void updateSleeping() {
+        if ( !useSleeping ) return;
+        if ( islands.dirty ) islands.rebuild( particles.size(), springs, bendingElements );
+        int n = particles.size();
+        std::vector<Real> energy( n, 0 );
+        std::vector<int> count( n, 0 );
+        for ( int i = 0; i < n; i++ ) {
+            Particle* p = particles[i];
+            if ( p->fixed() ) continue;
+            int r = islands.find( i );
+            energy[r] += 0.5 * p->mass * ( p->v.x * p->v.x + p->v.y * p->v.y );
+            count[r]++;
+        }
+        std::vector<char> sleep( n, false );
+        bool any = false;
+        for ( int r = 0; r < n; r++ ) {
+            if ( count[r] == 0 ) continue;
+            int& calm = islands.calmSteps[r];
+            calm = energy[r] < sleepEnergy * count[r] ? calm + 1 : 0;
+            sleep[r] = calm >= sleepSteps;
+            any |= sleep[r];
+        }
+        if ( !any ) return;
+        for ( int i = 0; i < n; i++ ) {
+            if ( !particles[i]->fixed() && sleep[islands.find( i )] ) setAsleep( i, true );
+        }
+        if ( sleepingIndices.empty() ) {
+            sleepGravity = gravity;
+            sleepUseGravity = useGravity;
+        }
+        updateSleepingIndices();
+    }
+
+    /**
+     * Wakes the islands touched by topology changes since the last call, or all
+     * islands when sleeping was turned off or gravity changed.  Called at the start
+     * of advance.
+     */
+    void wakeTouched() {
+        if ( !useSleeping || gravity != sleepGravity || useGravity != sleepUseGravity ) {
+            wakeAll();
+            return;
+        }
+        if ( !islands.touched.empty() && !sleepingIndices.empty() ) {
+            if ( islands.dirty ) islands.rebuild( particles.size(), springs, bendingElements );
+            int n = particles.size();
+            std::vector<char> wake( n, false );
+            for ( int i : islands.touched ) {
+                if ( i < n ) wake[islands.find( i )] = true;
+            }
+            for ( int i = 0; i < n; i++ ) {
+                if ( particles[i]->asleep && wake[islands.find( i )] ) setAsleep( i, false );
+            }
+            sleepingVersion = -1;
+        }
+        islands.clearTouched();
+        if ( sleepingVersion != topologyVersion ) updateSleepingIndices();
+    }
+
+    /**
+     * Wakes the island of the given particle, for instance when it is grabbed
+     * @param p
+     */
+    void wake( Particle* p ) {
+        islands.touched.push_back( p->index );
+    }
+
+    /**
+     * Wakes all particles
+     */
+    void wakeAll() {
+        sleepGravity = gravity;
+        sleepUseGravity = useGravity;
+        islands.clearTouched();
+        if ( sleepingIndices.empty() && sleepingVersion == topologyVersion ) return;
+        for ( size_t i = 0; i < particles.size(); i++ ) {
+            if ( particles[i]->asleep ) setAsleep( i, false );
+        }
+        std::fill( islands.calmSteps.begin(), islands.calmSteps.end(), 0 );
+        updateSleepingIndices();
+    }
+
+    /**
+     * Sets the sleeping flag of a particle, zeroing its velocity when it falls asleep,
+     * and its inverse mass when the mass arrays are current (otherwise updateMasses will)
+     * @param i particle index
+     * @param asleep
+     */
+    void setAsleep( int i, bool asleep ) {
+        Particle* p = particles[i];
+        if ( p->asleep != asleep ) fixedVersion++;
+        p->asleep = asleep;
+        if ( asleep ) p->v = vec2r( 0, 0 );
+        if ( massVersion == topologyVersion ) invMass[i] = p->fixed() ? 0 : 1 / mass[i];
+    }
+
+    /**
+     * Rebuilds the list of sleeping particles from their flags
+     */
+    void updateSleepingIndices() {
+        sleepingIndices.clear();
+        for ( Particle* p : particles ) {
+            if ( p->asleep ) sleepingIndices.push_back( p->index );
+        }
+        sleepingVersion = topologyVersion;
+        awakeSpringsVersion = -1;
+    }
+
+    /**
+     * Rebuilds the list of springs that have an awake end
+     */
+    void updateAwakeSprings() {
+        awakeSprings.clear();
+        for ( size_t k = 0; k < springs.size(); k++ ) {
+            if ( !( springs[k]->p1->asleep && springs[k]->p2->asleep ) ) awakeSprings.push_back( k );
+        }
+        awakeSpringsVersion = topologyVersion;
+    }
+
+    /** 
+     * Choose between fused symplectic Euler and an implicit solver, and the number
+     * of substeps, from an estimate of the stiffest mode, ignoring the integrator
+     * and substeps given to advance but leaving useExplicitIntegration and 
+     * implicitSolver as they are.  The other explicit integrators are not candidates,
+     * as for undamped springs symplectic Euler is stable up to h omega < 2 with one
+     * force evaluation, where RK4 needs four for h omega < 2.8, and forward Euler 
+     * and midpoint gain energy at any step size.
+     */
+    bool automaticStepping = false;
+    /** Fraction of the symplectic Euler stability limit, h omega < 2, to step at */
+    float stabilityMargin = 0.5f;
+    /** Power iterations refining the stiffest mode estimate, or zero to use only the Gershgorin bound */
+    int stabilityPowerIterations = 20;
+    /** Implicit solver to use when it is cheaper than explicit substeps */
+    ImplicitSolver automaticImplicitSolver = BDF2;
+    /** Largest number of symplectic Euler substeps per call to advance */
+    int maxAutomaticSubsteps = 1000;
+
+    /** Estimated highest angular frequency, and the choice made for it */
+    Real maxFrequency = 0;
+    int automaticSubsteps = 1;
+    bool automaticExplicit = true;
+    /** State for which the automatic choice was made */
+    int automaticTopologyVersion = -1;
+    int automaticParameterVersion = -1;
+    float automaticTotal = -1;
+
+    /**
+     * Chooses the solver and number of substeps for advancing by the given total
+     * time, keeping symplectic Euler within the stability margin.  A symplectic 
+     * Euler substep costs one force evaluation, while an implicit step costs about
+     * two for the assembly plus one per CG iteration, as measured by the last solve.
+     * The choice is only made again when the topology, spring or bending parameters,
+     * masses, or total time change.
+     * @param total time to advance
+     */
+    void chooseStepping( float total ) {
+        if ( massVersion != topologyVersion ) updateMasses();
+        if ( automaticTopologyVersion == topologyVersion && automaticParameterVersion == parameterVersion && automaticTotal == total ) return;
+        maxFrequency = estimateMaxFrequency();
+        Real steps = std::ceil( maxFrequency * total / ( 2 * stabilityMargin ) );
+        int cgIterations = CG.iterations > 0 ? CG.iterations : 20;
+        automaticExplicit = steps <= maxAutomaticSubsteps && steps <= 2 + cgIterations;
+        automaticSubsteps = automaticExplicit ? std::max( 1, (int) steps ) : 1;
+        automaticTopologyVersion = topologyVersion;
+        automaticParameterVersion = parameterVersion;
+        automaticTotal = total;
+    }
+
+    /**
+     * Estimates the highest angular frequency of the spring and bending network 
+     * about the current positions, the square root of the largest eigenvalue of 
+     * M^-1 K, with K = -dfdx without the transverse spring terms.  The Gershgorin 
+     * bound max_i sum_j |K_ij| / m_i is an upper bound.  Power iterations give a 
+     * lower bound, which is scaled by a safety factor and used instead when smaller.
+     * Pinned particles are left out.
+     * @return the frequency estimate in radians per unit time
+     */
+    Real estimateMaxFrequency() {
+        int n = particles.size();
+        if ( massVersion != topologyVersion ) updateMasses();
+        VectorXr x( 2 * n );
+        for ( int i = 0; i < n; i++ ) {
+            x[2 * i] = particles[i]->p.x;
+            x[2 * i + 1] = particles[i]->p.y;
+        }
+        // Gershgorin bound with the 2x2 block norms, k for a spring block
+        VectorXr rowSum = VectorXr::Zero( n );
+        for ( Spring* s : springs ) {
+            rowSum[s->p1->index] += 2 * s->k;
+            rowSum[s->p2->index] += 2 * s->k;
+        }
+        for ( const BendingElement& e : bendingElements ) {
+            vec2r g[3];
+            vec2r xs[3] = { particles[e.i0]->p, particles[e.i1]->p, particles[e.i2]->p };
+            BendingElement::gradient( xs, g );
+            Real sum = glm::length( g[0] ) + glm::length( g[1] ) + glm::length( g[2] );
+            int idx[3] = { e.i0, e.i1, e.i2 };
+            for ( int a = 0; a < 3; a++ ) rowSum[idx[a]] += e.k * glm::length( g[a] ) * sum;
+        }
+        Real bound = 0;
+        for ( int i = 0; i < n; i++ ) {
+            bound = std::max( bound, rowSum[i] * invMass[i] );
+        }
+        if ( stabilityPowerIterations <= 0 || bound == 0 ) return std::sqrt( bound );
+        // power iterations on M^-1 K from a fixed pseudo random start
+        VectorXr v( 2 * n ), Kv( 2 * n );
+        unsigned int seed = 12345;
+        for ( int i = 0; i < 2 * n; i++ ) {
+            seed = seed * 1664525u + 1013904223u;
+            v[i] = invMass[i / 2] == 0 ? 0 : Real( seed >> 8 ) / Real( 1 << 24 ) - Real( 0.5 );
+        }
+        Real lambda = 0;
+        for ( int it = 0; it < stabilityPowerIterations; it++ ) {
+            applyStiffness( x, v, Kv );
+            Real vMv = 0;
+            for ( int i = 0; i < 2 * n; i++ ) {
+                if ( invMass[i / 2] != 0 ) vMv += mass[i / 2] * v[i] * v[i];
+            }
+            if ( vMv == 0 ) break;
+            lambda = v.dot( Kv ) / vMv;
+            for ( int i = 0; i < 2 * n; i++ ) v[i] = Kv[i] * invMass[i / 2];
+            Real norm = v.norm();
+            if ( norm == 0 ) break;
+            v /= norm;
+        }
+        // power iteration approaches the top of a dense spectrum slowly from below
+        return std::sqrt( std::min( bound, Real( 1.5 ) * lambda ) );
+    }
+
+    /**
+     * Computes Kv = -dfdx v for the axial spring stiffness and the bending elements,
+     * without forming the matrix
+     * @param x positions
+     * @param v
+     * @param Kv
+     */
+    void applyStiffness( const VectorXr& x, const VectorXr& v, VectorXr& Kv ) {
+        Kv.setZero( v.size() );
+        for ( Spring* s : springs ) {
+            int i = 2 * s->p1->index;
+            int j = 2 * s->p2->index;
+            Real dx = x[j] - x[i];
+            Real dy = x[j + 1] - x[i + 1];
+            Real l = std::sqrt( dx * dx + dy * dy );
+            if ( l == 0 ) continue;
+            Real nx = dx / l;
+            Real ny = dy / l;
+            Real f = s->k * ( nx * ( v[j] - v[i] ) + ny * ( v[j + 1] - v[i + 1] ) );
+            Kv[i] -= f * nx;
+            Kv[i + 1] -= f * ny;
+            Kv[j] += f * nx;
+            Kv[j + 1] += f * ny;
+        }
+        for ( const BendingElement& e : bendingElements ) {
+            int idx[3] = { 2 * e.i0, 2 * e.i1, 2 * e.i2 };
+            vec2r g[3];
+            vec2r xs[3];
+            for ( int a = 0; a < 3; a++ ) xs[a] = vec2r( x[idx[a]], x[idx[a] + 1] );
+            BendingElement::gradient( xs, g );
+            Real f = 0;
+            for ( int a = 0; a < 3; a++ ) f += g[a].x * v[idx[a]] + g[a].y * v[idx[a] + 1];
+            for ( int a = 0; a < 3; a++ ) {
+                Kv[idx[a]] += e.k * f * g[a].x;
+                Kv[idx[a] + 1] += e.k * f * g[a].y;
+            }
+        }
+    }
+
+    /** Static obstacles, tested along each particle's path after the wall collisions */
+    StaticColliders colliders;
+
+    /** Positions at the start of the current substep, for the swept obstacle test */
+    VectorXr previousPositions;
+
+    /**
+     * Same wall collisions as postStepFix, but on the split arrays.  Pinned particles 
+     * already have zero velocity in the arrays and are not written back by scatterState.
+     * @param x positions
+     * @param xd velocities
+     * @param f forces
+     */
+    void wallCollisions( VectorXr& x, VectorXr& xd, VectorXr& f ) {
+        int n = particles.size();
+        Real r = restitution;
+        Real w = width;
+        Real h = height;
+        Real* px = x.data();
+        Real* pv = xd.data();
+        Real* pf = f.data();
+        if ( backend != NULL ) {
+            backend->parallelFor( n, [=]( int begin, int end ) {
+                for ( int i = begin; i < end; i++ ) {
+                    wall( px[2 * i], pv[2 * i], pf[2 * i], 0, w, r );
+                    wall( px[2 * i + 1], pv[2 * i + 1], pf[2 * i + 1], 0, h, r );
+                }
+            } );
+            return;
+        }
+        #pragma omp simd
+        for ( int i = 0; i < n; i++ ) {
+            wall( px[2 * i], pv[2 * i], pf[2 * i], 0, w, r );
+            wall( px[2 * i + 1], pv[2 * i + 1], pf[2 * i + 1], 0, h, r );
+        }
+    }
+    
+    void filter(VectorXr& v) {
+        for ( int i : pinnedIndices ) {
+            v[ i*2+0] = 0;
+            v[ i*2+1] = 0;
+        }
+        for ( int i : sleepingIndices ) {
+            v[ i*2+0] = 0;
+            v[ i*2+1] = 0;
+        }
+    }
+
+    /**
+     * Creates a new particle and adds it to the system
+     * @param x
+     * @param y
+     * @param vx
+     * @param vy
+     * @return the new particle
+     */
+    Particle* createParticle( float x, float y, float vx, float vy ) {
+        Particle* p = new Particle( x, y, vx, vy );
+        p->index = particles.size();
+        particles.push_back( p );
+        topologyVersion++;
+        for ( TopologyListener* l : listeners ) l->particleAdded( p );
+        return p;
+    }
+    
+    /**
+     * Adds many already created particles and springs at once, for instance from a
+     * scene file.  The particles are given their indices here, and the springs must
+     * already be in their particles' spring lists, as done by the Spring constructor.
+     * @param newParticles
+     * @param newSprings
+     */
+    void addAll( const std::vector<Particle*>& newParticles, const std::vector<Spring*>& newSprings ) {
+        particles.reserve( particles.size() + newParticles.size() );
+        springs.reserve( springs.size() + newSprings.size() );
+        for ( Particle* p : newParticles ) {
+            p->index = particles.size();
+            particles.push_back( p );
+            for ( TopologyListener* l : listeners ) l->particleAdded( p );
+        }
+        for ( Spring* s : newSprings ) {
+            springs.push_back( s );
+            for ( TopologyListener* l : listeners ) l->springAdded( s );
+        }
+        topologyVersion++;
+    }
+
+    /**
+     * Removes and deletes a particle and all its springs.  The last particle is 
+     * moved into the freed slot so that only one particle changes index.
+     * @param p
+     */
+    void remove( Particle* p ) {
+        std::vector<Spring*> attached = p->springs;
+    	for ( Spring* s : attached ) {
+            removeSpring( s );
+    	}
+        int index = p->index;
+        int last = particles.size() - 1;
+        removeBendingElements( index, last );
+        particles[index] = particles[last];
+        particles[index]->index = index;
+        particles.pop_back();
+        topologyVersion++;
+        for ( TopologyListener* l : listeners ) l->particleRemoved( index, last );
+        delete p;
+    }
+    
+    /**
+     * Creates a new spring between two particles and adds it to the system.
+     * @param p1
+     * @param p2
+     * @return the new spring
+     */
+    Spring* createSpring( Particle* p1, Particle* p2, int material = 0 ) {
+        Spring* s = new Spring( p1, p2 ); 
+        s->material = material;
+        applyMaterial( s );
+        springs.push_back( s );         
+        topologyVersion++;
+        for ( TopologyListener* l : listeners ) l->springAdded( s );
+        return s;
+    }
+
+    /**
+     * Creates a new bending element on three consecutive particles of a chain, with 
+     * its rest angle taken from their initial positions.
+     * @param p0
+     * @param p1 the middle particle
+     * @param p2
+     */
+    void createBendingElement( Particle* p0, Particle* p1, Particle* p2 ) {
+        BendingElement e( p0, p1, p2 );
+        e.k = bendingStiffness;
+        e.c = bendingDamping;
+        bendingElements.push_back( e );
+        topologyVersion++;
+        if ( !islands.dirty ) {
+            islands.unite( e.i0, e.i1 );
+            islands.unite( e.i1, e.i2 );
+        }
+        islands.touched.push_back( e.i1 );
+        if ( implicitStorageValid ) addBendingPattern( e );
+    }
+
+    /**
+     * Removes the bending elements that use the particle at the given index, and 
+     * renumbers references to the last particle, which is about to move into its slot.
+     * @param index
+     * @param last
+     */
+    void removeBendingElements( int index, int last ) {
+        auto uses = [index]( const BendingElement& e ) { return e.i0 == index || e.i1 == index || e.i2 == index; };
+        if ( implicitStorageValid ) {
+            for ( const BendingElement& e : bendingElements ) {
+                if ( uses( e ) ) removeBendingPattern( e );
+            }
+        }
+        bendingElements.erase( std::remove_if( bendingElements.begin(), bendingElements.end(), uses ), bendingElements.end() );
+        for ( BendingElement& e : bendingElements ) {
+            if ( e.i0 == last ) e.i0 = index;
+            if ( e.i1 == last ) e.i1 = index;
+            if ( e.i2 == last ) e.i2 = index;
+        }
+    }
+
+    /**
+     * Removes and deletes the given spring
+     * @param s
+     */
+    void removeSpring( Spring* s ) {
+        for ( TopologyListener* l : listeners ) l->springRemoved( s );
+        s->p1->springs.erase(std::remove(s->p1->springs.begin(), s->p1->springs.end(), s), s->p1->springs.end());
+        s->p2->springs.erase(std::remove(s->p2->springs.begin(), s->p2->springs.end(), s), s->p2->springs.end());
+        springs.erase(std::remove(springs.begin(), springs.end(), s), springs.end());
+        topologyVersion++;
+        delete s;
+    }
+    
+    /**
+     * Removes and deletes a batch of springs in one compaction pass over the spring
+     * list and the affected particles' lists, rather than one search per spring.
+     * The batch is cleared.
+     * @param batch springs to remove, each at most once
+     */
+    void removeSprings( std::vector<Spring*>& batch ) {
+        if ( batch.empty() ) return;
+        for ( Spring* s : batch ) {
+            s->broken = true;
+            for ( TopologyListener* l : listeners ) l->springRemoved( s );
+        }
+        auto marked = []( Spring* s ) { return s->broken; };
+        for ( Spring* s : batch ) {
+            for ( Particle* p : { s->p1, s->p2 } ) {
+                p->springs.erase( std::remove_if( p->springs.begin(), p->springs.end(), marked ), p->springs.end() );
+            }
+        }
+        springs.erase( std::remove_if( springs.begin(), springs.end(), marked ), springs.end() );
+        topologyVersion++;
+        for ( Spring* s : batch ) delete s;
+        batch.clear();
+    }
+
+    /**
+     * Removes a spring between p1 and p2 if it exists, does nothing otherwise
+     * @param p1
+     * @param p2
+     * @return true if the spring was found and removed
+     */
+    bool removeSpring( Particle* p1 = new Particle, Particle* p2 = new Particle ) {
+    	Spring* found = NULL;
+    	for ( Spring* s : springs ) {
+    		if ( ( s->p1 == p1 && s->p2 == p2 ) || ( s->p1 == p2 && s->p2 == p1 ) ) {
+    			found = s;
+    			break;
+    		}
+    	}
+    	if ( found != NULL ) {
+            removeSpring( found );
+			return true;
+    	}
+    	return false;
+    }
+    
+    /**
+     * Builds the implicit solver working storage from scratch.  After this, the
+     * TopologyListener methods keep it up to date as particles and springs change,
+     * until the topology is cleared, after which it is built again by the next
+     * backward Euler step.  This keeps bulk loads from paying for it up front.
+     */
+    void init() {
+        topologyCleared();
+        implicitStorageValid = true;
+        jacobianCache.invalidate();
+        deltaxdot.setZero( 2 * particles.size() );
+        b.resize( 2 * particles.size() );
+        for ( Particle* p : particles ) {
+            particleAdded( p );
+        }
+        for ( Spring* s : springs ) {
+            springAdded( s );
+        }
+        for ( const BendingElement& e : bendingElements ) {
+            addBendingPattern( e );
+        }
+    }
+
+    /** True while the implicit solver working storage matches the topology */
+    bool implicitStorageValid = false;
+
+    void particleAdded( Particle* p ) {
+        if ( !implicitStorageValid ) return;
+        A.addRow();
+        dfdx.addRow();
+        dfdv.addRow();
+        int n = p->index + 1;
+        if ( deltaxdot.size() < 2 * n ) {
+            deltaxdot.conservativeResize( 2 * n );
+            deltaxdot.tail<2>().setZero();
+            b.resize( 2 * n );
+        }
+    }
+
+    void particleRemoved( int index, int last ) {
+        if ( !implicitStorageValid ) return;
+        A.removeRow( index );
+        dfdx.removeRow( index );
+        dfdv.removeRow( index );
+        deltaxdot.segment<2>( 2 * index ) = deltaxdot.segment<2>( 2 * last );
+        deltaxdot.conservativeResize( 2 * last );
+        b.resize( 2 * last );
+    }
+
+    void springAdded( Spring* s ) {
+        if ( !implicitStorageValid ) return;
+        A.addPair( s->p1->index, s->p2->index );
+        dfdx.addPair( s->p1->index, s->p2->index );
+        dfdv.addPair( s->p1->index, s->p2->index );
+    }
+
+    void springRemoved( Spring* s ) {
+        if ( !implicitStorageValid ) return;
+        A.removePair( s->p1->index, s->p2->index );
+        dfdx.removePair( s->p1->index, s->p2->index );
+        dfdv.removePair( s->p1->index, s->p2->index );
+    }
+
+    /**
+     * Adds the blocks coupling the three particles of a bending element to the 
+     * implicit solver matrices
+     */
+    void addBendingPattern( const BendingElement& e ) {
+        for ( BlockSparseMatrix* M : { &A, &dfdx, &dfdv } ) {
+            M->addPair( e.i0, e.i1 );
+            M->addPair( e.i1, e.i2 );
+            M->addPair( e.i0, e.i2 );
+        }
+    }
+
+    void removeBendingPattern( const BendingElement& e ) {
+        for ( BlockSparseMatrix* M : { &A, &dfdx, &dfdv } ) {
+            M->removePair( e.i0, e.i1 );
+            M->removePair( e.i1, e.i2 );
+            M->removePair( e.i0, e.i2 );
+        }
+    }
+
+    void topologyCleared() {
+        A.clear();
+        dfdx.clear();
+        dfdv.clear();
+        deltaxdot.resize( 0 );
+        b.resize( 0 );
+        implicitStorageValid = false;
+    }
+
+    int height;
+    int width;
+
+    void display() {
+
+        colliders.display();
+
+        glPointSize( 10 );
+        glBegin( GL_POINTS );
+        for ( Particle* p : particles ) {
+            double alpha = 0.5;
+            if ( p->pinned ) {
+                glColor4d( 1, 0, 0, alpha );
+            } else if ( p->asleep ) {
+                glColor4d( 0.4, 0.4, 0.8, alpha );
+            } else {
+                glColor4d( p->color.x, p->color.y, p->color.z, alpha );
+            }
+            glVertex2d( p->p.x, p->p.y );
+        }
+        glEnd();
+        
+        glColor4d(0,.5,.5,.5);
+        glLineWidth(2.0f);
+        glBegin( GL_LINES );
+        for (Spring* s : springs) {
+            glVertex2d( s->p1->p.x, s->p1->p.y );
+            glVertex2d( s->p2->p.x, s->p2->p.y );
+        }
+        glEnd();
+
+        // bending elements are drawn as a short arc across the bend
+        glColor4d( .5, .5, 0, .5 );
+        glBegin( GL_LINES );
+        for ( const BendingElement& e : bendingElements ) {
+            vec2r c = particles[e.i1]->p;
+            vec2r a = c + ( particles[e.i0]->p - c ) * Real( 0.25 );
+            vec2r b = c + ( particles[e.i2]->p - c ) * Real( 0.25 );
+            glVertex2d( a.x, a.y );
+            glVertex2d( b.x, b.y );
+        }
+        glEnd();
+    }
+    
+    bool useGravity = true;
+    float gravity = 9.8;
     float springStiffness = 100;
     float springDamping = 0;
+
+    /** 
+     * Spring material class, with stiffness and damping relative to the global
+     * springStiffness and springDamping, which act as multipliers for all materials.
+     */
+    struct SpringMaterial {
+        float k = 1;
+        float c = 1;
+    };
+
+    /** Material classes, the first is the default with unit factors */
+    std::vector<SpringMaterial> materials = { SpringMaterial() };
+
+    /**
+     * Adds a material class
+     * @param k stiffness relative to springStiffness
+     * @param c damping relative to springDamping
+     * @return the index of the new material
+     */
+    int addMaterial( float k, float c ) {
+        materials.push_back( SpringMaterial{ k, c } );
+        materialsChanged();
+        return materials.size() - 1;
+    }
+
+    /**
+     * Call after changing materials or assigning springs to other materials
+     */
+    void materialsChanged() {
+        propagatedStiffness = -1;
+    }
+
+    /**
+     * Sets a spring's k and c from its material and the global multipliers, unless 
+     * the spring overrides them
+     * @param s
+     */
+    void applyMaterial( Spring* s ) {
+        const SpringMaterial& m = materials[s->material];
+        s->k = std::isnan( s->kOverride ) ? m.k * springStiffness : s->kOverride;
+        s->c = std::isnan( s->cOverride ) ? m.c * springDamping : s->cOverride;
+    }
+
+    /**
+     * Sets every spring's k and c from its material and the global multipliers.  
+     * Only done when the multipliers or materials have changed, so the force loops
+     * read each spring's own values with no per step overhead.
+     */
+    void updateSpringParameters() {
+        if ( springStiffness == propagatedStiffness && springDamping == propagatedDamping ) return;
+        for ( Spring* s : springs ) applyMaterial( s );
+        propagatedStiffness = springStiffness;
+        propagatedDamping = springDamping;
+        parameterVersion++;
+        wakeAll();
+    }
+
+    /** Stiffness of new bending elements, in force times length per radian */
+    float bendingStiffness = 10000;
+    /** Damping of the bending angle rate of new bending elements */
+    float bendingDamping = 0;
+    float propagatedBendingStiffness = 10000;
+    float propagatedBendingDamping = 0;
+
+    /**
+     * Sets the stiffness and damping of all bending elements when changed from the interface
+     */
+    void updateBendingParameters() {
+        if ( bendingStiffness == propagatedBendingStiffness && bendingDamping == propagatedBendingDamping ) return;
+        for ( BendingElement& e : bendingElements ) {
+            e.k = bendingStiffness;
+            e.c = bendingDamping;
+        }
+        propagatedBendingStiffness = bendingStiffness;
+        propagatedBendingDamping = bendingDamping;
+        parameterVersion++;
+        wakeAll();
+    }
+
+    /** Incremented whenever spring or bending parameters or the mass arrays are updated */
+    int parameterVersion = 0;
+
+    /** Values of springStiffness and springDamping last pushed to all the springs */
+    float propagatedStiffness = -1;
+    float propagatedDamping = -1;
     float viscousDamping = 0;
     /** should only go between 0 and 1 for bouncing off walls */
     float restitution = 0;
     int solverIterations = 100;
+    /** relative residual at which the conjugate gradient solve stops */
+    float solverTolerance = 1e-4;
+    /** local/global iterations per step for projective dynamics */
+    int projectiveDynamicsIterations = 10;
     bool useExplicitIntegration = true;
 };
\ No newline at end of file
@@ -0,0 +1,60 @@
+#pragma once
+#include <Eigen/Dense>
+
+#define GLM_FORCE_RADIANS
+#include <glm/glm.hpp>
+
+/**
+ * Precision policies for the simulation state.  A policy gives the scalar type
+ * used for positions, velocities, forces, and spring parameters, and the way 
+ * integrator updates x += dx are accumulated.  The compensated policy keeps float
+ * storage but carries the rounding error of each update in a separate array
+ * (Kahan summation), which removes most of the drift of long float runs at a 
+ * fraction of the cost of double storage.
+ *
+ * The policy is chosen at build time with COMP559_PRECISION in CMake, and 
+ * Function, Integrator, and Spring are templated on it.
+ */
+struct SinglePrecision {
+    typedef float Scalar;
+    static const bool compensated = false;
+    static inline void add( Scalar& x, Scalar dx, Scalar& c ) {
+        x += dx;
+    }
+};
+
+struct CompensatedSinglePrecision {
+    typedef float Scalar;
+    static const bool compensated = true;
+    /**
+     * Kahan summation, c holds the low order bits lost by previous additions to x
+     */
+    static inline void add( Scalar& x, Scalar dx, Scalar& c ) {
+        Scalar y = dx - c;
+        Scalar t = x + y;
+        c = ( t - x ) - y;
+        x = t;
+    }
+};
+
+struct DoublePrecision {
+    typedef double Scalar;
+    static const bool compensated = false;
+    static inline void add( Scalar& x, Scalar dx, Scalar& c ) {
+        x += dx;
+    }
+};
+
+#if defined(COMP559_DOUBLE_PRECISION)
+typedef DoublePrecision Precision;
+#elif defined(COMP559_COMPENSATED_PRECISION)
+typedef CompensatedSinglePrecision Precision;
+#else
+typedef SinglePrecision Precision;
+#endif
+
+/** Scalar type of the simulation state for the selected precision policy */
+typedef Precision::Scalar Real;
+typedef Eigen::Matrix<Real, Eigen::Dynamic, 1> VectorXr;
+typedef Eigen::Matrix<Real, Eigen::Dynamic, Eigen::Dynamic> MatrixXr;
+typedef glm::vec<2, Real, glm::defaultp> vec2r;
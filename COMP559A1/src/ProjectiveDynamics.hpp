@@ -0,0 +1,267 @@
+#pragma once
+#include <vector>
+
+#include <Eigen/Sparse>
+
+#include "Precision.hpp"
+#include "Particle.hpp"
+#include "Spring.hpp"
+#include "TopologyListener.hpp"
+
+/**
+ * Projective dynamics solver for mass spring systems.  The global system matrix
+ * M/h^2 + sum_s k_s A_s^T A_s depends only on the spring graph, the stiffnesses,
+ * the masses, the pinned particles and the step size, so it is factored once 
+ * and reused every step.  Each iteration is then a parallel local projection of 
+ * every spring onto its rest length followed by one back-substitution.  The x 
+ * and y coordinates share the same matrix and are solved together.  Topology
+ * edits only trigger a new symbolic analysis when they change the sparsity
+ * pattern, otherwise the matrix is refilled and numerically refactored.
+ * 
+ * Only the spring stiffness is modeled.  Spring damping and bending elements are
+ * ignored, as neither is a projection onto a constraint set with a constant 
+ * matrix, so scenes that rely on them behave differently with this solver.
+ * 
+ * See Liu, Bargteil, O'Brien, and Kavan, "Fast Simulation of Mass-Spring 
+ * Systems", SIGGRAPH Asia 2013, and Bouaziz et al., "Projective Dynamics", 
+ * SIGGRAPH 2014.
+ */
+class ProjectiveDynamicsSolver : public TopologyListener {
+public:
+    Eigen::SparseMatrix<Real> L;
+    Eigen::SimplicialLDLT<Eigen::SparseMatrix<Real>> ldlt;
+
+    /** Row of each particle in the global system, -1 for pinned particles */
+    std::vector<int> freeIndex;
+    /** Particle index of each row in the global system */
+    std::vector<int> freeParticles;
+    /** Spring stiffnesses used in the factored matrix */
+    std::vector<Real> weights;
+    /** Step size used in the factored matrix */
+    Real factoredH = 0;
+    /** Set when the sparsity pattern of the matrix must be rebuilt and analyzed */
+    bool patternDirty = true;
+    /** Set when the matrix entries changed but its sparsity pattern did not */
+    bool valuesDirty = true;
+    /** Number of symbolic analyses computed so far, for reporting */
+    int analyses = 0;
+    /** Number of numeric factorizations computed so far, for reporting */
+    int factorizations = 0;
+
+    /** Projected spring vectors, two floats per spring */
+    VectorXr d;
+    /** Inertial target positions, one row per free particle */
+    MatrixXr y;
+    MatrixXr rhs;
+    MatrixXr sol;
+
+    /**
+     * Brings the factorization up to date.  Topology edits are tracked through 
+     * the listener interface, but the pinned flags and the spring stiffnesses can 
+     * be changed by the user without a topology change, so these are compared too
+     * (cheap compared to a step).  Only a change in the free particles or a spring 
+     * between particles not already coupled requires a new symbolic analysis, 
+     * anything else is a numeric refactorization on the same pattern.
+     */
+    void update( std::vector<Particle*>& particles, std::vector<Spring*>& springs, Real h ) {
+        if ( freeIndex.size() != particles.size() ) patternDirty = true;
+        for ( size_t i = 0; i < particles.size() && !patternDirty; i++ ) {
+            if ( particles[i]->fixed() != ( freeIndex[i] < 0 ) ) patternDirty = true;
+        }
+        if ( factoredH != h || weights.size() != springs.size() ) valuesDirty = true;
+        for ( size_t i = 0; i < springs.size() && !valuesDirty; i++ ) {
+            if ( springs[i]->k != weights[i] ) valuesDirty = true;
+        }
+        if ( patternDirty ) {
+            analyze( particles, springs );
+        }
+        if ( patternDirty || valuesDirty ) {
+            factor( particles, springs, h );
+        }
+        patternDirty = false;
+        valuesDirty = false;
+    }
+
+    void particleAdded( Particle* p ) {
+        patternDirty = true;
+    }
+
+    void particleRemoved( int index, int last ) {
+        patternDirty = true;
+    }
+
+    void springAdded( Spring* s ) {
+        valuesDirty = true;
+        if ( patternDirty || s->p1->index >= (int) freeIndex.size() || s->p2->index >= (int) freeIndex.size() ) return;
+        int a = freeIndex[s->p1->index];
+        int b = freeIndex[s->p2->index];
+        if ( a >= 0 && b >= 0 && !hasEntry( a, b ) ) patternDirty = true;
+    }
+
+    void springRemoved( Spring* s ) {
+        // the coupling stays in the pattern as an explicit zero
+        valuesDirty = true;
+    }
+
+    void topologyCleared() {
+        patternDirty = true;
+    }
+
+    /**
+     * Builds the sparsity pattern of the global system matrix over the free 
+     * particles and computes the symbolic factorization.
+     */
+    void analyze( std::vector<Particle*>& particles, std::vector<Spring*>& springs ) {
+        int n = particles.size();
+        freeIndex.assign( n, -1 );
+        freeParticles.clear();
+        for ( int i = 0; i < n; i++ ) {
+            if ( particles[i]->fixed() ) continue;
+            freeIndex[i] = freeParticles.size();
+            freeParticles.push_back( i );
+        }
+        int nf = freeParticles.size();
+        std::vector<Eigen::Triplet<Real>> triplets;
+        triplets.reserve( nf + 2 * springs.size() );
+        for ( int r = 0; r < nf; r++ ) {
+            triplets.emplace_back( r, r, 1 );
+        }
+        for ( Spring* s : springs ) {
+            int a = freeIndex[s->p1->index];
+            int b = freeIndex[s->p2->index];
+            if ( a >= 0 && b >= 0 ) {
+                triplets.emplace_back( a, b, 1 );
+                triplets.emplace_back( b, a, 1 );
+            }
+        }
+        L.resize( nf, nf );
+        L.setFromTriplets( triplets.begin(), triplets.end() );
+        L.makeCompressed();
+        ldlt.analyzePattern( L );
+        analyses++;
+    }
+
+    /**
+     * Fills in the global system matrix on the current pattern and computes the
+     * numeric factorization.
+     */
+    void factor( std::vector<Particle*>& particles, std::vector<Spring*>& springs, Real h ) {
+        int nf = freeParticles.size();
+        std::fill( L.valuePtr(), L.valuePtr() + L.nonZeros(), Real( 0 ) );
+        for ( int r = 0; r < nf; r++ ) {
+            L.coeffRef( r, r ) = particles[freeParticles[r]]->mass / ( h * h );
+        }
+        weights.resize( springs.size() );
+        for ( size_t i = 0; i < springs.size(); i++ ) {
+            Spring* s = springs[i];
+            Real k = weights[i] = s->k;
+            int a = freeIndex[s->p1->index];
+            int b = freeIndex[s->p2->index];
+            if ( a >= 0 ) L.coeffRef( a, a ) += k;
+            if ( b >= 0 ) L.coeffRef( b, b ) += k;
+            if ( a >= 0 && b >= 0 ) {
+                L.coeffRef( a, b ) -= k;
+                L.coeffRef( b, a ) -= k;
+            }
+        }
+        ldlt.factorize( L );
+        factoredH = h;
+        factorizations++;
+    }
+
+    /**
+     * Advances positions and velocities by h.
+     * @param x positions (x and y interleaved per particle)
+     * @param v velocities
+     * @param w inverse masses, zero for pinned particles
+     * @param fext external forces (gravity, viscous damping)
+     * @param h step size, must match the factored step size
+     * @param iterations number of local/global iterations
+     */
+    void step( std::vector<Spring*>& springs, VectorXr& x, VectorXr& v, const VectorXr& w, const VectorXr& fext, Real h, int iterations ) {
+        int nf = freeParticles.size();
+        int m = springs.size();
+        if ( nf == 0 ) return;
+        y.resize( nf, 2 );
+        rhs.resize( nf, 2 );
+        d.resize( 2 * m );
+        for ( int r = 0; r < nf; r++ ) {
+            int i = freeParticles[r];
+            y( r, 0 ) = x[2 * i] + h * v[2 * i] + h * h * w[i] * fext[2 * i];
+            y( r, 1 ) = x[2 * i + 1] + h * v[2 * i + 1] + h * h * w[i] * fext[2 * i + 1];
+        }
+        // x is the previous position, keep it for the velocity update and iterate in sol
+        sol = y;
+        for ( int it = 0; it < iterations; it++ ) {
+            // local step: project each spring onto its rest length
+            #pragma omp parallel for
+            for ( int k = 0; k < m; k++ ) {
+                Spring* s = springs[k];
+                Real ax, ay, bx, by;
+                position( s->p1->index, x, ax, ay );
+                position( s->p2->index, x, bx, by );
+                Real dx = ax - bx;
+                Real dy = ay - by;
+                Real l = sqrt( dx * dx + dy * dy );
+                Real scale = l > 0 ? (Real) s->l0 / l : 0;
+                d[2 * k] = dx * scale;
+                d[2 * k + 1] = dy * scale;
+            }
+            // global step: one back-substitution, solving for the change from the current
+            // iterate, as solving for absolute screen coordinates loses too many digits
+            // when Real is float
+            for ( int r = 0; r < nf; r++ ) {
+                Real mh = 1 / ( w[freeParticles[r]] * h * h );
+                rhs( r, 0 ) = mh * y( r, 0 );
+                rhs( r, 1 ) = mh * y( r, 1 );
+            }
+            for ( int k = 0; k < m; k++ ) {
+                Spring* s = springs[k];
+                Real ks = weights[k];
+                int i = s->p1->index;
+                int j = s->p2->index;
+                int a = freeIndex[i];
+                int b = freeIndex[j];
+                if ( a >= 0 ) {
+                    rhs( a, 0 ) += ks * ( d[2 * k] + ( b < 0 ? x[2 * j] : 0 ) );
+                    rhs( a, 1 ) += ks * ( d[2 * k + 1] + ( b < 0 ? x[2 * j + 1] : 0 ) );
+                }
+                if ( b >= 0 ) {
+                    rhs( b, 0 ) += ks * ( -d[2 * k] + ( a < 0 ? x[2 * i] : 0 ) );
+                    rhs( b, 1 ) += ks * ( -d[2 * k + 1] + ( a < 0 ? x[2 * i + 1] : 0 ) );
+                }
+            }
+            rhs.noalias() -= L * sol;
+            sol += ldlt.solve( rhs );
+        }
+        Real ih = 1 / h;
+        for ( int r = 0; r < nf; r++ ) {
+            int i = freeParticles[r];
+            v[2 * i] = ( sol( r, 0 ) - x[2 * i] ) * ih;
+            v[2 * i + 1] = ( sol( r, 1 ) - x[2 * i + 1] ) * ih;
+            x[2 * i] = sol( r, 0 );
+            x[2 * i + 1] = sol( r, 1 );
+        }
+    }
+
+private:
+    /** @return true if the matrix pattern couples free rows a and b */
+    bool hasEntry( int a, int b ) {
+        for ( Eigen::SparseMatrix<Real>::InnerIterator it( L, b ); it; ++it ) {
+            if ( it.row() == a ) return true;
+        }
+        return false;
+    }
+
+    /** Current iterate for a free particle, or the fixed position of a pinned one */
+    inline void position( int i, const VectorXr& x, Real& px, Real& py ) {
+        int r = freeIndex[i];
+        if ( r < 0 ) {
+            px = x[2 * i];
+            py = x[2 * i + 1];
+        } else {
+            px = sol( r, 0 );
+            py = sol( r, 1 );
+        }
+    }
+};
@@ -1,15 +1,53 @@
+#pragma once
 #include <string>
 #include "Integrator.hpp"
+#include "StateUpdate.hpp"
 
+/**
+ * Classical fourth order Runge-Kutta.  The stage states and the final 
+ * p + h/6 ( k1 + 2 k2 + 2 k3 + k4 ) are each computed in one pass, see StateUpdate.
+ */
 class RK4 : public Integrator {
 public:
     std::string getName() {
         return "RK4";
     }
 
-    void step(VectorXf& p, int n, float t, float h, VectorXf& pout, Function* derivs) {
-        // TODO: Objective 6, implement the RK4 integration method
-        // see also efficient memory management suggestion in provided code for the Midpoint method.
+    VectorXr tmp;
+    VectorXr k1;
+    VectorXr k2;
+    VectorXr k3;
+    VectorXr k4;
+    /** Rounding error carried between steps by the compensated precision policy */
+    VectorXr error;
 
+    void step(VectorXr& p, int n, float t, float h, VectorXr& pout, Function* derivs) {
+        if ( tmp.size() != n ) {
+            tmp.resize( n );
+            k1.resize( n );
+            k2.resize( n );
+            k3.resize( n );
+            k4.resize( n );
+            error.setZero( n );
+        }
+        if ( pout.size() != n ) pout.resize( n );
+        derivs->derivs( t, p, k1 );
+        stage( n, p, h / 2, k1 );
+        derivs->derivs( t + h / 2, tmp, k2 );
+        stage( n, p, h / 2, k2 );
+        derivs->derivs( t + h / 2, tmp, k3 );
+        stage( n, p, h, k3 );
+        derivs->derivs( t + h, tmp, k4 );
+        const Real a[] = { h / 6, h / 3, h / 3, h / 6 };
+        const Real* k[] = { k1.data(), k2.data(), k3.data(), k4.data() };
+        StateUpdate::combine<Precision>( n, pout.data(), p.data(), a, k, error.data(), backend );
     }
-};
\ No newline at end of file
+
+private:
+    /** Sets tmp = p + a k */
+    void stage( int n, VectorXr& p, Real a, const VectorXr& k ) {
+        const Real as[] = { a };
+        const Real* ks[] = { k.data() };
+        StateUpdate::combine( n, tmp.data(), p.data(), as, ks, backend );
+    }
+};
@@ -0,0 +1,636 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <charconv>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <cmath>
+#include <filesystem>
+
+#include "ParticleSystem.hpp"
+
+/**
+ * Loads and saves particle system scenes.
+ *
+ * The text format has one item per line, with # comments:
+ *   p x y [vx vy [mass [pinned [r g b]]]]
+ *   material k c
+ *   s i j [k c [l0 [material]]]
+ *   b i j k
+ *   name value
+ * where i, j, and k index the particles in the order they appear, and b lines
+ * are bending elements bending at j, with rest angle from the initial positions.  Materials are 
+ * numbered from 1 in the order they appear, with stiffness and damping relative
+ * to the system springStiffness and springDamping.  Springs without a material 
+ * use the default material 0.  A spring's k and c are absolute values that 
+ * override those of its material, and nan or leaving them out uses the material.
+ * Springs without l0, or with nan, use the initial distance.
+ * The name is one of the system parameters gravity, useGravity, viscousDamping,
+ * springStiffness, springDamping, restitution, breakingStrain, solverIterations,
+ * bendingStiffness, or bendingDamping.
+ *
+ * The text is parsed in chunks in parallel.  When a cache directory is given, a
+ * binary copy of each text scene is kept there, tagged with a hash of the text it
+ * was made from, and used instead on later loads of the same text.  The binary
+ * format is the header followed by the raw particle and spring records, in the byte
+ * order of the machine that wrote it.
+ *
+ * Parsing, creating the particles and springs, and filling the spring lists of the
+ * particles run in parallel; what remains serial is reading the file and adding
+ * everything to the system.  Benchmark::sceneLoading times loads of up to a million
+ * particles and four million springs from the text and from the cache.  On one core
+ * these take seconds, with the cache about twice as fast as the text, and most of
+ * the time goes to allocating the springs and filling the spring lists, so a load
+ * well under a second needs several cores and an allocator that scales with them.
+ * @author kry
+ */
+class SceneIO {
+public:
+
+    struct Parameters {
+        double gravity;
+        double viscousDamping;
+        double springStiffness;
+        double springDamping;
+        double restitution;
+        double breakingStrain;
+        int32_t solverIterations;
+        int32_t useGravity;
+        double bendingStiffness;
+        double bendingDamping;
+    };
+
+    struct ParticleRecord {
+        double x, y, vx, vy, mass;
+        float r, g, b;
+        int32_t pinned;
+    };
+
+    /** 
+     * Spring between particles i and j, with NaN for the stiffness and damping
+     * overrides and the rest length if not given 
+     */
+    struct SpringRecord {
+        int32_t i, j, material;
+        double k, c, l0;
+    };
+
+    /** Bending element on particles i0, i1, and i2, bending at i1 */
+    struct BendingRecord {
+        int32_t i0, i1, i2;
+    };
+
+    /** Stiffness and damping factors of a material */
+    struct MaterialRecord {
+        double k, c;
+    };
+
+    /**
+     * Loads a text or binary scene, replacing the current particles and springs.
+     * For a text scene with a cache directory, the cached binary copy is used if it
+     * was made from the same text, and written otherwise.  Failing to write the 
+     * cache is reported but does not fail the load.
+     * @param system
+     * @param filename
+     * @param cacheDirectory directory for binary copies of text scenes, or empty for no caching
+     * @return false if the scene could not be read
+     */
+    static bool load( ParticleSystem& system, const std::string& filename, const std::string& cacheDirectory = "" ) {
+        if ( isBinary( filename ) ) return loadBinary( system, filename );
+        if ( cacheDirectory.empty() ) return loadText( system, filename );
+        std::string text;
+        if ( !readFile( filename, text ) ) return false;
+        uint64_t source = hash( text );
+        std::string cache = cacheFile( filename, cacheDirectory );
+        if ( sourceOf( cache ) == source && loadBinary( system, cache ) ) return true;
+        if ( !parseText( system, text, filename ) ) return false;
+        std::error_code ec;
+        std::filesystem::create_directories( cacheDirectory, ec );
+        if ( ec ) {
+            std::cerr << "Could not create scene cache directory " << cacheDirectory << ": " << ec.message() << std::endl;
+        } else {
+            saveBinary( system, cache, source );
+        }
+        return true;
+    }
+
+    /**
+     * Loads a text scene, replacing the current particles and springs.
+     * @param system
+     * @param filename
+     * @return false if the file could not be read or has a malformed line
+     */
+    static bool loadText( ParticleSystem& system, const std::string& filename ) {
+        std::string text;
+        if ( !readFile( filename, text ) ) return false;
+        return parseText( system, text, filename );
+    }
+
+    /**
+     * Loads a scene from the contents of a text file, replacing the current particles and springs.
+     * @param system
+     * @param text
+     * @param filename for error messages
+     * @return false if the text has a malformed line
+     */
+    static bool parseText( ParticleSystem& system, const std::string& text, const std::string& filename ) {
+        // split at line ends into more chunks than threads for load balance
+        const int numChunks = 64;
+        std::vector<size_t> bounds( numChunks + 1, text.size() );
+        bounds[0] = 0;
+        for ( int c = 1; c < numChunks; c++ ) {
+            size_t b = std::max( bounds[c - 1], text.size() * c / numChunks );
+            while ( b < text.size() && b > 0 && text[b - 1] != '\n' ) b++;
+            bounds[c] = b;
+        }
+        std::vector<Chunk> chunks( numChunks );
+        Parameters defaults = getParameters( system );
+        #pragma omp parallel for schedule(dynamic)
+        for ( int c = 0; c < numChunks; c++ ) {
+            chunks[c].params = defaults;
+            parse( text.data() + bounds[c], text.data() + bounds[c + 1], chunks[c] );
+        }
+        Parameters params = defaults;
+        size_t np = 0;
+        size_t ns = 0;
+        size_t nm = 0;
+        size_t nb = 0;
+        for ( int c = 0; c < numChunks; c++ ) {
+            Chunk& chunk = chunks[c];
+            if ( chunk.error != NULL ) {
+                const char* data = text.data();
+                size_t line = 1 + std::count( data, chunk.error, '\n' );
+                const char* end = std::find( chunk.error, data + text.size(), '\n' );
+                std::cerr << filename << ":" << line << ": could not parse \"" << std::string( chunk.error, end ) << "\"" << std::endl;
+                return false;
+            }
+            // parameters given in a later chunk win, as if read in order
+            for ( int f = 0; f < NUM_FIELDS; f++ ) {
+                if ( chunk.set[f] ) setField( params, f, getField( chunk.params, f ) );
+            }
+            np += chunk.particles.size();
+            ns += chunk.springs.size();
+            nm += chunk.materials.size();
+            nb += chunk.bending.size();
+        }
+        std::vector<ParticleRecord> particles;
+        std::vector<SpringRecord> springs;
+        std::vector<MaterialRecord> materials;
+        std::vector<BendingRecord> bending;
+        particles.reserve( np );
+        springs.reserve( ns );
+        materials.reserve( nm );
+        bending.reserve( nb );
+        for ( Chunk& chunk : chunks ) {
+            particles.insert( particles.end(), chunk.particles.begin(), chunk.particles.end() );
+            springs.insert( springs.end(), chunk.springs.begin(), chunk.springs.end() );
+            materials.insert( materials.end(), chunk.materials.begin(), chunk.materials.end() );
+            bending.insert( bending.end(), chunk.bending.begin(), chunk.bending.end() );
+        }
+        return build( system, params, particles, springs, materials, bending, filename );
+    }
+
+    /**
+     * Loads a binary scene, replacing the current particles and springs.
+     * @param system
+     * @param filename
+     * @return false if the file could not be read
+     */
+    static bool loadBinary( ParticleSystem& system, const std::string& filename ) {
+        std::ifstream in( filename, std::ios::binary );
+        Header header;
+        if ( !in.read( (char*) &header, sizeof( header ) ) || std::memcmp( header.magic, MAGIC, 4 ) != 0 || header.version != VERSION ) {
+            std::cerr << "Not a binary scene file " << filename << std::endl;
+            return false;
+        }
+        std::vector<ParticleRecord> particles( header.particles );
+        std::vector<SpringRecord> springs( header.springs );
+        std::vector<MaterialRecord> materials( header.materials );
+        std::vector<BendingRecord> bending( header.bending );
+        if ( !in.read( (char*) materials.data(), materials.size() * sizeof( MaterialRecord ) ) ||
+             !in.read( (char*) particles.data(), particles.size() * sizeof( ParticleRecord ) ) ||
+             !in.read( (char*) springs.data(), springs.size() * sizeof( SpringRecord ) ) ||
+             !in.read( (char*) bending.data(), bending.size() * sizeof( BendingRecord ) ) ) {
+            std::cerr << "Truncated binary scene file " << filename << std::endl;
+            return false;
+        }
+        return build( system, header.params, particles, springs, materials, bending, filename );
+    }
+
+    /**
+     * Saves the current scene in the binary format.
+     * @param system
+     * @param filename
+     * @param source hash of the text scene this is a cached copy of, or zero
+     * @return false if the file could not be written
+     */
+    static bool saveBinary( ParticleSystem& system, const std::string& filename, uint64_t source = 0 ) {
+        std::vector<ParticleRecord> particles;
+        std::vector<SpringRecord> springs;
+        std::vector<MaterialRecord> materials;
+        std::vector<BendingRecord> bending;
+        getRecords( system, particles, springs, materials, bending );
+        Header header;
+        std::memcpy( header.magic, MAGIC, 4 );
+        header.version = VERSION;
+        header.particles = particles.size();
+        header.springs = springs.size();
+        header.materials = materials.size();
+        header.bending = bending.size();
+        header.params = getParameters( system );
+        header.source = source;
+        std::ofstream out( filename, std::ios::binary );
+        out.write( (const char*) &header, sizeof( header ) );
+        out.write( (const char*) materials.data(), materials.size() * sizeof( MaterialRecord ) );
+        out.write( (const char*) particles.data(), particles.size() * sizeof( ParticleRecord ) );
+        out.write( (const char*) springs.data(), springs.size() * sizeof( SpringRecord ) );
+        out.write( (const char*) bending.data(), bending.size() * sizeof( BendingRecord ) );
+        if ( !out ) {
+            std::cerr << "Could not write binary scene file " << filename << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Saves the current scene in the text format, using the initial positions and
+     * velocities of the particles.
+     * @param system
+     * @param filename
+     * @return false if the file could not be written
+     */
+    static bool saveText( ParticleSystem& system, const std::string& filename ) {
+        std::vector<ParticleRecord> particles;
+        std::vector<SpringRecord> springs;
+        std::vector<MaterialRecord> materials;
+        std::vector<BendingRecord> bending;
+        getRecords( system, particles, springs, materials, bending );
+        std::ofstream out( filename );
+        out.precision( 9 );
+        Parameters params = getParameters( system );
+        for ( int f = 0; f < NUM_FIELDS; f++ ) {
+            out << FIELD_NAMES[f] << " " << getField( params, f ) << "\n";
+        }
+        for ( const MaterialRecord& m : materials ) {
+            out << "material " << m.k << " " << m.c << "\n";
+        }
+        for ( const ParticleRecord& p : particles ) {
+            out << "p " << p.x << " " << p.y << " " << p.vx << " " << p.vy << " " << p.mass << " " << p.pinned
+                << " " << p.r << " " << p.g << " " << p.b << "\n";
+        }
+        for ( const SpringRecord& s : springs ) {
+            out << "s " << s.i << " " << s.j << " " << s.k << " " << s.c << " " << s.l0 << " " << s.material << "\n";
+        }
+        for ( const BendingRecord& b : bending ) {
+            out << "b " << b.i0 << " " << b.i1 << " " << b.i2 << "\n";
+        }
+        if ( !out ) {
+            std::cerr << "Could not write scene file " << filename << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+private:
+
+    static constexpr const char* MAGIC = "P559";
+    static const uint32_t VERSION = 5;
+
+    /** Binary header, followed by the material, particle, spring, and bending records */
+    struct Header {
+        char magic[4];
+        uint32_t version;
+        uint64_t particles;
+        uint64_t springs;
+        uint64_t materials;
+        uint64_t bending;
+        Parameters params;
+        /** Hash of the text scene this file is a cached copy of, or zero */
+        uint64_t source;
+    };
+
+    static const int NUM_FIELDS = 10;
+
+    /** Result of parsing one chunk of a text scene */
+    struct Chunk {
+        std::vector<ParticleRecord> particles;
+        std::vector<SpringRecord> springs;
+        std::vector<MaterialRecord> materials;
+        std::vector<BendingRecord> bending;
+        Parameters params;
+        bool set[NUM_FIELDS] = { false };
+        /** Start of the first malformed line, or NULL */
+        const char* error = NULL;
+    };
+
+    static constexpr const char* FIELD_NAMES[NUM_FIELDS] = { "gravity", "viscousDamping", "springStiffness",
+        "springDamping", "restitution", "breakingStrain", "solverIterations", "useGravity", "bendingStiffness", 
+        "bendingDamping" };
+
+    static double getField( const Parameters& p, int f ) {
+        switch ( f ) {
+        case 0: return p.gravity;
+        case 1: return p.viscousDamping;
+        case 2: return p.springStiffness;
+        case 3: return p.springDamping;
+        case 4: return p.restitution;
+        case 5: return p.breakingStrain;
+        case 6: return p.solverIterations;
+        case 7: return p.useGravity;
+        case 8: return p.bendingStiffness;
+        default: return p.bendingDamping;
+        }
+    }
+
+    static void setField( Parameters& p, int f, double v ) {
+        switch ( f ) {
+        case 0: p.gravity = v; break;
+        case 1: p.viscousDamping = v; break;
+        case 2: p.springStiffness = v; break;
+        case 3: p.springDamping = v; break;
+        case 4: p.restitution = v; break;
+        case 5: p.breakingStrain = v; break;
+        case 6: p.solverIterations = (int32_t) v; break;
+        case 7: p.useGravity = v != 0; break;
+        case 8: p.bendingStiffness = v; break;
+        default: p.bendingDamping = v;
+        }
+    }
+
+    static Parameters getParameters( ParticleSystem& system ) {
+        Parameters p;
+        p.gravity = system.gravity;
+        p.viscousDamping = system.viscousDamping;
+        p.springStiffness = system.springStiffness;
+        p.springDamping = system.springDamping;
+        p.restitution = system.restitution;
+        p.breakingStrain = system.breakingStrain;
+        p.solverIterations = system.solverIterations;
+        p.useGravity = system.useGravity;
+        p.bendingStiffness = system.bendingStiffness;
+        p.bendingDamping = system.bendingDamping;
+        return p;
+    }
+
+    static bool isBinary( const std::string& filename ) {
+        std::ifstream in( filename, std::ios::binary );
+        char magic[4];
+        return in.read( magic, 4 ) && std::memcmp( magic, MAGIC, 4 ) == 0;
+    }
+
+    /**
+     * @return the source hash in the header of a binary scene file, or zero if it 
+     * is missing or not a binary scene of this version
+     */
+    static uint64_t sourceOf( const std::string& filename ) {
+        std::ifstream in( filename, std::ios::binary );
+        Header header;
+        if ( !in.read( (char*) &header, sizeof( header ) ) || std::memcmp( header.magic, MAGIC, 4 ) != 0 || header.version != VERSION ) return 0;
+        return header.source;
+    }
+
+    /**
+     * Hashes the contents of a text scene eight bytes at a time, never returning zero
+     */
+    static uint64_t hash( const std::string& text ) {
+        const uint64_t prime = 0x100000001b3ULL;
+        uint64_t h = 0xcbf29ce484222325ULL ^ text.size();
+        size_t k = 0;
+        for ( ; k + 8 <= text.size(); k += 8 ) {
+            uint64_t w;
+            std::memcpy( &w, text.data() + k, 8 );
+            h = ( h ^ w ) * prime;
+            h ^= h >> 32;
+        }
+        for ( ; k < text.size(); k++ ) h = ( h ^ (unsigned char) text[k] ) * prime;
+        return h != 0 ? h : 1;
+    }
+
+    /**
+     * @return the name of the cached binary copy of a text scene, made from the 
+     * file name and a hash of its absolute path so that scenes with the same name 
+     * in different directories do not share a copy
+     */
+    static std::string cacheFile( const std::string& filename, const std::string& cacheDirectory ) {
+        std::error_code ec;
+        std::filesystem::path path = std::filesystem::absolute( filename, ec );
+        char tag[17];
+        std::snprintf( tag, sizeof( tag ), "%016llx", (unsigned long long) hash( path.string() ) );
+        return ( std::filesystem::path( cacheDirectory ) / ( path.filename().string() + "." + tag + ".bin" ) ).string();
+    }
+
+    static bool readFile( const std::string& filename, std::string& text ) {
+        std::ifstream in( filename, std::ios::binary | std::ios::ate );
+        if ( !in ) {
+            std::cerr << "Could not open scene file " << filename << std::endl;
+            return false;
+        }
+        text.resize( in.tellg() );
+        in.seekg( 0 );
+        in.read( &text[0], text.size() );
+        return true;
+    }
+
+    /**
+     * Reads the next number on the line, skipping spaces
+     * @return false at the end of the line, at a comment, or if the next word is not a number
+     */
+    template <typename T>
+    static bool number( const char*& s, const char* end, T& value ) {
+        while ( s < end && ( *s == ' ' || *s == '\t' || *s == '\r' ) ) s++;
+        if ( s == end || *s == '\n' || *s == '#' ) return false;
+        if ( *s == '+' ) s++;
+        std::from_chars_result r = std::from_chars( s, end, value );
+        if ( r.ec != std::errc() ) return false;
+        s = r.ptr;
+        return true;
+    }
+
+    /**
+     * @return true if only spaces or a comment remain on the line
+     */
+    static bool endOfLine( const char* s, const char* end ) {
+        while ( s < end && ( *s == ' ' || *s == '\t' || *s == '\r' ) ) s++;
+        return s == end || *s == '\n' || *s == '#';
+    }
+
+    /**
+     * Parses the lines from begin to end into the chunk, stopping at the first malformed line
+     */
+    static void parse( const char* begin, const char* end, Chunk& chunk ) {
+        const double NaN = std::nan( "" );
+        const char* line = begin;
+        while ( line < end ) {
+            const char* next = std::find( line, end, '\n' );
+            const char* s = line;
+            while ( s < next && ( *s == ' ' || *s == '\t' || *s == '\r' ) ) s++;
+            const char* word = s;
+            while ( s < next && *s != ' ' && *s != '\t' && *s != '\r' && *s != '#' ) s++;
+            size_t len = s - word;
+            bool ok = true;
+            if ( len == 0 ) {
+                ok = endOfLine( s, next );
+            } else if ( len == 1 && *word == 'p' ) {
+                ParticleRecord p = { 0, 0, 0, 0, 1, 0.0f, 0.95f, 0.0f, 0 };
+                ok = number( s, next, p.x ) && number( s, next, p.y );
+                if ( ok && number( s, next, p.vx ) ) {
+                    ok = number( s, next, p.vy );
+                    if ( ok && number( s, next, p.mass ) && number( s, next, p.pinned ) && number( s, next, p.r ) ) {
+                        ok = number( s, next, p.g ) && number( s, next, p.b );
+                    }
+                }
+                ok = ok && endOfLine( s, next ) && p.mass > 0;
+                chunk.particles.push_back( p );
+            } else if ( len == 1 && *word == 's' ) {
+                SpringRecord r = { 0, 0, 0, NaN, NaN, NaN };
+                ok = number( s, next, r.i ) && number( s, next, r.j );
+                if ( ok && number( s, next, r.k ) ) {
+                    ok = number( s, next, r.c );
+                    if ( ok && number( s, next, r.l0 ) ) number( s, next, r.material );
+                }
+                ok = ok && endOfLine( s, next );
+                chunk.springs.push_back( r );
+            } else if ( len == 8 && std::strncmp( word, "material", len ) == 0 ) {
+                MaterialRecord m;
+                ok = number( s, next, m.k ) && number( s, next, m.c ) && endOfLine( s, next );
+                chunk.materials.push_back( m );
+            } else if ( len == 1 && *word == 'b' ) {
+                BendingRecord b;
+                ok = number( s, next, b.i0 ) && number( s, next, b.i1 ) && number( s, next, b.i2 ) && endOfLine( s, next );
+                chunk.bending.push_back( b );
+            } else {
+                int f = 0;
+                while ( f < NUM_FIELDS && ( std::strlen( FIELD_NAMES[f] ) != len || std::strncmp( FIELD_NAMES[f], word, len ) != 0 ) ) f++;
+                double v;
+                ok = f < NUM_FIELDS && number( s, next, v ) && endOfLine( s, next );
+                if ( ok ) {
+                    setField( chunk.params, f, v );
+                    chunk.set[f] = true;
+                }
+            }
+            if ( !ok ) {
+                chunk.error = line;
+                return;
+            }
+            line = next + 1;
+        }
+    }
+
+    /**
+     * Replaces the particles and springs of the system with the given records
+     */
+    static bool build( ParticleSystem& system, const Parameters& params, const std::vector<ParticleRecord>& pr,
+        const std::vector<SpringRecord>& sr, const std::vector<MaterialRecord>& mr, const std::vector<BendingRecord>& br,
+        const std::string& filename ) {
+        int n = pr.size();
+        int nm = mr.size();
+        for ( const SpringRecord& r : sr ) {
+            if ( r.i < 0 || r.i >= n || r.j < 0 || r.j >= n || r.i == r.j ) {
+                std::cerr << filename << ": spring between particles " << r.i << " and " << r.j << " is not valid" << std::endl;
+                return false;
+            }
+            if ( r.material < 0 || r.material > nm ) {
+                std::cerr << filename << ": spring between particles " << r.i << " and " << r.j << " has undefined material " << r.material << std::endl;
+                return false;
+            }
+        }
+        for ( const BendingRecord& r : br ) {
+            int i[3] = { r.i0, r.i1, r.i2 };
+            bool ok = i[0] != i[1] && i[1] != i[2] && i[0] != i[2];
+            for ( int k = 0; k < 3; k++ ) ok = ok && i[k] >= 0 && i[k] < n;
+            if ( !ok ) {
+                std::cerr << filename << ": bending element on particles " << r.i0 << " " << r.i1 << " " << r.i2 << " is not valid" << std::endl;
+                return false;
+            }
+        }
+        system.clearParticles();
+        system.gravity = params.gravity;
+        system.viscousDamping = params.viscousDamping;
+        system.springStiffness = params.springStiffness;
+        system.springDamping = params.springDamping;
+        system.restitution = params.restitution;
+        system.breakingStrain = params.breakingStrain;
+        system.solverIterations = params.solverIterations;
+        system.useGravity = params.useGravity != 0;
+        system.bendingStiffness = params.bendingStiffness;
+        system.bendingDamping = params.bendingDamping;
+        system.materials.resize( 1 );
+        for ( const MaterialRecord& m : mr ) system.materials.push_back( ParticleSystem::SpringMaterial{ (float) m.k, (float) m.c } );
+        std::vector<Particle*> particles( n );
+        #pragma omp parallel for
+        for ( int i = 0; i < n; i++ ) {
+            const ParticleRecord& r = pr[i];
+            Particle* p = new Particle( r.x, r.y, r.vx, r.vy );
+            p->mass = r.mass;
+            p->pinned = r.pinned != 0;
+            p->color = glm::vec3( r.r, r.g, r.b );
+            particles[i] = p;
+        }
+        int ns = sr.size();
+        std::vector<Spring*> springs( ns );
+        #pragma omp parallel for
+        for ( int k = 0; k < ns; k++ ) {
+            const SpringRecord& r = sr[k];
+            Spring* s = new Spring( particles[r.i], particles[r.j], r.l0 );
+            if ( std::isnan( r.l0 ) ) s->recomputeRestLength();
+            s->material = r.material;
+            s->kOverride = r.k;
+            s->cOverride = r.c;
+            springs[k] = s;
+        }
+        // attach the springs to their particles in spring order, as the Spring constructor
+        // would, by first sorting the spring ends by particle so that each particle's list
+        // is filled at once by one thread instead of growing at random
+        std::vector<int> start( n + 1, 0 );
+        for ( const SpringRecord& r : sr ) {
+            start[r.i + 1]++;
+            start[r.j + 1]++;
+        }
+        for ( int i = 0; i < n; i++ ) start[i + 1] += start[i];
+        std::vector<int> next( start.begin(), start.end() - 1 );
+        std::vector<int> ends( 2 * (size_t) ns );
+        for ( int k = 0; k < ns; k++ ) {
+            ends[next[sr[k].i]++] = k;
+            ends[next[sr[k].j]++] = k;
+        }
+        #pragma omp parallel for
+        for ( int i = 0; i < n; i++ ) {
+            std::vector<Spring*>& list = particles[i]->springs;
+            list.reserve( start[i + 1] - start[i] );
+            for ( int e = start[i]; e < start[i + 1]; e++ ) list.push_back( springs[ends[e]] );
+        }
+        system.addAll( particles, springs );
+        system.bendingElements.reserve( br.size() );
+        for ( const BendingRecord& r : br ) {
+            system.createBendingElement( particles[r.i0], particles[r.i1], particles[r.i2] );
+        }
+        system.materialsChanged();
+        system.updateSpringParameters();
+        return true;
+    }
+
+    static void getRecords( ParticleSystem& system, std::vector<ParticleRecord>& pr, std::vector<SpringRecord>& sr,
+        std::vector<MaterialRecord>& mr, std::vector<BendingRecord>& br ) {
+        pr.resize( system.particles.size() );
+        sr.resize( system.springs.size() );
+        mr.clear();
+        for ( size_t m = 1; m < system.materials.size(); m++ ) {
+            mr.push_back( MaterialRecord{ system.materials[m].k, system.materials[m].c } );
+        }
+        for ( Particle* p : system.particles ) {
+            pr[p->index] = ParticleRecord{ p->p0.x, p->p0.y, p->v0.x, p->v0.y, p->mass, p->color.x, p->color.y, p->color.z, p->pinned ? 1 : 0 };
+        }
+        for ( size_t k = 0; k < system.springs.size(); k++ ) {
+            Spring* s = system.springs[k];
+            sr[k] = SpringRecord{ s->p1->index, s->p2->index, s->material, s->kOverride, s->cOverride, s->l0 };
+        }
+        br.clear();
+        for ( const BendingElement& e : system.bendingElements ) {
+            br.push_back( BendingRecord{ e.i0, e.i1, e.i2 } );
+        }
+    }
+};
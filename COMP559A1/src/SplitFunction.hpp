@@ -0,0 +1,52 @@
+#ifndef COMP599_SPLIT_FUNCTION
+#define COMP599_SPLIT_FUNCTION
+#include <vector>
+#include "Function.hpp"
+
+/**
+ * Interface for a function whose derivative can be split into a slow part,
+ * involving the whole state, and a fast part, involving only a few stiff
+ * particles, for multi-rate integration (see MultiRate).  The state has the
+ * same layout as the phase space, [x, y, vx, vy] for each particle.
+ * @param P precision policy, see Precision.hpp
+ * @author kry
+ */
+template <typename P>
+class SplitFunctionT : public FunctionT<P> {
+public:
+    typedef typename P::Scalar Scalar;
+    typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+
+    /**
+     * Splits the forces into fast and slow parts for the given step size, so that
+     * the slow part is stable at step h.
+     * @param h step size for the slow part
+     * @return number of substeps of the fast part to take for each step of h
+     */
+    virtual int partition( float h ) = 0;
+
+    /**
+     * @return indices of the particles moved by the fast part, as set by the last partition
+     */
+    virtual const std::vector<int>& fastParticles() = 0;
+
+    /**
+     * Evaluates the derivative due to the slow part of the forces
+     * @param t time
+     * @param p phase space state (don't modify)
+     * @param dpdt to be filled with the derivative, for all particles
+     */
+    virtual void slowDerivs( float t, Vector& p, Vector& dpdt ) = 0;
+
+    /**
+     * Evaluates the derivative due to the fast part of the forces, reading and
+     * writing only the entries of the fast particles
+     * @param t time
+     * @param p phase space state (don't modify)
+     * @param dpdt to be filled with the derivative, for the fast particles
+     */
+    virtual void fastDerivs( float t, Vector& p, Vector& dpdt ) = 0;
+};
+
+typedef SplitFunctionT<Precision> SplitFunction;
+#endif
@@ -1,39 +1,60 @@
+#pragma once
 #define GLM_FORCE_RADIANS
 #include <glm/glm.hpp>
 #include <glm/fwd.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+#include <cmath>
 #include <Eigen/Dense>
-using Eigen::MatrixXf;
-using Eigen::VectorXf;
 
+#include "Precision.hpp"
 #include "Particle.hpp"
+#include "BlockSparseMatrix.hpp"
 
 /**
  * Spring class for 599 assignment 1
+ * @param P precision policy, see Precision.hpp
  * @author kry
  */
-class Spring {
+template <typename P>
+class SpringT {
 
 public:
+    typedef typename P::Scalar Scalar;
+    typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+    typedef ParticleT<P> Particle;
+    typedef typename Particle::Vec2 Vec2;
 
     Particle* p1;
     Particle* p2;
 
-    /** Spring stiffness, sometimes written k_s in equations */
-    float k = 1;
+    /** 
+     * Spring stiffness, sometimes written k_s in equations.  This is set from the 
+     * material by ParticleSystem::updateSpringParameters and not written per step. 
+     */
+    Scalar k = 1;
     /** Spring damping (along spring direction), sometimes written k_d in equations */
-    float c = 1;
+    Scalar c = 1;
+    /** Index of this spring's material class in ParticleSystem::materials */
+    int material = 0;
+    /** 
+     * Stiffness and damping given for this spring alone, such as in a scene file,
+     * used instead of those of the material when not NaN
+     */
+    Scalar kOverride = std::nan( "" );
+    Scalar cOverride = std::nan( "" );
     /** Rest length of this spring */
-    double l0 = 0;
+    Scalar l0 = 0;
+    /** Set when the spring exceeds the breaking strain, and while it waits in a removal batch */
+    bool broken = false;
 
     /**
      * Creates a spring between two particles
      * @param p1
      * @param p2
      */
-    Spring(Particle* p1, Particle* p2) {
+    SpringT(Particle* p1, Particle* p2) {
         this->p1 = p1;
         this->p2 = p2;
         recomputeRestLength();
@@ -41,52 +62,253 @@ public:
         p2->springs.push_back(this);
     }
 
+    /**
+     * Creates a spring with the given rest length without adding it to the spring
+     * lists of the particles, for bulk loads that build those lists afterwards
+     * @param p1
+     * @param p2
+     * @param l0
+     */
+    SpringT(Particle* p1, Particle* p2, Scalar l0) : p1(p1), p2(p2), l0(l0) {
+    }
+
     /**
      * Computes and sets the rest length based on the original position of the two particles
      */
     void recomputeRestLength() {
-        glm::vec2 diff = p1->p0 - p2->p0;
+        Vec2 diff = p1->p0 - p2->p0;
         l0 = sqrt(diff.x * diff.x + diff.y * diff.y);
     }
 
     /**
      * Applies the spring force by adding a force to each particle
+     * @return the current length
+     */
+    Scalar apply() {
+        Vec2 d = p2->p - p1->p;
+        Scalar l = sqrt(d.x * d.x + d.y * d.y);
+        if ( l == 0 ) return l;
+        Vec2 n = d / l;
+        Vec2 dv = p2->v - p1->v;
+        Scalar fs = k * (l - l0) + c * (dv.x * n.x + dv.y * n.y);
+        p1->addForce( n * fs );
+        p2->addForce( n * -fs );
+        return l;
+    }
+
+    /**
+     * Computes the force from positions and velocities stored in split arrays
+     * (x and y interleaved per particle, indexed by Particle::index) and adds it
+     * to the force array.  This is the same force as apply(), but used by the 
+     * fused stepping code which does not touch the Particle objects.
+     * @param x positions
+     * @param xd velocities
+     * @param f forces
      */
-    void apply() {
-        // TODO: Objective 1, FINISH THIS CODE!
+    void addForce(const Vector& x, const Vector& xd, Vector& f) {
+        addForce( p1->index, p2->index, x, xd, f );
+    }
 
-   
+    /**
+     * Same as above, but with the particle indices of the two ends provided by
+     * the caller so that the particles themselves need not be read.
+     * @param a index of p1
+     * @param b index of p2
+     * @param x positions
+     * @param xd velocities
+     * @param f forces
+     * @return the current length, for checking the breaking strain
+     */
+    inline Scalar addForce(int a, int b, const Vector& x, const Vector& xd, Vector& f) {
+        int i = a * 2;
+        int j = b * 2;
+        Scalar dx = x[j] - x[i];
+        Scalar dy = x[j + 1] - x[i + 1];
+        Scalar l = sqrt(dx * dx + dy * dy);
+        if ( l == 0 ) return l;
+        Scalar nx = dx / l;
+        Scalar ny = dy / l;
+        Scalar fs = k * (l - l0) + c * ((xd[j] - xd[i]) * nx + (xd[j + 1] - xd[i + 1]) * ny);
+        f[i] += fs * nx;
+        f[i + 1] += fs * ny;
+        f[j] -= fs * nx;
+        f[j + 1] -= fs * ny;
+        return l;
+    }
+
+    /**
+     * Same as above, but adds the force to only one end, for the domain decomposed
+     * force pass where the springs crossing a domain boundary are computed by both
+     * domains, each for its own particle.
+     * @param a index of p1
+     * @param b index of p2
+     * @param x positions
+     * @param xd velocities
+     * @param f forces
+     * @param first true to add the force to p1, false for p2
+     * @return the current length
+     */
+    inline Scalar addForceToEnd(int a, int b, const Vector& x, const Vector& xd, Vector& f, bool first) {
+        int i = a * 2;
+        int j = b * 2;
+        Scalar dx = x[j] - x[i];
+        Scalar dy = x[j + 1] - x[i + 1];
+        Scalar l = sqrt(dx * dx + dy * dy);
+        if ( l == 0 ) return l;
+        Scalar nx = dx / l;
+        Scalar ny = dy / l;
+        Scalar fs = k * (l - l0) + c * ((xd[j] - xd[i]) * nx + (xd[j + 1] - xd[i + 1]) * ny);
+        if ( first ) {
+            f[i] += fs * nx;
+            f[i + 1] += fs * ny;
+        } else {
+            f[j] -= fs * nx;
+            f[j + 1] -= fs * ny;
+        }
+        return l;
+    }
 
+    /**
+     * Computes the force on p1 without adding it anywhere, for the backend force pass
+     * which gathers the forces of each particle's springs afterwards.  The force on
+     * p2 is the negative.
+     * @param a index of p1
+     * @param b index of p2
+     * @param x positions
+     * @param xd velocities
+     * @param force set to the force on p1, zero for a zero length spring
+     * @return the current length
+     */
+    inline Scalar computeForce(int a, int b, const Vector& x, const Vector& xd, Scalar* force) const {
+        int i = a * 2;
+        int j = b * 2;
+        Scalar dx = x[j] - x[i];
+        Scalar dy = x[j + 1] - x[i + 1];
+        Scalar l = sqrt(dx * dx + dy * dy);
+        if ( l == 0 ) {
+            force[0] = force[1] = 0;
+            return l;
+        }
+        Scalar nx = dx / l;
+        Scalar ny = dy / l;
+        Scalar fs = k * (l - l0) + c * ((xd[j] - xd[i]) * nx + (xd[j + 1] - xd[i + 1]) * ny);
+        force[0] = fs * nx;
+        force[1] = fs * ny;
+        return l;
     }
 
-    /** TODO: the functions below are for the backwards Euler solver */
+    /** The functions below are for the implicit solvers */
 
     /**
      * Computes the force and adds it to the appropriate components of the force vector.
-     * (This function is something you might use for a backward Euler integrator)
+     * Uses the current particle positions and velocities.
      * @param f
      */
-    void addForce(VectorXf& f) {
-        // TODO: Objective 8, FINISH THIS CODE for backward Euler method (probably very simlar to what you did above)
-
+    void addForce(Vector& f) {
+        Vec2 d = p2->p - p1->p;
+        Scalar l = sqrt(d.x * d.x + d.y * d.y);
+        if ( l == 0 ) return;
+        Vec2 n = d / l;
+        Vec2 dv = p2->v - p1->v;
+        Scalar fs = k * (l - l0) + c * (dv.x * n.x + dv.y * n.y);
+        int i = p1->index * 2;
+        int j = p2->index * 2;
+        f[i] += fs * n.x;
+        f[i + 1] += fs * n.y;
+        f[j] -= fs * n.x;
+        f[j + 1] -= fs * n.y;
     }
 
     /**
-     * Adds this springs contribution to the stiffness matrix
+     * Adds this springs contribution to the stiffness matrix.  The transverse term
+     * (1 - l0/l) is clamped at zero for compressed springs so that the matrix stays
+     * negative semi-definite and the implicit system stays positive definite.
+     * @param x positions
      * @param dfdx
      */
-    void addDfdx(MatrixXf& dfdx) {
-        // TODO: Objective 8, FINISH THIS CODE... necessary for backward euler integration
-
+    void addDfdx(const Vector& x, BlockSparseMatrixT<Scalar>& dfdx) {
+        Scalar K[4];
+        if ( stiffnessBlock( p1->index, p2->index, x, K ) ) addBlocks( dfdx, p1->index, p2->index, K );
     }
 
     /**
      * Adds this springs damping contribution to the implicit damping matrix
+     * @param x positions
      * @param dfdv
      */
-    void addDfdv(MatrixXf& dfdv) {
-        // TODO: Objective 8, FINISH THIS CODE... necessary for backward Euler integration
+    void addDfdv(const Vector& x, BlockSparseMatrixT<Scalar>& dfdv) {
+        Scalar D[4];
+        if ( dampingBlock( p1->index, p2->index, x, D ) ) addBlocks( dfdv, p1->index, p2->index, D );
+    }
+
+    /**
+     * Computes the block K = k ( nn^T + t (I - nn^T) ) in row major order, with 
+     * t = max( 0, 1 - l0/l ), so that df1/dx1 = -K and df1/dx2 = K.  This is the 
+     * contribution addDfdx adds, for the matrix free products which do not assemble dfdx.
+     * @param a index of p1
+     * @param b index of p2
+     * @param x positions
+     * @param K set to the block, zero for a zero length spring
+     * @return false for a zero length spring
+     */
+    inline bool stiffnessBlock(int a, int b, const Vector& x, Scalar* K) const {
+        Scalar dx = x[2 * b] - x[2 * a];
+        Scalar dy = x[2 * b + 1] - x[2 * a + 1];
+        Scalar l = sqrt(dx * dx + dy * dy);
+        if ( l == 0 ) {
+            K[0] = K[1] = K[2] = K[3] = 0;
+            return false;
+        }
+        Scalar nx = dx / l;
+        Scalar ny = dy / l;
+        Scalar t = std::max( Scalar( 0 ), 1 - l0 / l );
+        K[0] = k * ( nx * nx + t * ( 1 - nx * nx ) );
+        K[1] = K[2] = k * ( nx * ny - t * nx * ny );
+        K[3] = k * ( ny * ny + t * ( 1 - ny * ny ) );
+        return true;
+    }
 
+    /**
+     * Computes the damping block D = c nn^T, so that df1/dv1 = -D and df1/dv2 = D
+     * @param a index of p1
+     * @param b index of p2
+     * @param x positions
+     * @param D set to the block, zero for a zero length spring
+     * @return false for a zero length spring
+     */
+    inline bool dampingBlock(int a, int b, const Vector& x, Scalar* D) const {
+        Scalar dx = x[2 * b] - x[2 * a];
+        Scalar dy = x[2 * b + 1] - x[2 * a + 1];
+        Scalar l = sqrt(dx * dx + dy * dy);
+        if ( l == 0 ) {
+            D[0] = D[1] = D[2] = D[3] = 0;
+            return false;
+        }
+        Scalar nx = dx / l;
+        Scalar ny = dy / l;
+        D[0] = c * nx * nx;
+        D[1] = D[2] = c * nx * ny;
+        D[3] = c * ny * ny;
+        return true;
     }
 
-};
\ No newline at end of file
+private:
+    /**
+     * Adds -B to the diagonal blocks and B to the off diagonal blocks of the two particles
+     */
+    static void addBlocks( BlockSparseMatrixT<Scalar>& M, int a, int b, const Scalar* B ) {
+        Scalar* aa = M.block( a, a ).m;
+        Scalar* ab = M.block( a, b ).m;
+        Scalar* ba = M.block( b, a ).m;
+        Scalar* bb = M.block( b, b ).m;
+        for ( int i = 0; i < 4; i++ ) {
+            aa[i] -= B[i];
+            ab[i] += B[i];
+            ba[i] += B[i];
+            bb[i] -= B[i];
+        }
+    }
+
+};
+
+typedef SpringT<Precision> Spring;
\ No newline at end of file
@@ -0,0 +1,118 @@
+#pragma once
+#include <algorithm>
+#include <utility>
+#include <Eigen/Dense>
+
+#include "Backend.hpp"
+
+/**
+ * Fused linear combinations of phase space vectors for the explicit integrators.
+ * Each stage of a Runge-Kutta method computes p + h ( a1 k1 + ... + aK kK ), which
+ * done as separate vector expressions makes one pass over memory per term.  Here
+ * all the terms are combined in a single pass, built as one Eigen expression so
+ * that it is vectorized, and large states are split into chunks processed in
+ * parallel, with the particle system's backend when it has one.  The entries are 
+ * independent, so the result does not depend on the backend or the number of threads.
+ *
+ * The final update of a step can also be made with the addition of a precision policy,
+ * which for the compensated policy carries the rounding error of each entry between
+ * steps in an array kept by the integrator, as SymplecticEuler does.
+ * @author kry
+ */
+class StateUpdate {
+public:
+    /** Number of entries per chunk */
+    static const int grain = 4096;
+
+    /** Number of entries below which one thread is faster than starting a parallel loop */
+    static const int parallelSize = 1 << 17;
+
+    /**
+     * Computes out = p + sum over j of a[j] k[j], entry by entry in one pass.  The
+     * output may be the same array as p or one of the k.
+     * @param n number of entries
+     * @param out
+     * @param p
+     * @param a coefficients, with the step size already multiplied in
+     * @param k derivative arrays
+     * @param backend runs the chunks, or NULL for the built in parallel loop
+     */
+    template <int K, typename Scalar>
+    static void combine( int n, Scalar* out, const Scalar* p, const Scalar ( &a )[K], const Scalar* const ( &k )[K], Backend* backend = NULL ) {
+        forChunks( n, backend, [&]( int begin, int length ) {
+            combineChunk( begin, length, out, p, a, k, std::make_integer_sequence<int, K>() );
+        } );
+    }
+
+    /**
+     * Same as above, but adds the sum of the terms to p with the addition of the 
+     * precision policy P, for the final update of a step.  For the compensated policy
+     * error holds the rounding error of each entry, carried between steps, and for the
+     * others this is the plain combination and error is not used.
+     * @param P precision policy, see Precision.hpp
+     * @param n number of entries
+     * @param out
+     * @param p
+     * @param a coefficients, with the step size already multiplied in
+     * @param k derivative arrays
+     * @param error rounding error of each entry, kept by the integrator
+     * @param backend runs the chunks, or NULL for the built in parallel loop
+     */
+    template <typename P, int K, typename Scalar>
+    static void combine( int n, Scalar* out, const Scalar* p, const Scalar ( &a )[K], const Scalar* const ( &k )[K], Scalar* error, 
+            Backend* backend = NULL ) {
+        if ( !P::compensated ) {
+            combine( n, out, p, a, k, backend );
+            return;
+        }
+        forChunks( n, backend, [&]( int begin, int length ) {
+            compensatedChunk<P>( begin, length, out, p, a, k, error, std::make_integer_sequence<int, K>() );
+        } );
+    }
+
+private:
+    /**
+     * Calls body( begin, length ) for the chunks of n entries, with the backend or
+     * the built in parallel loop
+     */
+    template <typename F>
+    static void forChunks( int n, Backend* backend, const F& body ) {
+        if ( backend != NULL ) {
+            backend->parallelFor( n, [&]( int begin, int end ) { body( begin, end - begin ); } );
+            return;
+        }
+        int chunks = ( n + grain - 1 ) / grain;
+        #pragma omp parallel for schedule(static) if(n >= parallelSize)
+        for ( int c = 0; c < chunks; c++ ) {
+            int begin = c * grain;
+            body( begin, std::min( n, begin + grain ) - begin );
+        }
+    }
+
+    /**
+     * Combines one chunk as a single Eigen expression, which Eigen evaluates in one
+     * vectorized loop.  The expression is coefficient wise, so the output may alias
+     * the inputs.
+     */
+    template <int K, typename Scalar, int... J>
+    static inline void combineChunk( int begin, int length, Scalar* out, const Scalar* p, const Scalar ( &a )[K], 
+            const Scalar* const ( &k )[K], std::integer_sequence<int, J...> ) {
+        typedef Eigen::Matrix<Scalar, Eigen::Dynamic, 1> Vector;
+        typedef Eigen::Map<const Vector> ConstMap;
+        Eigen::Map<Vector>( out + begin, length ) = ( ConstMap( p + begin, length ) + ... + ( a[J] * ConstMap( k[J] + begin, length ) ) );
+    }
+
+    /**
+     * Combines one chunk entry by entry, summing the terms of each entry and adding
+     * the sum to p with the policy's compensated addition
+     */
+    template <typename P, int K, typename Scalar, int... J>
+    static inline void compensatedChunk( int begin, int length, Scalar* out, const Scalar* p, const Scalar ( &a )[K], 
+            const Scalar* const ( &k )[K], Scalar* error, std::integer_sequence<int, J...> ) {
+        for ( int i = begin; i < begin + length; i++ ) {
+            Scalar x = p[i];
+            P::add( x, ( ... + ( a[J] * k[J][i] ) ), error[i] );
+            out[i] = x;
+        }
+    }
+};
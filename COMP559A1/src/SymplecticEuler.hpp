@@ -1,3 +1,4 @@
+#pragma once
 #include <string>
 #include "Integrator.hpp"
 
@@ -8,12 +9,52 @@ public:
         return "symplectic Euler";
     }
 
-    void step(VectorXf &p, int n, float t, float h, VectorXf &pout, Function* derivs) {
-        // TODO: Objective 7, complete the symplectic Euler integration method.
-        // note you'll need to know how p is packed to properly implement this, so go
-        // look at ParticleSystem.getPhaseSpace()
-   
-       
+    VectorXr dpdt;
+    /** Rounding error carried between steps by the compensated precision policy */
+    VectorXr error;
+
+    /**
+     * Generic symplectic Euler step on the interleaved [x, y, vx, vy] phase space.
+     * ParticleSystem has a fused version of this that works on split arrays, see
+     * ParticleSystem::stepSymplecticEuler.
+     */
+    void step(VectorXr &p, int n, float t, float h, VectorXr &pout, Function* derivs) {
+        if ( dpdt.size() != n ) {
+            dpdt.resize( n );
+            error.setZero( n );
+        }
+        derivs->derivs( t, p, dpdt );
+        pout = p;
+        for ( int i = 0; i < n; i += 4 ) {
+            Precision::add( pout[i + 2], h * dpdt[i + 2], error[i + 2] );
+            Precision::add( pout[i + 3], h * dpdt[i + 3], error[i + 3] );
+            Precision::add( pout[i], h * pout[i + 2], error[i] );
+            Precision::add( pout[i + 1], h * pout[i + 3], error[i + 1] );
+        }
+    }
+
+    /**
+     * Fused symplectic Euler update of split position and velocity arrays, 
+     * v += h w f then x += h v, in one streaming pass.
+     * @param P precision policy, see Precision.hpp
+     * @param n number of particles
+     * @param h step size
+     * @param x positions, two per particle
+     * @param v velocities
+     * @param f forces
+     * @param w inverse masses, one per particle
+     * @param ex position rounding error, only used by compensated policies
+     * @param ev velocity rounding error, only used by compensated policies
+     */
+    template <typename P, typename Scalar = typename P::Scalar>
+    static void update( int n, Scalar h, Scalar* x, Scalar* v, const Scalar* f, const Scalar* w, Scalar* ex, Scalar* ev ) {
+        for ( int i = 0; i < n; i++ ) {
+            Scalar hw = h * w[i];
+            P::add( v[2 * i], hw * f[2 * i], ev[2 * i] );
+            P::add( v[2 * i + 1], hw * f[2 * i + 1], ev[2 * i + 1] );
+            P::add( x[2 * i], h * v[2 * i], ex[2 * i] );
+            P::add( x[2 * i + 1], h * v[2 * i + 1], ex[2 * i + 1] );
+        }
     }
 
 };
\ No newline at end of file
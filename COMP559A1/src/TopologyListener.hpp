@@ -0,0 +1,46 @@
+#pragma once
+
+#include "Particle.hpp"
+#include "Spring.hpp"
+
+/**
+ * Interface for objects that keep topology dependent data (sparsity patterns,
+ * graph colorings, factorizations) and want to update it incrementally as 
+ * particles and springs are added to or removed from a particle system.
+ * @author kry
+ */
+class TopologyListener {
+public:
+    /**
+     * Called after a particle is added, its index is the last index
+     * @param p
+     */
+    virtual void particleAdded( Particle* p ) = 0;
+
+    /**
+     * Called after a particle is removed.  Particles are removed by moving the last
+     * particle into the freed slot, so the particle that had index last now has 
+     * the given index (unless index == last).  All springs of the removed particle 
+     * are removed (and reported) before this is called.
+     * @param index
+     * @param last
+     */
+    virtual void particleRemoved( int index, int last ) = 0;
+
+    /**
+     * Called after a spring is added
+     * @param s
+     */
+    virtual void springAdded( Spring* s ) = 0;
+
+    /**
+     * Called before a spring is removed and deleted
+     * @param s
+     */
+    virtual void springRemoved( Spring* s ) = 0;
+
+    /**
+     * Called after all particles and springs are deleted
+     */
+    virtual void topologyCleared() = 0;
+};
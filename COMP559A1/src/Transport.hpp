@@ -0,0 +1,336 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <iostream>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#endif
+
+/**
+ * Point to point message passing between the ranks of a distributed simulation,
+ * in the style of MPI but with only what DistributedSystem needs.  Messages
+ * between each pair of ranks arrive in the order they were sent, and receives
+ * block until the message arrives.  Implementations can move the bytes any way
+ * they like, see ThreadTransport and SocketTransport.  A message of the wrong size
+ * or a failed connection means the ranks no longer agree on the state of the 
+ * simulation, so it aborts the process rather than continue with garbage.
+ * @author kry
+ */
+class Transport {
+public:
+    virtual ~Transport() {}
+
+    /** @return this rank, from 0 to size - 1 */
+    virtual int rank() = 0;
+
+    /** @return number of ranks */
+    virtual int size() = 0;
+
+    /**
+     * Sends a message, which may return before it is received
+     * @param to destination rank
+     * @param data
+     * @param bytes
+     */
+    virtual void send( int to, const void* data, size_t bytes ) = 0;
+
+    /**
+     * Receives the next message from a rank, which must have the given size, and
+     * aborts otherwise, see fail
+     * @param from source rank
+     * @param data
+     * @param bytes
+     */
+    virtual void receive( int from, void* data, size_t bytes ) = 0;
+
+    /** Bytes sent by this rank, for the benchmarks */
+    size_t bytesSent = 0;
+
+    /**
+     * Sums values over all ranks.  Rank 0 adds the contributions in rank order
+     * and sends the result back, so every rank gets the same sums.
+     * @param values replaced by the sums
+     * @param count
+     */
+    void allReduceSum( double* values, int count ) {
+        if ( size() == 1 ) return;
+        size_t bytes = count * sizeof( double );
+        if ( rank() == 0 ) {
+            std::vector<double> other( count );
+            for ( int r = 1; r < size(); r++ ) {
+                receive( r, other.data(), bytes );
+                for ( int k = 0; k < count; k++ ) values[k] += other[k];
+            }
+            for ( int r = 1; r < size(); r++ ) send( r, values, bytes );
+        } else {
+            send( 0, values, bytes );
+            receive( 0, values, bytes );
+        }
+    }
+
+    /**
+     * @param value
+     * @return the sum of the value over all ranks
+     */
+    double allReduceSum( double value ) {
+        allReduceSum( &value, 1 );
+        return value;
+    }
+
+    /**
+     * Waits until all ranks get here
+     */
+    void barrier() {
+        allReduceSum( 0.0 );
+    }
+
+protected:
+    /**
+     * Reports a transport error and aborts the process.  Ranks that are threads 
+     * cannot be stopped one at a time, and ranks that are processes find their
+     * connections closed and abort in turn, so the launcher sees the failure.
+     * @param message
+     */
+    static void fail( const std::string& message ) {
+        std::cerr << message << std::endl;
+        std::abort();
+    }
+};
+
+/**
+ * Transport between ranks that are threads of one process, through shared
+ * memory mailboxes.  Sends never block.
+ */
+class ThreadTransport : public Transport {
+public:
+    /** Mailboxes for every ordered pair of ranks of a group */
+    class Group {
+    public:
+        struct Mailbox {
+            std::mutex mutex;
+            std::condition_variable arrived;
+            std::deque<std::vector<char>> messages;
+        };
+
+        int size;
+        std::vector<Mailbox> boxes;
+
+        Group( int size ) : size( size ), boxes( size * size ) {}
+    };
+
+    ThreadTransport( Group& group, int rank ) : group( group ), me( rank ) {}
+
+    int rank() { return me; }
+
+    int size() { return group.size; }
+
+    void send( int to, const void* data, size_t bytes ) {
+        Group::Mailbox& box = group.boxes[me * group.size + to];
+        const char* c = (const char*) data;
+        {
+            std::lock_guard<std::mutex> lock( box.mutex );
+            box.messages.emplace_back( c, c + bytes );
+        }
+        box.arrived.notify_one();
+        bytesSent += bytes;
+    }
+
+    void receive( int from, void* data, size_t bytes ) {
+        Group::Mailbox& box = group.boxes[from * group.size + me];
+        std::unique_lock<std::mutex> lock( box.mutex );
+        box.arrived.wait( lock, [&]() { return !box.messages.empty(); } );
+        std::vector<char>& m = box.messages.front();
+        if ( m.size() != bytes ) {
+            fail( "ThreadTransport: rank " + std::to_string( me ) + " expected " + std::to_string( bytes ) 
+                + " bytes from rank " + std::to_string( from ) + ", got " + std::to_string( m.size() ) );
+        }
+        std::memcpy( data, m.data(), bytes );
+        box.messages.pop_front();
+    }
+
+    /**
+     * Runs a function on the given number of ranks, each in its own thread, and
+     * waits for them all to finish
+     * @param size number of ranks
+     * @param f called with the transport of each rank
+     */
+    static void run( int size, const std::function<void( Transport& )>& f ) {
+        Group group( size );
+        std::vector<std::thread> threads;
+        for ( int r = 1; r < size; r++ ) {
+            threads.emplace_back( [&group, &f, r]() {
+                ThreadTransport t( group, r );
+                f( t );
+            } );
+        }
+        ThreadTransport t( group, 0 );
+        f( t );
+        for ( std::thread& thread : threads ) thread.join();
+    }
+
+private:
+    Group& group;
+    int me;
+};
+
+#ifndef _WIN32
+/**
+ * Transport between ranks that are separate processes, over TCP connections
+ * on the loopback interface, one for each pair of ranks.  See launch.
+ */
+class SocketTransport : public Transport {
+public:
+    SocketTransport( int rank, const std::vector<int>& sockets ) : me( rank ), sockets( sockets ) {}
+
+    ~SocketTransport() {
+        for ( int s : sockets ) {
+            if ( s >= 0 ) close( s );
+        }
+    }
+
+    int rank() { return me; }
+
+    int size() { return sockets.size(); }
+
+    /**
+     * Sends the size of the message followed by its bytes, so that the receiver can 
+     * check it
+     */
+    void send( int to, const void* data, size_t bytes ) {
+        uint64_t size = bytes;
+        writeAll( to, &size, sizeof( size ) );
+        writeAll( to, data, bytes );
+    }
+
+    void receive( int from, void* data, size_t bytes ) {
+        uint64_t size = 0;
+        readAll( from, &size, sizeof( size ) );
+        if ( size != bytes ) {
+            fail( "SocketTransport: rank " + std::to_string( me ) + " expected " + std::to_string( bytes ) 
+                + " bytes from rank " + std::to_string( from ) + ", got " + std::to_string( size ) );
+        }
+        readAll( from, data, bytes );
+    }
+
+    /**
+     * Runs a function on the given number of ranks, rank 0 in this process and
+     * the others in forked child processes, connected over the loopback interface.
+     * The listening sockets are all opened before forking, so every rank can
+     * connect to the lower ranks and accept the higher ones without waiting.
+     * @param size number of ranks
+     * @param f called with the transport of each rank
+     * @return false if the listening sockets could not be set up or a child process 
+     * failed, while transport errors during the run abort, see fail
+     */
+    static bool launch( int size, const std::function<void( Transport& )>& f ) {
+        std::vector<int> listeners( size, -1 );
+        std::vector<sockaddr_in> addresses( size );
+        for ( int r = 0; r < size; r++ ) {
+            listeners[r] = socket( AF_INET, SOCK_STREAM, 0 );
+            sockaddr_in& a = addresses[r];
+            std::memset( &a, 0, sizeof( a ) );
+            a.sin_family = AF_INET;
+            a.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+            a.sin_port = 0;
+            socklen_t length = sizeof( a );
+            if ( listeners[r] < 0 || bind( listeners[r], (sockaddr*) &a, sizeof( a ) ) != 0
+                || listen( listeners[r], size ) != 0 || getsockname( listeners[r], (sockaddr*) &a, &length ) != 0 ) {
+                std::cerr << "SocketTransport: could not listen on the loopback interface" << std::endl;
+                for ( int l : listeners ) {
+                    if ( l >= 0 ) close( l );
+                }
+                return false;
+            }
+        }
+        std::vector<pid_t> children;
+        int me = 0;
+        for ( int r = 1; r < size; r++ ) {
+            pid_t pid = fork();
+            if ( pid == 0 ) {
+                me = r;
+                children.clear();
+                break;
+            }
+            children.push_back( pid );
+        }
+        std::vector<int> sockets( size, -1 );
+        for ( int r = 0; r < me; r++ ) {
+            int s = socket( AF_INET, SOCK_STREAM, 0 );
+            if ( connect( s, (sockaddr*) &addresses[r], sizeof( addresses[r] ) ) != 0 ) {
+                std::cerr << "SocketTransport: rank " << me << " could not connect to rank " << r << std::endl;
+            }
+            ssize_t n = write( s, &me, sizeof( me ) );
+            (void) n;
+            sockets[r] = s;
+        }
+        for ( int k = me + 1; k < size; k++ ) {
+            int s = accept( listeners[me], NULL, NULL );
+            int r = -1;
+            if ( s < 0 || read( s, &r, sizeof( r ) ) != sizeof( r ) || r <= me || r >= size ) {
+                std::cerr << "SocketTransport: rank " << me << " could not accept a connection" << std::endl;
+                continue;
+            }
+            sockets[r] = s;
+        }
+        for ( int l : listeners ) close( l );
+        for ( int s : sockets ) {
+            int one = 1;
+            if ( s >= 0 ) setsockopt( s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof( one ) );
+        }
+        {
+            SocketTransport t( me, sockets );
+            f( t );
+        }
+        if ( me != 0 ) {
+            std::cout.flush();
+            _exit( 0 );
+        }
+        bool ok = true;
+        for ( pid_t pid : children ) {
+            int status = 0;
+            waitpid( pid, &status, 0 );
+            ok &= WIFEXITED( status ) && WEXITSTATUS( status ) == 0;
+        }
+        return ok;
+    }
+
+private:
+    int me;
+    std::vector<int> sockets;
+
+    void writeAll( int to, const void* data, size_t bytes ) {
+        const char* c = (const char*) data;
+        while ( bytes > 0 ) {
+            ssize_t n = sockets[to] >= 0 ? write( sockets[to], c, bytes ) : -1;
+            if ( n <= 0 ) fail( "SocketTransport: rank " + std::to_string( me ) + " could not send to rank " + std::to_string( to ) );
+            c += n;
+            bytes -= n;
+            bytesSent += n;
+        }
+    }
+
+    void readAll( int from, void* data, size_t bytes ) {
+        char* c = (char*) data;
+        while ( bytes > 0 ) {
+            ssize_t n = sockets[from] >= 0 ? read( sockets[from], c, bytes ) : -1;
+            if ( n <= 0 ) fail( "SocketTransport: rank " + std::to_string( me ) + " could not receive from rank " + std::to_string( from ) );
+            c += n;
+            bytes -= n;
+        }
+    }
+};
+#endif
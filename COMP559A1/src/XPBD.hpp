@@ -0,0 +1,257 @@
+#pragma once
+#include <vector>
+#include <unordered_map>
+
+#include "Precision.hpp"
+
+#include "Particle.hpp"
+#include "Spring.hpp"
+#include "Bending.hpp"
+#include "TopologyListener.hpp"
+
+/**
+ * Extended position based dynamics (XPBD) solver that treats each spring as a
+ * compliant distance constraint with compliance 1/k.  Springs are graph colored
+ * so that no two springs of the same color share a particle, which lets each
+ * color be projected in parallel within a Gauss-Seidel sweep.  The coloring is
+ * made on first use and then maintained incrementally as springs are added and
+ * removed, until the topology is cleared.  Bending elements are compliant angle
+ * constraints with compliance 1/k, colored the same way but from scratch whenever
+ * the topology version changes, as they are few and refer to particles by index.
+ * 
+ * See Macklin, Mueller, and Chentanez, "XPBD: Position-Based Simulation of 
+ * Compliant Constrained Dynamics", MIG 2016.
+ */
+class XPBDSolver : public TopologyListener {
+public:
+    /** Springs of each color */
+    std::vector<std::vector<Spring*>> colors;
+    /** Lagrange multipliers, parallel to colors */
+    std::vector<std::vector<Real>> lambda;
+    /** Color of each spring and its position in that color's list */
+    struct Slot {
+        int color;
+        int index;
+    };
+    std::unordered_map<Spring*, Slot> colorOf;
+    /** True while the coloring matches the topology, see color */
+    bool colored = false;
+    /** Bending element indices of each color, and their Lagrange multipliers */
+    std::vector<std::vector<int>> bendingColors;
+    std::vector<std::vector<Real>> bendingLambda;
+    /** Topology version of the bending coloring, or -1 */
+    int bendingVersion = -1;
+    /** Positions at the start of the step */
+    VectorXr xprev;
+
+    /**
+     * Greedy graph coloring of all the springs from scratch.
+     * @param springs
+     */
+    void color( std::vector<Spring*>& springs ) {
+        topologyCleared();
+        colored = true;
+        colorOf.reserve( springs.size() );
+        for ( Spring* s : springs ) {
+            springAdded( s );
+        }
+    }
+
+    /**
+     * Greedy graph coloring of the bending elements, so that no two elements of
+     * the same color share a particle
+     * @param elements
+     * @param n number of particles
+     */
+    void colorBending( const std::vector<BendingElement>& elements, int n ) {
+        bendingColors.clear();
+        bendingLambda.clear();
+        std::vector<std::vector<bool>> used;
+        for ( int k = 0; k < (int) elements.size(); k++ ) {
+            const BendingElement& e = elements[k];
+            size_t c = 0;
+            while ( c < used.size() && ( used[c][e.i0] || used[c][e.i1] || used[c][e.i2] ) ) c++;
+            if ( c == used.size() ) {
+                used.emplace_back( n, false );
+                bendingColors.emplace_back();
+                bendingLambda.emplace_back();
+            }
+            used[c][e.i0] = used[c][e.i1] = used[c][e.i2] = true;
+            bendingColors[c].push_back( k );
+            bendingLambda[c].push_back( 0 );
+        }
+    }
+
+    /**
+     * Gives the new spring the smallest color not already used by a spring 
+     * sharing one of its particles.
+     */
+    void springAdded( Spring* s ) {
+        if ( !colored ) return;
+        std::vector<bool> used( colors.size() + 1, false );
+        for ( Spring* o : s->p1->springs ) {
+            auto it = colorOf.find( o );
+            if ( it != colorOf.end() ) used[it->second.color] = true;
+        }
+        for ( Spring* o : s->p2->springs ) {
+            auto it = colorOf.find( o );
+            if ( it != colorOf.end() ) used[it->second.color] = true;
+        }
+        size_t c = 0;
+        while ( used[c] ) c++;
+        if ( c == colors.size() ) {
+            colors.emplace_back();
+            lambda.emplace_back();
+        }
+        colorOf[s] = Slot{ (int) c, (int) colors[c].size() };
+        colors[c].push_back( s );
+        lambda[c].push_back( 0 );
+    }
+
+    void springRemoved( Spring* s ) {
+        if ( !colored ) return;
+        auto it = colorOf.find( s );
+        if ( it == colorOf.end() ) return;
+        // swap with the last spring of the same color
+        Slot slot = it->second;
+        std::vector<Spring*>& list = colors[slot.color];
+        list[slot.index] = list.back();
+        colorOf[list[slot.index]].index = slot.index;
+        list.pop_back();
+        lambda[slot.color].pop_back();
+        colorOf.erase( s );
+        while ( !colors.empty() && colors.back().empty() ) {
+            colors.pop_back();
+            lambda.pop_back();
+        }
+    }
+
+    void particleAdded( Particle* p ) {
+        // nothing to do, springs read particle indices when projected
+    }
+
+    void particleRemoved( int index, int last ) {
+        // nothing to do, springs read particle indices when projected
+    }
+
+    void topologyCleared() {
+        colors.clear();
+        lambda.clear();
+        colorOf.clear();
+        colored = false;
+    }
+
+    /**
+     * Advances positions and velocities by h.  External forces are applied in
+     * the prediction, then the spring and bending constraints are projected.
+     * @param bending bending elements, colored by colorBending
+     * @param x positions (x and y interleaved per particle)
+     * @param v velocities
+     * @param w inverse masses, zero for pinned particles
+     * @param fext external forces (gravity, viscous damping)
+     * @param h step size
+     * @param iterations number of Gauss-Seidel sweeps over all colors
+     */
+    void step( const std::vector<BendingElement>& bending, VectorXr& x, VectorXr& v, const VectorXr& w, const VectorXr& fext, Real h, int iterations ) {
+        int n = w.size();
+        xprev = x;
+        for ( int i = 0; i < n; i++ ) {
+            v[2 * i] += h * w[i] * fext[2 * i];
+            v[2 * i + 1] += h * w[i] * fext[2 * i + 1];
+            x[2 * i] += h * v[2 * i];
+            x[2 * i + 1] += h * v[2 * i + 1];
+        }
+        for ( std::vector<Real>& l : lambda ) {
+            std::fill( l.begin(), l.end(), Real( 0 ) );
+        }
+        for ( std::vector<Real>& l : bendingLambda ) {
+            std::fill( l.begin(), l.end(), Real( 0 ) );
+        }
+        for ( int it = 0; it < iterations; it++ ) {
+            for ( size_t c = 0; c < colors.size(); c++ ) {
+                std::vector<Spring*>& list = colors[c];
+                Real* lc = lambda[c].data();
+                int m = list.size();
+                #pragma omp parallel for
+                for ( int k = 0; k < m; k++ ) {
+                    project( list[k], lc[k], x, w, h );
+                }
+            }
+            for ( size_t c = 0; c < bendingColors.size(); c++ ) {
+                const std::vector<int>& list = bendingColors[c];
+                Real* lc = bendingLambda[c].data();
+                int m = list.size();
+                #pragma omp parallel for
+                for ( int k = 0; k < m; k++ ) {
+                    project( bending[list[k]], lc[k], x, w, h );
+                }
+            }
+        }
+        Real ih = 1 / h;
+        for ( int i = 0; i < 2 * n; i++ ) {
+            v[i] = ( x[i] - xprev[i] ) * ih;
+        }
+    }
+
+private:
+    /**
+     * Projects one distance constraint, with damping along the spring as in
+     * equation 26 of the XPBD paper.
+     */
+    void project( Spring* s, Real& lambda, VectorXr& x, const VectorXr& w, Real h ) {
+        if ( s->k <= 0 ) return;
+        int a = s->p1->index;
+        int b = s->p2->index;
+        Real wsum = w[a] + w[b];
+        if ( wsum == 0 ) return;
+        Real dx = x[2 * a] - x[2 * b];
+        Real dy = x[2 * a + 1] - x[2 * b + 1];
+        Real l = sqrt( dx * dx + dy * dy );
+        if ( l == 0 ) return;
+        Real nx = dx / l;
+        Real ny = dy / l;
+        Real C = l - (Real) s->l0;
+        Real compliance = 1 / s->k;
+        Real alpha = compliance / ( h * h );
+        Real gamma = compliance * s->c / h;
+        // constraint velocity times h, i.e., grad C . (x - xprev)
+        Real dC = nx * ( x[2 * a] - xprev[2 * a] - x[2 * b] + xprev[2 * b] )
+                 + ny * ( x[2 * a + 1] - xprev[2 * a + 1] - x[2 * b + 1] + xprev[2 * b + 1] );
+        Real dlambda = ( -C - alpha * lambda - gamma * dC ) / ( ( 1 + gamma ) * wsum + alpha );
+        lambda += dlambda;
+        x[2 * a] += w[a] * dlambda * nx;
+        x[2 * a + 1] += w[a] * dlambda * ny;
+        x[2 * b] -= w[b] * dlambda * nx;
+        x[2 * b + 1] -= w[b] * dlambda * ny;
+    }
+
+    /**
+     * Projects one angle constraint C = theta - theta0, with damping of the angle
+     * rate in the same way as for springs
+     */
+    void project( const BendingElement& e, Real& lambda, VectorXr& x, const VectorXr& w, Real h ) {
+        if ( e.k <= 0 ) return;
+        int idx[3] = { e.i0, e.i1, e.i2 };
+        BendingElement::Vec2 xs[3], g[3];
+        for ( int a = 0; a < 3; a++ ) xs[a] = BendingElement::Vec2( x[2 * idx[a]], x[2 * idx[a] + 1] );
+        Real C = e.angleError( BendingElement::gradient( xs, g ) );
+        Real wsum = 0;
+        Real dC = 0;
+        for ( int a = 0; a < 3; a++ ) {
+            int i = idx[a];
+            wsum += w[i] * ( g[a].x * g[a].x + g[a].y * g[a].y );
+            dC += g[a].x * ( x[2 * i] - xprev[2 * i] ) + g[a].y * ( x[2 * i + 1] - xprev[2 * i + 1] );
+        }
+        if ( wsum == 0 ) return;
+        Real compliance = 1 / (Real) e.k;
+        Real alpha = compliance / ( h * h );
+        Real gamma = compliance * (Real) e.c / h;
+        Real dlambda = ( -C - alpha * lambda - gamma * dC ) / ( ( 1 + gamma ) * wsum + alpha );
+        lambda += dlambda;
+        for ( int a = 0; a < 3; a++ ) {
+            int i = idx[a];
+            x[2 * i] += w[i] * dlambda * g[a].x;
+            x[2 * i + 1] += w[i] * dlambda * g[a].y;
+        }
+    }
+};
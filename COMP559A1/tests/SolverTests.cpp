@@ -0,0 +1,248 @@
+#include <cstdio>
+#include <cmath>
+#include <random>
+#include <vector>
+#include <algorithm>
+
+#include "ParticleSystem.hpp"
+#include "Benchmark.hpp"
+
+/**
+ * Checks of the implicit solvers that need no window, run by ctest.  Each check
+ * prints its measured error and whether it passed, and the program returns the
+ * number of failed checks.
+ * @author kry
+ */
+
+static int failures = 0;
+
+/**
+ * Prints the result of a check and counts it if it failed
+ * @param name
+ * @param value measured quantity
+ * @param pass
+ */
+static void report( const char* name, double value, bool pass ) {
+    printf( "%-40s %12.4g  %s\n", name, value, pass ? "pass" : "FAIL" );
+    if ( !pass ) failures++;
+}
+
+/**
+ * Largest distance between corresponding particles of two systems
+ */
+static double maxDistance( ParticleSystem& a, ParticleSystem& b ) {
+    double d = 0;
+    for ( size_t i = 0; i < a.particles.size(); i++ ) {
+        d = std::max( d, (double) glm::length( a.particles[i]->p - b.particles[i]->p ) );
+    }
+    return d;
+}
+
+/**
+ * Sets up a hanging cloth stepped implicitly, with walls far enough to never be touched
+ */
+static void setupCloth( ParticleSystem& system, Integrator& integrator, int n, float spacing ) {
+    system.width = system.height = 100000;
+    system.integrator = &integrator;
+    Benchmark::createCloth( system, n, n, spacing );
+    system.useExplicitIntegration = false;
+}
+
+/**
+ * Compares the bending stiffness and damping blocks with central differences of the
+ * bending force.  The stiffness blocks keep only the k grad grad^T term of the energy
+ * Hessian, so they are compared at the rest angle, where that is the whole Hessian, 
+ * and are checked to be negative semidefinite in a bent configuration.  The damping
+ * blocks are compared with the force of a bent and moving element.
+ */
+static void testBendingHessian() {
+    typedef BendingElementT<DoublePrecision> Element;
+    typedef ParticleT<DoublePrecision> Particle;
+    Particle p0( 0, 0, 0, 0 ), p1( 1, 0.2, 0, 0 ), p2( 1.5, 1, 0, 0 );
+    p0.index = 0;
+    p1.index = 1;
+    p2.index = 2;
+    Element e( &p0, &p1, &p2 );
+    e.k = 3;
+    e.c = 0.7;
+    Eigen::VectorXd x( 6 ), v( 6 );
+    x << 0.1, -0.2, 1.1, 0.3, 1.4, 1.2;
+    std::mt19937 random( 1 );
+    std::uniform_real_distribution<double> uniform( -1, 1 );
+    for ( int i = 0; i < 6; i++ ) v[i] = uniform( random );
+
+    BlockSparseMatrixT<double> bent, rest, D;
+    for ( BlockSparseMatrixT<double>* M : { &bent, &rest, &D } ) {
+        for ( int i = 0; i < 3; i++ ) M->addRow();
+        M->addPair( 0, 1 );
+        M->addPair( 1, 2 );
+        M->addPair( 0, 2 );
+        M->setZero();
+    }
+    e.addDfdx( x, bent );
+    e.addDfdv( x, D );
+    Eigen::MatrixXd dense( 6, 6 );
+    for ( int i = 0; i < 6; i++ ) {
+        for ( int j = 0; j < 6; j++ ) dense( i, j ) = bent.block( i / 2, j / 2 ).m[( i % 2 ) * 2 + j % 2];
+    }
+    double largest = Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd>( dense ).eigenvalues().maxCoeff();
+    Element::Vec2 xs[3] = { Element::Vec2( x[0], x[1] ), Element::Vec2( x[2], x[3] ), Element::Vec2( x[4], x[5] ) };
+    Element::Vec2 g[3];
+    double bentTheta0 = e.theta0;
+    e.theta0 = Element::gradient( xs, g );
+    e.addDfdx( x, rest );
+
+    const double delta = 1e-6;
+    Eigen::VectorXd zero = Eigen::VectorXd::Zero( 6 );
+    double stiffnessError = 0;
+    for ( int j = 0; j < 6; j++ ) {
+        Eigen::VectorXd xp = x, xm = x;
+        xp[j] += delta;
+        xm[j] -= delta;
+        Eigen::VectorXd fp = Eigen::VectorXd::Zero( 6 ), fm = fp;
+        e.addForce( xp, zero, fp );
+        e.addForce( xm, zero, fm );
+        for ( int i = 0; i < 6; i++ ) {
+            stiffnessError = std::max( stiffnessError, std::abs( ( fp[i] - fm[i] ) / ( 2 * delta ) - rest.block( i / 2, j / 2 ).m[( i % 2 ) * 2 + j % 2] ) );
+        }
+    }
+    e.theta0 = bentTheta0;
+    double dampingError = 0;
+    for ( int j = 0; j < 6; j++ ) {
+        Eigen::VectorXd vp = v, vm = v;
+        vp[j] += delta;
+        vm[j] -= delta;
+        Eigen::VectorXd fp = Eigen::VectorXd::Zero( 6 ), fm = fp;
+        e.addForce( x, vp, fp );
+        e.addForce( x, vm, fm );
+        for ( int i = 0; i < 6; i++ ) {
+            dampingError = std::max( dampingError, std::abs( ( fp[i] - fm[i] ) / ( 2 * delta ) - D.block( i / 2, j / 2 ).m[( i % 2 ) * 2 + j % 2] ) );
+        }
+    }
+    report( "bending stiffness vs finite differences", stiffnessError, stiffnessError < 1e-6 );
+    report( "bent stiffness largest eigenvalue", largest, largest < 1e-12 );
+    report( "bending damping vs finite differences", dampingError, dampingError < 1e-6 );
+}
+
+/**
+ * Swings a chain with stiff bending elements with large backward Euler steps, and 
+ * checks that every CG solve reaches its tolerance, which needs the implicit system
+ * matrix to stay positive definite while the chain bends far from its rest angles
+ */
+static void testBentChain() {
+    SymplecticEuler integrator;
+    ParticleSystem system;
+    system.width = system.height = 100000;
+    system.integrator = &integrator;
+    system.createSystem( 3 );
+    system.useExplicitIntegration = false;
+    system.bendingStiffness = 1e5;
+    system.solverIterations = 1000;
+    system.solverTolerance = 1e-6;
+    system.linearSolver = ParticleSystem::CONJUGATE_GRADIENT;
+    for ( Particle* p : system.particles ) {
+        if ( !p->pinned ) p->v = glm::vec2( p->p0.y, -p->p0.x ) * 5.0f;
+    }
+    system.stateChanged();
+    double residual = 0;
+    for ( int i = 0; i < 200; i++ ) {
+        system.advance( 0.05f, 1 );
+        residual = std::max( residual, (double) system.CG.residual );
+    }
+    report( "bent chain largest CG residual", residual, residual <= system.solverTolerance );
+}
+
+/**
+ * Steps the same cloth with conjugate gradients at a tight tolerance and with the
+ * sparse direct solver, through pinning, spring removal, and particle removal, for
+ * each implicit solver that uses the linear solvers
+ */
+static void testDirectVersusCG() {
+    SymplecticEuler integrator;
+    ParticleSystem::ImplicitSolver solvers[] = { ParticleSystem::BACKWARD_EULER, ParticleSystem::IMPLICIT_MIDPOINT, ParticleSystem::BDF2 };
+    const char* names[] = { "direct vs CG, backward Euler", "direct vs CG, implicit midpoint", "direct vs CG, BDF2" };
+    for ( int s = 0; s < 3; s++ ) {
+        ParticleSystem cg, direct;
+        ParticleSystem* systems[] = { &cg, &direct };
+        for ( ParticleSystem* system : systems ) {
+            setupCloth( *system, integrator, 20, 1 );
+            system->springStiffness = 1e4;
+            system->implicitSolver = solvers[s];
+            system->solverIterations = 100000;
+            system->solverTolerance = 1e-10;
+        }
+        cg.linearSolver = ParticleSystem::CONJUGATE_GRADIENT;
+        direct.linearSolver = ParticleSystem::SPARSE_DIRECT;
+        double d = 0;
+        for ( int step = 0; step < 30; step++ ) {
+            for ( ParticleSystem* system : systems ) {
+                if ( step == 10 ) system->particles[200]->pinned = true;
+                if ( step == 20 ) system->removeSpring( system->springs[100] );
+                if ( step == 25 ) system->remove( system->particles[150] );
+                system->advance( 0.01f, 1 );
+            }
+            d = std::max( d, maxDistance( cg, direct ) );
+        }
+        report( names[s], d, direct.usedDirectSolver && d < 1e-6 );
+    }
+}
+
+/**
+ * Estimates the order of BDF2 from the errors at a fixed time with two step sizes,
+ * against a solution with a much smaller step
+ */
+static void testBDF2Order() {
+    SymplecticEuler integrator;
+    const float total = 0.64f;
+    const int steps[] = { 64, 128, 4096 };
+    ParticleSystem systems[3];
+    for ( int i = 0; i < 3; i++ ) {
+        setupCloth( systems[i], integrator, 6, 10 );
+        systems[i].springStiffness = 100;
+        systems[i].implicitSolver = ParticleSystem::BDF2;
+        systems[i].linearSolver = ParticleSystem::SPARSE_DIRECT;
+        for ( int k = 0; k < steps[i]; k++ ) systems[i].advance( total / steps[i], 1 );
+    }
+    double coarse = maxDistance( systems[0], systems[2] );
+    double fine = maxDistance( systems[1], systems[2] );
+    double order = std::log2( coarse / fine );
+    report( "BDF2 order", order, order > 1.8 && order < 2.5 );
+}
+
+/**
+ * Takes the same Newton backward Euler step from a uniformly stretched cloth with an
+ * increasing number of iterations, and checks that the residual drops quickly.  With
+ * every spring stretched and no damping the Jacobians are exact, so that convergence
+ * is quadratic until the residual reaches the accuracy of the linear solve.
+ */
+static void testNewtonResidual() {
+    SymplecticEuler integrator;
+    std::vector<double> residuals;
+    for ( int iterations = 0; iterations <= 4; iterations++ ) {
+        ParticleSystem system;
+        setupCloth( system, integrator, 10, 5 );
+        system.springStiffness = 1e4;
+        system.useNewton = true;
+        system.newtonMaxIterations = iterations;
+        system.newtonTolerance = 0;
+        system.linearSolver = ParticleSystem::SPARSE_DIRECT;
+        for ( Particle* p : system.particles ) p->p *= 1.2f;
+        system.stateChanged();
+        system.advance( 0.02f, 1 );
+        residuals.push_back( system.newtonResidual.norm() );
+    }
+    bool decreasing = true;
+    for ( int i = 1; i < (int) residuals.size(); i++ ) decreasing = decreasing && residuals[i] < residuals[i - 1];
+    double drop = residuals.back() / residuals.front();
+    report( "Newton residual drop in 4 iterations", drop, decreasing && drop < 1e-8 );
+}
+
+int main() {
+    testBendingHessian();
+    testBentChain();
+    testDirectVersusCG();
+    testBDF2Order();
+    testNewtonResidual();
+    printf( "%d failed\n", failures );
+    return failures;
+}